@@ -0,0 +1,94 @@
+/* Microbenchmark for the browser audio mixing kernels.
+ *
+ * Mixes a number of synthetic streams into a stereo output the way
+ * BrowserSource::AudioMix does, with both the plain add loop the mixer
+ * used to use and the SIMD kernels, and prints the time per audio tick. */
+
+#include "browser-audio-mix.hpp"
+
+#include <stdio.h>
+#include <string.h>
+#include <chrono>
+#include <vector>
+
+#define FRAMES 1024
+#define CHANNELS 2
+#define ITERATIONS 200000
+
+static void mix_scalar(float *out, const float *in, size_t count)
+{
+	for (size_t i = 0; i < count; i++)
+		out[i] += in[i];
+}
+
+typedef void (*mix_func)(float *out, const std::vector<const float *> &in);
+
+static void mix_streams_scalar(float *out, const std::vector<const float *> &in)
+{
+	for (const float *stream : in)
+		mix_scalar(out, stream, FRAMES);
+}
+
+static void mix_streams_simd(float *out, const std::vector<const float *> &in)
+{
+	if (in.size() == 1)
+		memcpy(out, in[0], FRAMES * sizeof(float));
+	else
+		mix_audio_multi(out, in.data(), in.size(), FRAMES);
+}
+
+static double run(mix_func func, size_t num_streams, float *checksum)
+{
+	std::vector<std::vector<float>> streams(num_streams * CHANNELS);
+	for (size_t i = 0; i < streams.size(); i++) {
+		streams[i].resize(FRAMES);
+		for (size_t j = 0; j < FRAMES; j++)
+			streams[i][j] = (float)((i * 31 + j) % 97) / 97.0f;
+	}
+
+	std::vector<float> out(FRAMES * CHANNELS);
+	std::vector<const float *> in(num_streams);
+
+	auto start = std::chrono::steady_clock::now();
+
+	for (int iter = 0; iter < ITERATIONS; iter++) {
+		memset(out.data(), 0, out.size() * sizeof(float));
+
+		for (size_t ch = 0; ch < CHANNELS; ch++) {
+			for (size_t s = 0; s < num_streams; s++)
+				in[s] = streams[s * CHANNELS + ch].data();
+			func(out.data() + ch * FRAMES, in);
+		}
+	}
+
+	auto end = std::chrono::steady_clock::now();
+
+	/* keeps the compiler from throwing the work away */
+	float sum = 0.0f;
+	for (float f : out)
+		sum += f;
+	*checksum = sum;
+
+	return std::chrono::duration<double, std::nano>(end - start).count() /
+	       (double)ITERATIONS;
+}
+
+int main()
+{
+	static const size_t stream_counts[] = {1, 2, 4, 8};
+
+	printf("%-8s %14s %14s %9s\n", "streams", "scalar ns/tick",
+	       "simd ns/tick", "speedup");
+
+	for (size_t num_streams : stream_counts) {
+		float scalar_sum, simd_sum;
+		double scalar = run(mix_streams_scalar, num_streams, &scalar_sum);
+		double simd = run(mix_streams_simd, num_streams, &simd_sum);
+
+		printf("%-8zu %14.1f %14.1f %8.2fx%s\n", num_streams, scalar,
+		       simd, scalar / simd,
+		       scalar_sum == simd_sum ? "" : "  (output mismatch!)");
+	}
+
+	return 0;
+}
@@ -0,0 +1,520 @@
+/* End to end benchmark for browser sources.
+ *
+ * Starts libobs without a frontend, loads the browser plugin, and renders
+ * 1, 10 and 50 browser sources showing synthetic pages through the main
+ * output.  The paint, upload and present numbers come from the plugin's
+ * own obs_browser_get_stats proc, CPU time and RSS of the renderer
+ * processes are read from the OS.  Results are printed as JSON, so they
+ * can be compared across builds.
+ *
+ *   obs-browser-bench --plugin <obs-browser module> --data <plugin data>
+ *                     [--duration <seconds>] [--counts 1,10,50]
+ *                     [--output <file>] */
+
+#include <obs.h>
+#include <util/platform.h>
+#include "json11/json11.hpp"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <vector>
+#include <set>
+
+#ifdef _WIN32
+#include <windows.h>
+#include <psapi.h>
+#else
+#include <sys/resource.h>
+#include <unistd.h>
+#endif
+
+using namespace json11;
+
+#define BENCH_WIDTH 1920
+#define BENCH_HEIGHT 1080
+#define WARMUP_SECONDS 3
+
+struct Scenario {
+	const char *name;
+	const char *html;
+	bool audio;
+};
+
+static const Scenario scenarios[] = {
+	{"static",
+	 "<body style=\"margin:0;background:rgb(32,48,64);color:white;"
+	 "font:64px sans-serif\">static page</body>",
+	 false},
+	{"animation",
+	 "<body style=\"margin:0;overflow:hidden\">"
+	 "<canvas id=\"c\" width=\"1920\" height=\"1080\"></canvas><script>"
+	 "let ctx = document.getElementById('c').getContext('2d');"
+	 "function draw(t) {"
+	 "ctx.fillStyle = 'hsl(' + (t / 10) % 360 + ', 80%, 50%)';"
+	 "ctx.fillRect(0, 0, 1920, 1080);"
+	 "requestAnimationFrame(draw);"
+	 "}"
+	 "requestAnimationFrame(draw);"
+	 "</script></body>",
+	 false},
+	{"dirty-region",
+	 "<body style=\"margin:0;background:rgb(32,48,64)\">"
+	 "<div id=\"d\" style=\"position:absolute;width:64px;height:64px;"
+	 "background:white\"></div><script>"
+	 "let d = document.getElementById('d');"
+	 "function move(t) {"
+	 "d.style.left = (100 + (t / 5) % 200) + 'px';"
+	 "d.style.top = '100px';"
+	 "requestAnimationFrame(move);"
+	 "}"
+	 "requestAnimationFrame(move);"
+	 "</script></body>",
+	 false},
+	{"audio-tone",
+	 "<body style=\"margin:0;background:black\"><script>"
+	 "let ac = new AudioContext();"
+	 "let osc = ac.createOscillator();"
+	 "osc.frequency.value = 440;"
+	 "osc.connect(ac.destination);"
+	 "osc.start();"
+	 "</script></body>",
+	 true},
+};
+
+/* ------------------------------------------------------------------------- */
+
+struct ProcessSample {
+	double cpu_seconds = 0.0;
+	double rss_mb = 0.0;
+};
+
+#ifdef _WIN32
+static double filetime_seconds(const FILETIME &ft)
+{
+	ULARGE_INTEGER val;
+	val.LowPart = ft.dwLowDateTime;
+	val.HighPart = ft.dwHighDateTime;
+	return (double)val.QuadPart / 10000000.0;
+}
+
+static bool sample_handle(HANDLE process, ProcessSample &sample)
+{
+	FILETIME creation, exit, kernel, user;
+	if (!GetProcessTimes(process, &creation, &exit, &kernel, &user))
+		return false;
+
+	PROCESS_MEMORY_COUNTERS pmc = {};
+	GetProcessMemoryInfo(process, &pmc, sizeof(pmc));
+
+	sample.cpu_seconds = filetime_seconds(kernel) + filetime_seconds(user);
+	sample.rss_mb = (double)pmc.WorkingSetSize / (1024.0 * 1024.0);
+	return true;
+}
+
+static bool sample_process(int pid, ProcessSample &sample)
+{
+	HANDLE process = OpenProcess(PROCESS_QUERY_LIMITED_INFORMATION, false,
+				     (DWORD)pid);
+	if (!process)
+		return false;
+
+	bool success = sample_handle(process, sample);
+	CloseHandle(process);
+	return success;
+}
+
+static ProcessSample sample_self(void)
+{
+	ProcessSample sample;
+	sample_handle(GetCurrentProcess(), sample);
+	return sample;
+}
+
+#elif defined(__linux__)
+static bool sample_process(int pid, ProcessSample &sample)
+{
+	char path[64];
+	snprintf(path, sizeof(path), "/proc/%d/stat", pid);
+
+	FILE *f = fopen(path, "r");
+	if (!f)
+		return false;
+
+	char buf[1024];
+	size_t len = fread(buf, 1, sizeof(buf) - 1, f);
+	fclose(f);
+	buf[len] = 0;
+
+	/* the process name can contain spaces, fields are counted from
+	 * after it */
+	const char *p = strrchr(buf, ')');
+	if (!p)
+		return false;
+
+	unsigned long utime = 0, stime = 0;
+	long rss = 0;
+	if (sscanf(p + 2,
+		   "%*s %*s %*s %*s %*s %*s %*s %*s %*s %*s %*s %lu %lu "
+		   "%*s %*s %*s %*s %*s %*s %*s %*s %ld",
+		   &utime, &stime, &rss) != 3)
+		return false;
+
+	double ticks = (double)sysconf(_SC_CLK_TCK);
+	double page = (double)sysconf(_SC_PAGESIZE);
+	sample.cpu_seconds = (double)(utime + stime) / ticks;
+	sample.rss_mb = (double)rss * page / (1024.0 * 1024.0);
+	return true;
+}
+
+static ProcessSample sample_self(void)
+{
+	ProcessSample sample;
+	sample_process((int)getpid(), sample);
+	return sample;
+}
+
+#else
+static bool sample_process(int, ProcessSample &)
+{
+	return false;
+}
+
+static ProcessSample sample_self(void)
+{
+	ProcessSample sample;
+	struct rusage usage;
+	if (getrusage(RUSAGE_SELF, &usage) == 0) {
+		sample.cpu_seconds =
+			(double)usage.ru_utime.tv_sec +
+			(double)usage.ru_utime.tv_usec / 1000000.0 +
+			(double)usage.ru_stime.tv_sec +
+			(double)usage.ru_stime.tv_usec / 1000000.0;
+	}
+	return sample;
+}
+#endif
+
+/* ------------------------------------------------------------------------- */
+
+static std::string url_encode(const char *str)
+{
+	static const char hex[] = "0123456789ABCDEF";
+	std::string out;
+
+	for (; *str; str++) {
+		unsigned char ch = (unsigned char)*str;
+		bool plain = (ch >= 'a' && ch <= 'z') ||
+			     (ch >= 'A' && ch <= 'Z') ||
+			     (ch >= '0' && ch <= '9') || ch == '-' ||
+			     ch == '_' || ch == '.' || ch == '~';
+		if (plain) {
+			out += (char)ch;
+		} else {
+			out += '%';
+			out += hex[ch >> 4];
+			out += hex[ch & 0xF];
+		}
+	}
+
+	return out;
+}
+
+static Json get_stats(void)
+{
+	calldata_t cd = {0};
+	proc_handler_call(obs_get_proc_handler(), "obs_browser_get_stats",
+			  &cd);
+
+	const char *json = calldata_string(&cd, "json");
+	std::string err;
+	Json stats = Json::parse(json ? json : "", err);
+	calldata_free(&cd);
+	return stats;
+}
+
+struct Snapshot {
+	uint64_t ns;
+	Json stats;
+	ProcessSample self;
+	double renderer_cpu_seconds = 0.0;
+	double renderer_rss_mb = 0.0;
+	int renderer_processes = 0;
+};
+
+static Snapshot take_snapshot(void)
+{
+	Snapshot snap;
+	snap.ns = os_gettime_ns();
+	snap.stats = get_stats();
+	snap.self = sample_self();
+
+	/* sources can share a renderer process */
+	std::set<int> pids;
+	for (const Json &source : snap.stats["sources"].array_items()) {
+		int pid = source["rendererPid"].int_value();
+		if (pid)
+			pids.insert(pid);
+	}
+
+	for (int pid : pids) {
+		ProcessSample sample;
+		if (!sample_process(pid, sample))
+			continue;
+
+		snap.renderer_cpu_seconds += sample.cpu_seconds;
+		snap.renderer_rss_mb += sample.rss_mb;
+		snap.renderer_processes++;
+	}
+
+	return snap;
+}
+
+static double sum_of(const Json &stats, const char *key)
+{
+	double total = 0.0;
+	for (const Json &source : stats["sources"].array_items())
+		total += source[key].number_value();
+	return total;
+}
+
+static double max_of(const Json &stats, const char *key)
+{
+	double val = 0.0;
+	for (const Json &source : stats["sources"].array_items())
+		if (source[key].number_value() > val)
+			val = source[key].number_value();
+	return val;
+}
+
+static double task_wait_ns(const Json &stats)
+{
+	return stats["tasks"].number_value() *
+	       stats["taskWaitAverageMs"].number_value() * 1000000.0;
+}
+
+static Json run(const Scenario &scenario, int count, int duration)
+{
+	std::string url = std::string("data:text/html,") +
+			  url_encode(scenario.html);
+
+	obs_scene_t *scene = obs_scene_create_private("bench");
+	std::vector<obs_source_t *> sources;
+
+	for (int i = 0; i < count; i++) {
+		obs_data_t *settings = obs_data_create();
+		obs_data_set_string(settings, "url", url.c_str());
+		obs_data_set_int(settings, "width", BENCH_WIDTH);
+		obs_data_set_int(settings, "height", BENCH_HEIGHT);
+		obs_data_set_bool(settings, "reroute_audio", scenario.audio);
+
+		std::string name = std::string(scenario.name) + " " +
+				   std::to_string(i + 1);
+		obs_source_t *source = obs_source_create_private(
+			"browser_source", name.c_str(), settings);
+		obs_data_release(settings);
+
+		if (!source)
+			continue;
+
+		obs_scene_add(scene, source);
+		sources.push_back(source);
+	}
+
+	obs_set_output_source(0, obs_scene_get_source(scene));
+
+	os_sleep_ms(WARMUP_SECONDS * 1000);
+	Snapshot start = take_snapshot();
+	os_sleep_ms((uint32_t)duration * 1000);
+	Snapshot end = take_snapshot();
+
+	obs_set_output_source(0, nullptr);
+	obs_scene_release(scene);
+	for (obs_source_t *source : sources) {
+		obs_source_remove(source);
+		obs_source_release(source);
+	}
+
+	/* gives the browsers time to close before the next run */
+	os_sleep_ms(2000);
+
+	double seconds = (double)(end.ns - start.ns) / 1000000000.0;
+	double paints = sum_of(end.stats, "paints") - sum_of(start.stats, "paints");
+	double upload = sum_of(end.stats, "uploadBytes") -
+			sum_of(start.stats, "uploadBytes");
+	double presents = sum_of(end.stats, "presents") -
+			  sum_of(start.stats, "presents");
+	double tasks = end.stats["tasks"].number_value() -
+		       start.stats["tasks"].number_value();
+	double wait_ns = task_wait_ns(end.stats) - task_wait_ns(start.stats);
+
+	/* the latency average is cumulative per source, weighing it by the
+	 * presents of each source keeps the warmup out of it */
+	double latency_ms = 0.0;
+	for (const Json &source : end.stats["sources"].array_items())
+		latency_ms += source["presentLatencyAverageMs"].number_value() *
+			      source["presents"].number_value();
+	for (const Json &source : start.stats["sources"].array_items())
+		latency_ms -= source["presentLatencyAverageMs"].number_value() *
+			      source["presents"].number_value();
+
+	double obs_cpu = end.self.cpu_seconds - start.self.cpu_seconds;
+	double renderer_cpu =
+		end.renderer_cpu_seconds - start.renderer_cpu_seconds;
+	int created = (int)sources.size();
+
+	return Json::object{
+		{"scenario", scenario.name},
+		{"sources", created},
+		{"seconds", seconds},
+		{"paintsPerSecondPerSource",
+		 created ? paints / seconds / created : 0.0},
+		{"uploadMBPerSecond", upload / seconds / (1024.0 * 1024.0)},
+		{"presentLatencyAverageMs",
+		 presents > 0.0 ? latency_ms / presents : 0.0},
+		{"presentLatencyMaxMs", max_of(end.stats, "presentLatencyMaxMs")},
+		{"droppedFrames", sum_of(end.stats, "droppedFrames") -
+					  sum_of(start.stats, "droppedFrames")},
+		{"audioUnderruns", sum_of(end.stats, "audioUnderruns") -
+					   sum_of(start.stats, "audioUnderruns")},
+		{"obsCpuPercent", obs_cpu / seconds * 100.0},
+		{"rendererCpuPercent", renderer_cpu / seconds * 100.0},
+		{"cpuPercentPerSource",
+		 created ? (obs_cpu + renderer_cpu) / seconds * 100.0 / created
+			 : 0.0},
+		{"rendererProcesses", end.renderer_processes},
+		{"rendererRssMB", end.renderer_rss_mb},
+		{"obsRssMB", end.self.rss_mb},
+		{"cefTasks", tasks},
+		{"cefTaskWaitAverageMs",
+		 tasks > 0.0 ? wait_ns / tasks / 1000000.0 : 0.0},
+		{"firstFrameMaxMs", max_of(end.stats, "firstFrameMs")},
+	};
+}
+
+/* ------------------------------------------------------------------------- */
+
+static bool start_obs(void)
+{
+	if (!obs_startup("en-US", nullptr, nullptr))
+		return false;
+
+	struct obs_video_info ovi = {};
+#ifdef _WIN32
+	ovi.graphics_module = "libobs-d3d11";
+#else
+	ovi.graphics_module = "libobs-opengl";
+#endif
+	ovi.fps_num = 60;
+	ovi.fps_den = 1;
+	ovi.base_width = BENCH_WIDTH;
+	ovi.base_height = BENCH_HEIGHT;
+	ovi.output_width = BENCH_WIDTH;
+	ovi.output_height = BENCH_HEIGHT;
+	ovi.output_format = VIDEO_FORMAT_NV12;
+	ovi.colorspace = VIDEO_CS_709;
+	ovi.range = VIDEO_RANGE_PARTIAL;
+	ovi.scale_type = OBS_SCALE_BICUBIC;
+	ovi.gpu_conversion = true;
+	if (obs_reset_video(&ovi) != OBS_VIDEO_SUCCESS)
+		return false;
+
+	struct obs_audio_info oai = {};
+	oai.samples_per_sec = 48000;
+	oai.speakers = SPEAKERS_STEREO;
+	return obs_reset_audio(&oai);
+}
+
+static void usage(void)
+{
+	fprintf(stderr,
+		"usage: obs-browser-bench --plugin <module> --data <dir> "
+		"[--duration <seconds>] [--counts 1,10,50] "
+		"[--output <file>]\n");
+}
+
+int main(int argc, char *argv[])
+{
+	const char *plugin = nullptr;
+	const char *data = nullptr;
+	const char *output = nullptr;
+	std::string counts_str = "1,10,50";
+	int duration = 10;
+
+	for (int i = 1; i < argc; i++) {
+		bool has_val = i + 1 < argc;
+		if (strcmp(argv[i], "--plugin") == 0 && has_val)
+			plugin = argv[++i];
+		else if (strcmp(argv[i], "--data") == 0 && has_val)
+			data = argv[++i];
+		else if (strcmp(argv[i], "--output") == 0 && has_val)
+			output = argv[++i];
+		else if (strcmp(argv[i], "--counts") == 0 && has_val)
+			counts_str = argv[++i];
+		else if (strcmp(argv[i], "--duration") == 0 && has_val)
+			duration = atoi(argv[++i]);
+		else {
+			usage();
+			return 1;
+		}
+	}
+
+	if (!plugin || !data || duration <= 0) {
+		usage();
+		return 1;
+	}
+
+	std::vector<int> counts;
+	for (const char *p = counts_str.c_str(); *p;) {
+		int count = atoi(p);
+		if (count > 0)
+			counts.push_back(count);
+		p = strchr(p, ',');
+		if (!p)
+			break;
+		p++;
+	}
+
+	if (!start_obs()) {
+		fprintf(stderr, "failed to start libobs\n");
+		return 1;
+	}
+
+	obs_module_t *module = nullptr;
+	if (obs_open_module(&module, plugin, data) != MODULE_SUCCESS ||
+	    !obs_init_module(module)) {
+		fprintf(stderr, "failed to load %s\n", plugin);
+		obs_shutdown();
+		return 1;
+	}
+
+	Json::array results;
+	for (const Scenario &scenario : scenarios) {
+		for (int count : counts) {
+			fprintf(stderr, "running %s with %d sources\n",
+				scenario.name, count);
+			results.push_back(run(scenario, count, duration));
+		}
+	}
+
+	obs_shutdown();
+
+	std::string json = Json(Json::object{
+					{"width", BENCH_WIDTH},
+					{"height", BENCH_HEIGHT},
+					{"results", results},
+				})
+				   .dump();
+
+	FILE *f = output ? fopen(output, "w") : stdout;
+	if (!f) {
+		fprintf(stderr, "failed to open %s\n", output);
+		return 1;
+	}
+
+	fprintf(f, "%s\n", json.c_str());
+	if (output)
+		fclose(f);
+	return 0;
+}
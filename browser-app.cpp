@@ -19,15 +19,20 @@
 #include "browser-app.hpp"
 #include "browser-version.h"
 #include <json11/json11.hpp>
+#include <algorithm>
 
 #ifdef _WIN32
 #include <windows.h>
+#else
+#include <unistd.h>
 #endif
 
 #ifdef USE_QT_LOOP
 #include <util/base.h>
 #include <util/platform.h>
 #include <util/threading.h>
+#include <inttypes.h>
+#include <limits.h>
 #include <QTimer>
 #endif
 
@@ -103,10 +108,49 @@ void BrowserApp::OnBeforeCommandLineProcessing(
 
 	command_line->AppendSwitchWithValue("autoplay-policy",
 					    "no-user-gesture-required");
+
+	/* by default every browser gets a renderer of its own, even when it
+	 * shows the same site as another one.  these let sources of the same
+	 * site share one, and put a cap on how many there can be. */
+	if (command_line->GetSwitchValue("type").empty()) {
+		if (process_per_site)
+			command_line->AppendSwitch("process-per-site");
+		if (renderer_process_limit > 0)
+			command_line->AppendSwitchWithValue(
+				"renderer-process-limit",
+				std::to_string(renderer_process_limit));
+
+		/* with more than one GPU, chromium would otherwise pick
+		 * its own, and textures shared from another adapter can't
+		 * be opened by OBS */
+		if (shared_texture_available && !adapter_luid.empty())
+			command_line->AppendSwitchWithValue("use-adapter-luid",
+							    adapter_luid);
+	}
+}
+
+#if CHROME_VERSION_BUILD >= 3770
+void BrowserApp::OnBrowserCreated(CefRefPtr<CefBrowser> browser,
+				  CefRefPtr<CefDictionaryValue> extra_info)
+{
+	if (!extra_info)
+		return;
+
+	PageInjection &injection = pageInjections[browser->GetIdentifier()];
+	injection.css = extra_info->GetString("css");
+	injection.script = extra_info->GetString("script");
+}
+#endif
+
+void BrowserApp::OnBrowserDestroyed(CefRefPtr<CefBrowser> browser)
+{
+	pageInjections.erase(browser->GetIdentifier());
+	contextFunctions.erase(browser->GetIdentifier());
+	eventListeners.erase(browser->GetIdentifier());
 }
 
 void BrowserApp::OnContextCreated(CefRefPtr<CefBrowser> browser,
-				  CefRefPtr<CefFrame>,
+				  CefRefPtr<CefFrame> frame,
 				  CefRefPtr<CefV8Context> context)
 {
 	CefRefPtr<CefV8Value> globalObj = context->GetGlobal();
@@ -135,12 +179,71 @@ void BrowserApp::OnContextCreated(CefRefPtr<CefBrowser> browser,
 	obsStudioObj->SetValue("saveReplayBuffer", saveReplayBuffer,
 			       V8_PROPERTY_ATTRIBUTE_NONE);
 
+	CefRefPtr<CefV8Value> subscribe =
+		CefV8Value::CreateFunction("subscribe", this);
+	obsStudioObj->SetValue("subscribe", subscribe,
+			       V8_PROPERTY_ATTRIBUTE_NONE);
+
+	CefRefPtr<CefV8Value> unsubscribe =
+		CefV8Value::CreateFunction("unsubscribe", this);
+	obsStudioObj->SetValue("unsubscribe", unsubscribe,
+			       V8_PROPERTY_ATTRIBUTE_NONE);
+
 #if !ENABLE_WASHIDDEN
 	int id = browser->GetIdentifier();
 	if (browserVis.find(id) != browserVis.end()) {
 		SetDocumentVisibility(browser, browserVis[id]);
 	}
 #endif
+
+	/* navigating can move the page to another renderer process, so this
+	 * is sent for every new main frame context rather than just once */
+	if (frame->IsMain()) {
+		CefRefPtr<CefProcessMessage> msg =
+			CefProcessMessage::Create("rendererInfo");
+#ifdef _WIN32
+		msg->GetArgumentList()->SetInt(0, (int)GetCurrentProcessId());
+#else
+		msg->GetArgumentList()->SetInt(0, (int)getpid());
+#endif
+		SendBrowserProcessMessage(browser, PID_BROWSER, msg);
+	}
+
+	/* a new page starts out without listeners.  the hook reports every
+	 * obs* event the page adds a listener for from now on. */
+	if (frame->IsMain()) {
+		eventListeners[browser->GetIdentifier()].clear();
+		SendEventListeners(browser);
+
+		context->Enter();
+
+		CefRefPtr<CefV8Value> hook =
+			GetContextFunctions(browser, context).listenerHook;
+		if (hook) {
+			CefV8ValueList args;
+			args.push_back(CefV8Value::CreateFunction(
+				"eventListenerAdded", this));
+			hook->ExecuteFunction(nullptr, args);
+		}
+
+		context->Exit();
+	}
+
+	/* the context is created before any of the page's own scripts run,
+	 * so neither the CSS nor the script have to wait for the load to
+	 * finish */
+	auto injection = pageInjections.find(browser->GetIdentifier());
+	if (frame->IsMain() && injection != pageInjections.end()) {
+		if (!injection->second.css.empty())
+			ApplyCSS(browser, context, injection->second.css);
+
+		if (!injection->second.script.empty()) {
+			CefRefPtr<CefV8Value> retval;
+			CefRefPtr<CefV8Exception> exception;
+			context->Eval(injection->second.script, frame->GetURL(),
+				      0, retval, exception);
+		}
+	}
 }
 
 void BrowserApp::ExecuteJSFunction(CefRefPtr<CefBrowser> browser,
@@ -246,6 +349,378 @@ void BrowserApp::SetDocumentVisibility(CefRefPtr<CefBrowser> browser,
 }
 #endif
 
+static CefRefPtr<CefV8Value> CefValueToV8(CefRefPtr<CefValue> value)
+{
+	switch (value->GetType()) {
+	case VTYPE_BOOL:
+		return CefV8Value::CreateBool(value->GetBool());
+	case VTYPE_INT:
+		return CefV8Value::CreateInt(value->GetInt());
+	case VTYPE_DOUBLE:
+		return CefV8Value::CreateDouble(value->GetDouble());
+	case VTYPE_STRING:
+		return CefV8Value::CreateString(value->GetString());
+	case VTYPE_LIST: {
+		CefRefPtr<CefListValue> list = value->GetList();
+		CefRefPtr<CefV8Value> array =
+			CefV8Value::CreateArray((int)list->GetSize());
+		for (size_t i = 0; i < list->GetSize(); i++)
+			array->SetValue((int)i, CefValueToV8(list->GetValue(i)));
+		return array;
+	}
+	case VTYPE_DICTIONARY: {
+		CefRefPtr<CefDictionaryValue> dict = value->GetDictionary();
+		CefRefPtr<CefV8Value> object = CefV8Value::CreateObject(0, 0);
+		CefDictionaryValue::KeyList keys;
+		dict->GetKeys(keys);
+		for (const CefString &key : keys)
+			object->SetValue(key, CefValueToV8(dict->GetValue(key)),
+					 V8_PROPERTY_ATTRIBUTE_NONE);
+		return object;
+	}
+	default:
+		return CefV8Value::CreateNull();
+	}
+}
+
+/* The new operator can't be invoked through the V8 API, so events and
+ * promises are created through small JS functions.  They're only compiled
+ * once per context, after which neither dispatching events nor calling the
+ * obsstudio functions touches the compiler. */
+BrowserApp::ContextFunctions &
+BrowserApp::GetContextFunctions(CefRefPtr<CefBrowser> browser,
+				CefRefPtr<CefV8Context> context)
+{
+	std::vector<ContextFunctions> &contexts =
+		contextFunctions[browser->GetIdentifier()];
+	for (ContextFunctions &functions : contexts) {
+		if (functions.context->IsSame(context))
+			return functions;
+	}
+
+	CefRefPtr<CefV8Exception> exception;
+
+	/* callers only keep what they take out of it, so the vector growing
+	 * later doesn't matter */
+	contexts.emplace_back();
+	ContextFunctions &cached = contexts.back();
+	cached.context = context;
+
+	context->Eval("(function(name, detail) {"
+		      "return new CustomEvent(name, {detail: detail});"
+		      "})",
+		      CefString(), 0, cached.eventFactory, exception);
+	context->Eval("(function() {"
+		      "let d = {};"
+		      "d.promise = new Promise(function(resolve) {"
+		      "d.resolve = resolve;"
+		      "});"
+		      "return d;"
+		      "})",
+		      CefString(), 0, cached.deferredFactory, exception);
+	/* the document element doesn't exist yet when the context is
+	 * created, so the style element is added once the parser has
+	 * created it */
+	context->Eval("(function(css) {"
+		      "function apply() {"
+		      "let root = document.head || document.documentElement;"
+		      "let style = document.getElementById('obs-browser-css');"
+		      "if (!style) {"
+		      "style = document.createElement('style');"
+		      "style.id = 'obs-browser-css';"
+		      "root.appendChild(style);"
+		      "}"
+		      "style.textContent = css;"
+		      "}"
+		      "if (document.documentElement) {"
+		      "apply();"
+		      "return;"
+		      "}"
+		      "new MutationObserver(function(records, observer) {"
+		      "if (!document.documentElement)"
+		      "return;"
+		      "observer.disconnect();"
+		      "apply();"
+		      "}).observe(document, {childList: true});"
+		      "})",
+		      CefString(), 0, cached.cssInjector, exception);
+	/* listeners can be added through window or the global scope, both
+	 * end up in EventTarget with the window as this */
+	context->Eval("(function(report) {"
+		      "let add = EventTarget.prototype.addEventListener;"
+		      "let seen = new Set();"
+		      "EventTarget.prototype.addEventListener = function(type) {"
+		      "if (this === window && typeof type === 'string' &&"
+		      "type.startsWith('obs') && !seen.has(type)) {"
+		      "seen.add(type);"
+		      "report(type);"
+		      "}"
+		      "return add.apply(this, arguments);"
+		      "};"
+		      "})",
+		      CefString(), 0, cached.listenerHook, exception);
+	return cached;
+}
+
+void BrowserApp::ApplyCSS(CefRefPtr<CefBrowser> browser,
+			  CefRefPtr<CefV8Context> context,
+			  const std::string &css)
+{
+	context->Enter();
+
+	CefRefPtr<CefV8Value> injector =
+		GetContextFunctions(browser, context).cssInjector;
+	if (injector) {
+		CefV8ValueList args;
+		args.push_back(CefV8Value::CreateString(css));
+		injector->ExecuteFunction(nullptr, args);
+	}
+
+	context->Exit();
+}
+
+class RendererTask : public CefTask {
+public:
+	std::function<void()> task;
+
+	inline RendererTask(std::function<void()> task_) : task(task_) {}
+	virtual void Execute() override { task(); }
+
+	IMPLEMENT_REFCOUNTING(RendererTask);
+};
+
+void BrowserApp::QueueRequest(CefRefPtr<CefBrowser> browser, int id,
+			      const CefString &name)
+{
+	CefRefPtr<CefListValue> &requests =
+		pendingRequests[browser->GetIdentifier()];
+
+	/* the first call in this task schedules sending all of them once
+	 * the script that made them returns */
+	if (!requests) {
+		requests = CefListValue::Create();
+
+		CefRefPtr<BrowserApp> self = this;
+		CefPostTask(TID_RENDERER,
+			    CefRefPtr<RendererTask>(new RendererTask(
+				    [self, browser]() {
+					    self->SendRequests(browser);
+				    })));
+	}
+
+	CefRefPtr<CefListValue> request = CefListValue::Create();
+	request->SetInt(0, id);
+	request->SetString(1, name);
+	requests->SetList(requests->GetSize(), request);
+}
+
+void BrowserApp::SendRequests(CefRefPtr<CefBrowser> browser)
+{
+	auto it = pendingRequests.find(browser->GetIdentifier());
+	if (it == pendingRequests.end())
+		return;
+
+	CefRefPtr<CefProcessMessage> msg =
+		CefProcessMessage::Create("obsRequests");
+	msg->GetArgumentList()->SetList(0, it->second);
+	pendingRequests.erase(it);
+
+	SendBrowserProcessMessage(browser, PID_BROWSER, msg);
+}
+
+void BrowserApp::ExecuteCallbacks(CefRefPtr<CefListValue> replies)
+{
+	for (size_t i = 0; i < replies->GetSize(); i++) {
+		CefRefPtr<CefListValue> reply = replies->GetList(i);
+
+		auto it = callbackMap.find(reply->GetInt(0));
+		if (it == callbackMap.end())
+			continue;
+
+		PendingCall call = it->second;
+		callbackMap.erase(it);
+
+		call.context->Enter();
+
+		CefV8ValueList args;
+		args.push_back(CefValueToV8(reply->GetValue(1)));
+
+		if (call.callback)
+			call.callback->ExecuteFunction(nullptr, args);
+		if (call.resolve)
+			call.resolve->ExecuteFunction(nullptr, args);
+
+		call.context->Exit();
+	}
+}
+
+void BrowserApp::OnContextReleased(CefRefPtr<CefBrowser> browser,
+				   CefRefPtr<CefFrame>,
+				   CefRefPtr<CefV8Context> context)
+{
+	/* iframes can call the obsstudio functions too, so everything is
+	 * dropped by context rather than only for the main frame */
+	auto it = contextFunctions.find(browser->GetIdentifier());
+	if (it != contextFunctions.end()) {
+		std::vector<ContextFunctions> &contexts = it->second;
+		for (size_t i = 0; i < contexts.size(); i++) {
+			if (contexts[i].context->IsSame(context)) {
+				contexts.erase(contexts.begin() + i);
+				break;
+			}
+		}
+	}
+
+	/* replies for these can't be delivered anymore */
+	for (auto call = callbackMap.begin(); call != callbackMap.end();) {
+		if (call->second.context->IsSame(context))
+			call = callbackMap.erase(call);
+		else
+			++call;
+	}
+
+	bool removed = false;
+	for (size_t i = stateSubscriptions.size(); i > 0; i--) {
+		StateSubscription &sub = stateSubscriptions[i - 1];
+		if (sub.context->IsSame(context)) {
+			stateSubscriptions.erase(stateSubscriptions.begin() +
+						 (i - 1));
+			removed = true;
+		}
+	}
+
+	if (removed)
+		SendStateSubscriptions(browser);
+}
+
+/* tells the browser process which topics this browser wants as a whole,
+ * it doesn't know about individual subscriptions.  a subscription that was
+ * just added is passed along, so only it gets the initial state. */
+void BrowserApp::SendStateSubscriptions(CefRefPtr<CefBrowser> browser,
+					const StateSubscription *added)
+{
+	std::vector<std::string> topics;
+	for (const StateSubscription &sub : stateSubscriptions) {
+		if (sub.browserId != browser->GetIdentifier())
+			continue;
+
+		for (const std::string &topic : sub.topics) {
+			if (std::find(topics.begin(), topics.end(), topic) ==
+			    topics.end())
+				topics.push_back(topic);
+		}
+	}
+
+	CefRefPtr<CefProcessMessage> msg =
+		CefProcessMessage::Create("subscribeState");
+	CefRefPtr<CefListValue> args = msg->GetArgumentList();
+	CefRefPtr<CefListValue> list = CefListValue::Create();
+	for (size_t i = 0; i < topics.size(); i++)
+		list->SetString(i, topics[i]);
+	args->SetList(0, list);
+
+	CefRefPtr<CefListValue> added_topics = CefListValue::Create();
+	if (added) {
+		for (size_t i = 0; i < added->topics.size(); i++)
+			added_topics->SetString(i, added->topics[i]);
+	}
+	args->SetInt(1, added ? added->id : 0);
+	args->SetList(2, added_topics);
+
+	SendBrowserProcessMessage(browser, PID_BROWSER, msg);
+}
+
+void BrowserApp::SendEventListeners(CefRefPtr<CefBrowser> browser)
+{
+	const std::vector<std::string> &events =
+		eventListeners[browser->GetIdentifier()];
+
+	CefRefPtr<CefProcessMessage> msg =
+		CefProcessMessage::Create("subscribeEvents");
+	CefRefPtr<CefListValue> list = CefListValue::Create();
+	for (size_t i = 0; i < events.size(); i++)
+		list->SetString(i, events[i]);
+	msg->GetArgumentList()->SetList(0, list);
+
+	SendBrowserProcessMessage(browser, PID_BROWSER, msg);
+}
+
+/* events come in batches of everything that happened during a video frame,
+ * each one a list of its name and detail */
+void BrowserApp::DispatchJSEvents(CefRefPtr<CefBrowser> browser,
+				  CefRefPtr<CefListValue> events)
+{
+	CefRefPtr<CefV8Context> context =
+		browser->GetMainFrame()->GetV8Context();
+
+	context->Enter();
+
+	CefRefPtr<CefV8Value> globalObj = context->GetGlobal();
+	CefRefPtr<CefV8Value> factory =
+		GetContextFunctions(browser, context).eventFactory;
+	CefRefPtr<CefV8Value> dispatchEvent =
+		globalObj->GetValue("dispatchEvent");
+
+	for (size_t i = 0; factory && i < events->GetSize(); i++) {
+		CefRefPtr<CefListValue> entry = events->GetList(i);
+
+		CefV8ValueList factoryArgs;
+		factoryArgs.push_back(
+			CefV8Value::CreateString(entry->GetString(0)));
+		factoryArgs.push_back(CefValueToV8(entry->GetValue(1)));
+
+		CefRefPtr<CefV8Value> event =
+			factory->ExecuteFunction(nullptr, factoryArgs);
+
+		CefV8ValueList arguments;
+		arguments.push_back(event);
+		dispatchEvent->ExecuteFunction(NULL, arguments);
+	}
+
+	context->Exit();
+}
+
+void BrowserApp::DispatchStateUpdate(CefRefPtr<CefBrowser> browser,
+				     CefRefPtr<CefListValue> args)
+{
+	CefRefPtr<CefDictionaryValue> state = args->GetDictionary(0);
+	double version = args->GetDouble(1);
+	int browserId = browser->GetIdentifier();
+	/* the initial state of a subscription is only for that one */
+	int only_id = args->GetSize() > 2 ? args->GetInt(2) : 0;
+
+	/* callbacks can unsubscribe, so work on a copy */
+	std::vector<StateSubscription> subs = stateSubscriptions;
+
+	for (StateSubscription &sub : subs) {
+		if (sub.browserId != browserId || (only_id && sub.id != only_id))
+			continue;
+
+		sub.context->Enter();
+
+		CefRefPtr<CefV8Value> object = CefV8Value::CreateObject(0, 0);
+		bool any = false;
+		for (const std::string &topic : sub.topics) {
+			if (!state->HasKey(topic))
+				continue;
+
+			object->SetValue(topic,
+					 CefValueToV8(state->GetValue(topic)),
+					 V8_PROPERTY_ATTRIBUTE_NONE);
+			any = true;
+		}
+
+		if (any) {
+			CefV8ValueList arguments;
+			arguments.push_back(object);
+			arguments.push_back(CefV8Value::CreateDouble(version));
+			sub.callback->ExecuteFunction(nullptr, arguments);
+		}
+
+		sub.context->Exit();
+	}
+}
+
 bool BrowserApp::OnProcessMessageReceived(CefRefPtr<CefBrowser> browser,
 #if CHROME_VERSION_BUILD >= 3770
 					  CefRefPtr<CefFrame> frame,
@@ -273,78 +748,27 @@ bool BrowserApp::OnProcessMessageReceived(CefRefPtr<CefBrowser> browser,
 
 		ExecuteJSFunction(browser, "onActiveChange", arguments);
 
-	} else if (message->GetName() == "DispatchJSEvent") {
-		CefRefPtr<CefV8Context> context =
-			browser->GetMainFrame()->GetV8Context();
-
-		context->Enter();
-
-		CefRefPtr<CefV8Value> globalObj = context->GetGlobal();
+	} else if (message->GetName() == "DispatchJSEvents") {
+		DispatchJSEvents(browser, args->GetList(0));
 
-		std::string err;
-		auto payloadJson =
-			Json::parse(args->GetString(1).ToString(), err);
+	} else if (message->GetName() == "StateUpdate") {
+		DispatchStateUpdate(browser, args);
 
-		Json::object wrapperJson;
-		if (args->GetSize() > 1)
-			wrapperJson["detail"] = payloadJson;
-		std::string wrapperJsonString = Json(wrapperJson).dump();
-		std::string script;
+	} else if (message->GetName() == "executeCallbacks") {
+		ExecuteCallbacks(args->GetList(0));
 
-		script += "new CustomEvent('";
-		script += args->GetString(0).ToString();
-		script += "', ";
-		script += wrapperJsonString;
-		script += ");";
+	} else if (message->GetName() == "PageInjection") {
+		PageInjection &injection =
+			pageInjections[browser->GetIdentifier()];
+		injection.css = args->GetString(0);
+		injection.script = args->GetString(1);
 
-		CefRefPtr<CefV8Value> returnValue;
-		CefRefPtr<CefV8Exception> exception;
-
-		/* Create the CustomEvent object
-		 * We have to use eval to invoke the new operator */
-		context->Eval(script, browser->GetMainFrame()->GetURL(), 0,
-			      returnValue, exception);
-
-		CefV8ValueList arguments;
-		arguments.push_back(returnValue);
-
-		CefRefPtr<CefV8Value> dispatchEvent =
-			globalObj->GetValue("dispatchEvent");
-		dispatchEvent->ExecuteFunction(NULL, arguments);
-
-		context->Exit();
-
-	} else if (message->GetName() == "executeCallback") {
-		CefRefPtr<CefV8Context> context =
-			browser->GetMainFrame()->GetV8Context();
-		CefRefPtr<CefV8Value> retval;
-		CefRefPtr<CefV8Exception> exception;
-
-		context->Enter();
-
-		CefRefPtr<CefListValue> arguments = message->GetArgumentList();
-		int callbackID = arguments->GetInt(0);
-		CefString jsonString = arguments->GetString(1);
-
-		std::string script;
-		script += "JSON.parse('";
-		script += arguments->GetString(1).ToString();
-		script += "');";
-
-		CefRefPtr<CefV8Value> callback = callbackMap[callbackID];
-		CefV8ValueList args;
-
-		context->Eval(script, browser->GetMainFrame()->GetURL(), 0,
-			      retval, exception);
-
-		args.push_back(retval);
-
-		if (callback)
-			callback->ExecuteFunction(NULL, args);
-
-		context->Exit();
-
-		callbackMap.erase(callbackID);
+		if (args->GetBool(2)) {
+			CefRefPtr<CefV8Context> context =
+				browser->GetMainFrame()->GetV8Context();
+			if (context)
+				ApplyCSS(browser, context, injection.css);
+		}
 
 	} else {
 		return false;
@@ -355,23 +779,106 @@ bool BrowserApp::OnProcessMessageReceived(CefRefPtr<CefBrowser> browser,
 
 bool BrowserApp::Execute(const CefString &name, CefRefPtr<CefV8Value>,
 			 const CefV8ValueList &arguments,
-			 CefRefPtr<CefV8Value> &, CefString &)
+			 CefRefPtr<CefV8Value> &retval, CefString &exception)
 {
 	if (name == "getCurrentScene" || name == "getStatus" ||
 	    name == "saveReplayBuffer") {
-		if (arguments.size() == 1 && arguments[0]->IsFunction()) {
-			callbackId++;
-			callbackMap[callbackId] = arguments[0];
+		CefRefPtr<CefV8Context> context =
+			CefV8Context::GetCurrentContext();
+		CefRefPtr<CefBrowser> browser = context->GetBrowser();
+
+		/* every call gets its own ID, whether it passed a callback or
+		 * not, so replies can't be mixed up */
+		int id = ++callbackId;
+
+		PendingCall call;
+		call.context = context;
+		if (arguments.size() == 1 && arguments[0]->IsFunction())
+			call.callback = arguments[0];
+
+		/* also returns a promise for the reply */
+		CefRefPtr<CefV8Value> factory =
+			GetContextFunctions(browser, context).deferredFactory;
+		if (factory) {
+			CefRefPtr<CefV8Value> deferred =
+				factory->ExecuteFunction(nullptr,
+							 CefV8ValueList());
+			if (deferred) {
+				call.resolve = deferred->GetValue("resolve");
+				retval = deferred->GetValue("promise");
+			}
 		}
 
-		CefRefPtr<CefProcessMessage> msg =
-			CefProcessMessage::Create(name);
-		CefRefPtr<CefListValue> args = msg->GetArgumentList();
-		args->SetInt(0, callbackId);
+		callbackMap[id] = call;
+		QueueRequest(browser, id, name);
+
+	} else if (name == "subscribe") {
+		if (arguments.size() != 2 || !arguments[1]->IsFunction()) {
+			exception = "subscribe(topics, callback) expects a "
+				    "topic or list of topics and a function";
+			return true;
+		}
+
+		CefRefPtr<CefV8Context> context =
+			CefV8Context::GetCurrentContext();
+		CefRefPtr<CefBrowser> browser = context->GetBrowser();
+
+		StateSubscription sub;
+		sub.id = ++subscriptionId;
+		sub.browserId = browser->GetIdentifier();
+		sub.context = context;
+		sub.callback = arguments[1];
+
+		CefRefPtr<CefV8Value> topics = arguments[0];
+		if (topics->IsString()) {
+			sub.topics.push_back(topics->GetStringValue());
+		} else if (topics->IsArray()) {
+			for (int i = 0; i < topics->GetArrayLength(); i++) {
+				CefRefPtr<CefV8Value> topic =
+					topics->GetValue(i);
+				if (topic->IsString())
+					sub.topics.push_back(
+						topic->GetStringValue());
+			}
+		}
+
+		stateSubscriptions.push_back(sub);
+		SendStateSubscriptions(browser, &sub);
+
+		retval = CefV8Value::CreateInt(sub.id);
+
+	} else if (name == "eventListenerAdded") {
+		if (arguments.size() != 1 || !arguments[0]->IsString())
+			return true;
 
 		CefRefPtr<CefBrowser> browser =
 			CefV8Context::GetCurrentContext()->GetBrowser();
-		SendBrowserProcessMessage(browser, PID_BROWSER, msg);
+		std::vector<std::string> &events =
+			eventListeners[browser->GetIdentifier()];
+
+		std::string type = arguments[0]->GetStringValue();
+		if (std::find(events.begin(), events.end(), type) ==
+		    events.end()) {
+			events.push_back(type);
+			SendEventListeners(browser);
+		}
+
+	} else if (name == "unsubscribe") {
+		if (arguments.size() != 1 || !arguments[0]->IsInt())
+			return true;
+
+		CefRefPtr<CefBrowser> browser =
+			CefV8Context::GetCurrentContext()->GetBrowser();
+		int id = arguments[0]->GetIntValue();
+
+		for (size_t i = 0; i < stateSubscriptions.size(); i++) {
+			if (stateSubscriptions[i].id == id) {
+				stateSubscriptions.erase(
+					stateSubscriptions.begin() + i);
+				SendStateSubscriptions(browser);
+				break;
+			}
+		}
 
 	} else {
 		/* Function does not exist. */
@@ -385,29 +892,81 @@ bool BrowserApp::Execute(const CefString &name, CefRefPtr<CefV8Value>,
 Q_DECLARE_METATYPE(MessageTask);
 MessageObject messageObject;
 
+/* upper bound on how many tasks run per Qt event, so that a flood of
+ * tasks can't starve the rest of the UI.  whatever is left over gets
+ * another wakeup. */
+#define MAX_BROWSER_TASK_BATCH 64
+
 void QueueBrowserTask(CefRefPtr<CefBrowser> browser, BrowserFunc func)
 {
-	std::lock_guard<std::mutex> lock(messageObject.browserTaskMutex);
-	messageObject.browserTasks.emplace_back(browser, func);
+	messageObject.browserTasks.Push(MessageObject::Task(
+		browser, std::move(func), os_gettime_ns()));
+	messageObject.browserTaskDepth++;
+
+	/* one wakeup covers everything queued until the Qt thread gets
+	 * around to it */
+	if (!messageObject.browserTasksPending.exchange(true))
+		QMetaObject::invokeMethod(&messageObject, "ExecuteBrowserTasks",
+					  Qt::QueuedConnection);
+}
 
-	QMetaObject::invokeMethod(&messageObject, "ExecuteNextBrowserTask",
-				  Qt::QueuedConnection);
+void MessageObject::RunBrowserTask(Task &task)
+{
+	int64_t depth = browserTaskDepth--;
+	if (depth > maxBrowserTaskDepth)
+		maxBrowserTaskDepth = depth;
+
+	uint64_t wait = os_gettime_ns() - task.queued_ns;
+	totalBrowserTaskWaitNs += wait;
+	if (wait > maxBrowserTaskWaitNs)
+		maxBrowserTaskWaitNs = wait;
+	browserTaskCount++;
+
+	task.func(task.browser);
 }
 
 bool MessageObject::ExecuteNextBrowserTask()
 {
 	Task nextTask;
-	{
-		std::lock_guard<std::mutex> lock(browserTaskMutex);
-		if (!browserTasks.size())
-			return false;
+	if (!browserTasks.Pop(nextTask))
+		return false;
+
+	RunBrowserTask(nextTask);
+	return true;
+}
 
-		nextTask = browserTasks[0];
-		browserTasks.pop_front();
+void MessageObject::ExecuteBrowserTasks()
+{
+	/* cleared before draining, so anything pushed from here on gets a
+	 * wakeup of its own */
+	browserTasksPending = false;
+	browserTaskBatches++;
+
+	Task task;
+	for (int i = 0; i < MAX_BROWSER_TASK_BATCH; i++) {
+		if (!browserTasks.Pop(task))
+			return;
+
+		RunBrowserTask(task);
+		task = Task();
 	}
 
-	nextTask.func(nextTask.browser);
-	return true;
+	if (!browserTasksPending.exchange(true))
+		QMetaObject::invokeMethod(this, "ExecuteBrowserTasks",
+					  Qt::QueuedConnection);
+}
+
+void MessageObject::LogBrowserTaskStats()
+{
+	blog(LOG_DEBUG,
+	     "[obs-browser]: Browser task queue: %" PRIu64 " tasks in "
+	     "%" PRIu64 " batches, max depth %" PRId64 ", "
+	     "average wait %.3f ms, max wait %.3f ms",
+	     browserTaskCount, browserTaskBatches, maxBrowserTaskDepth,
+	     browserTaskCount ? (double)totalBrowserTaskWaitNs /
+					(double)browserTaskCount / 1000000.0
+			      : 0.0,
+	     (double)maxBrowserTaskWaitNs / 1000000.0);
 }
 
 void MessageObject::ExecuteTask(MessageTask task)
@@ -415,44 +974,90 @@ void MessageObject::ExecuteTask(MessageTask task)
 	task();
 }
 
+/* Can be called from any thread.  Immediate requests are coalesced, so no
+ * matter how many come in before the Qt thread gets to them, the pump only
+ * runs once. */
+void MessageObject::ScheduleMessagePumpWork(int64_t delay_ms)
+{
+	if (delay_ms <= 0) {
+		if (!pumpPending.exchange(true))
+			QMetaObject::invokeMethod(this, "DoCefMessageLoop",
+						  Qt::QueuedConnection,
+						  Q_ARG(int, 0));
+		return;
+	}
+
+	if (delay_ms > INT_MAX)
+		delay_ms = INT_MAX;
+
+	QMetaObject::invokeMethod(this, "DoCefMessageLoop",
+				  Qt::QueuedConnection,
+				  Q_ARG(int, (int)delay_ms));
+}
+
+extern bool BrowserSourcesShowing();
+
+#define MAX_PUMP_DELAY (1000 / 30)
+
+void MessageObject::DoCefMessageLoopWork()
+{
+	/* CEF can end up calling back in to here, and doesn't support
+	 * CefDoMessageLoopWork being called recursively */
+	if (pumping) {
+		ScheduleMessagePumpWork(0);
+		return;
+	}
+
+	pumping = true;
+	CefDoMessageLoopWork();
+	pumping = false;
+
+	/* a delayed pump that's still pending is left alone, CEF doesn't
+	 * always ask for it again.  while a source is showing, there's also
+	 * always one pending at most a frame out, in case CEF stops asking
+	 * altogether. */
+	if (BrowserSourcesShowing())
+		DoCefMessageLoop(MAX_PUMP_DELAY);
+}
+
 void MessageObject::DoCefMessageLoop(int ms)
 {
-	if (ms)
-		QTimer::singleShot((int)ms + 2,
-				   []() { CefDoMessageLoopWork(); });
-	else
-		CefDoMessageLoopWork();
+	if (ms <= 0) {
+		pumpPending = false;
+		DoCefMessageLoopWork();
+		return;
+	}
+
+	if (!pumpTimer) {
+		pumpTimer = new QTimer(this);
+		pumpTimer->setSingleShot(true);
+		pumpTimer->setTimerType(Qt::PreciseTimer);
+		connect(pumpTimer, &QTimer::timeout, this,
+			&MessageObject::Process);
+	}
+
+	/* an earlier pump already covers this one */
+	if (pumpTimer->isActive() && pumpTimer->remainingTime() <= ms)
+		return;
+
+	pumpTimer->start(ms);
 }
 
 void MessageObject::Process()
 {
-	CefDoMessageLoopWork();
+	DoCefMessageLoopWork();
 }
 
 void ProcessCef()
 {
-	QMetaObject::invokeMethod(&messageObject, "DoCefMessageLoop",
-				  Qt::QueuedConnection, Q_ARG(int, (int)0));
+	messageObject.ScheduleMessagePumpWork(0);
 }
 
-#define MAX_DELAY (1000 / 30)
-
+/* The delay CEF asks for is honored as is.  There's no repeating timer, so
+ * when no source is showing and nothing is going on in any browser, the UI
+ * thread isn't woken up at all. */
 void BrowserApp::OnScheduleMessagePumpWork(int64 delay_ms)
 {
-	if (delay_ms < 0)
-		delay_ms = 0;
-	else if (delay_ms > MAX_DELAY)
-		delay_ms = MAX_DELAY;
-
-	if (!frameTimer.isActive()) {
-		QObject::connect(&frameTimer, &QTimer::timeout, &messageObject,
-				 &MessageObject::Process);
-		frameTimer.setSingleShot(false);
-		frameTimer.start(33);
-	}
-
-	QMetaObject::invokeMethod(&messageObject, "DoCefMessageLoop",
-				  Qt::QueuedConnection,
-				  Q_ARG(int, (int)delay_ms));
+	messageObject.ScheduleMessagePumpWork(delay_ms);
 }
 #endif
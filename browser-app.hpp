@@ -21,6 +21,8 @@
 #include <map>
 #include <unordered_map>
 #include <functional>
+#include <vector>
+#include <string>
 #include "cef-headers.hpp"
 
 typedef std::function<void(CefRefPtr<CefBrowser>)> BrowserFunc;
@@ -28,8 +30,9 @@ typedef std::function<void(CefRefPtr<CefBrowser>)> BrowserFunc;
 #ifdef USE_QT_LOOP
 #include <QObject>
 #include <QTimer>
-#include <mutex>
-#include <deque>
+#include <atomic>
+#include <stdint.h>
+#include "browser-task-queue.hpp"
 
 typedef std::function<void()> MessageTask;
 
@@ -42,19 +45,47 @@ class MessageObject : public QObject {
 	struct Task {
 		CefRefPtr<CefBrowser> browser;
 		BrowserFunc func;
+		uint64_t queued_ns = 0;
 
 		inline Task() {}
-		inline Task(CefRefPtr<CefBrowser> browser_, BrowserFunc func_)
-			: browser(browser_), func(func_)
+		inline Task(CefRefPtr<CefBrowser> browser_, BrowserFunc &&func_,
+			    uint64_t queued_ns_)
+			: browser(browser_),
+			  func(std::move(func_)),
+			  queued_ns(queued_ns_)
 		{
 		}
 	};
 
-	std::mutex browserTaskMutex;
-	std::deque<Task> browserTasks;
+	MPSCQueue<Task> browserTasks;
+	std::atomic<bool> browserTasksPending = {false};
+
+	/* queue metrics, depth is updated by producers and the Qt thread,
+	 * the rest only by the Qt thread */
+	std::atomic<int64_t> browserTaskDepth = {0};
+	int64_t maxBrowserTaskDepth = 0;
+	uint64_t browserTaskCount = 0;
+	uint64_t browserTaskBatches = 0;
+	uint64_t totalBrowserTaskWaitNs = 0;
+	uint64_t maxBrowserTaskWaitNs = 0;
+
+	void RunBrowserTask(Task &task);
+
+	/* message pump state, only touched on the Qt thread except for
+	 * pumpPending */
+	QTimer *pumpTimer = nullptr;
+	bool pumping = false;
+	std::atomic<bool> pumpPending = {false};
+
+	void DoCefMessageLoopWork();
+
+public:
+	void LogBrowserTaskStats();
+	void ScheduleMessagePumpWork(int64_t delay_ms);
 
 public slots:
 	bool ExecuteNextBrowserTask();
+	void ExecuteBrowserTasks();
 	void ExecuteTask(MessageTask task);
 	void DoCefMessageLoop(int ms);
 	void Process();
@@ -72,15 +103,92 @@ class BrowserApp : public CefApp,
 			       const char *functionName,
 			       CefV8ValueList arguments);
 
-	typedef std::map<int, CefRefPtr<CefV8Value>> CallbackMap;
+	/* a call to one of the obsstudio functions that is waiting on its
+	 * reply from the browser process */
+	struct PendingCall {
+		CefRefPtr<CefV8Context> context;
+		CefRefPtr<CefV8Value> callback;
+		CefRefPtr<CefV8Value> resolve;
+	};
+	typedef std::map<int, PendingCall> CallbackMap;
+
+	/* JS helpers that are compiled once per context */
+	struct ContextFunctions {
+		CefRefPtr<CefV8Context> context;
+		CefRefPtr<CefV8Value> eventFactory;
+		CefRefPtr<CefV8Value> deferredFactory;
+		CefRefPtr<CefV8Value> cssInjector;
+		CefRefPtr<CefV8Value> listenerHook;
+	};
+	/* every frame of a browser has a context of its own, keyed by
+	 * browser identifier */
+	typedef std::unordered_map<int, std::vector<ContextFunctions>>
+		ContextFunctionMap;
+
+	struct StateSubscription {
+		int id;
+		int browserId;
+		CefRefPtr<CefV8Context> context;
+		CefRefPtr<CefV8Value> callback;
+		std::vector<std::string> topics;
+	};
+
+	/* the custom CSS and script of a browser source, applied to each
+	 * page of it as soon as its main frame context exists */
+	struct PageInjection {
+		std::string css;
+		std::string script;
+	};
 
 	bool shared_texture_available;
+
+	/* renderer process sharing, see OnBeforeCommandLineProcessing */
+	bool process_per_site;
+	int renderer_process_limit;
+
+	/* "high,low" LUID of the adapter the GPU process has to use */
+	std::string adapter_luid;
 	CallbackMap callbackMap;
-	int callbackId;
+	ContextFunctionMap contextFunctions;
+	std::vector<StateSubscription> stateSubscriptions;
+	std::unordered_map<int, PageInjection> pageInjections;
+	/* obs* events the page of a browser listens for, only those are
+	 * sent to it.  keyed by browser identifier. */
+	std::unordered_map<int, std::vector<std::string>> eventListeners;
+	int callbackId = 0;
+	int subscriptionId = 0;
+
+	/* calls made during the same task are sent together, keyed by
+	 * browser identifier */
+	std::unordered_map<int, CefRefPtr<CefListValue>> pendingRequests;
+
+	void QueueRequest(CefRefPtr<CefBrowser> browser, int id,
+			  const CefString &name);
+	void SendRequests(CefRefPtr<CefBrowser> browser);
+	void ExecuteCallbacks(CefRefPtr<CefListValue> replies);
+
+	void SendStateSubscriptions(CefRefPtr<CefBrowser> browser,
+				    const StateSubscription *added = nullptr);
+	void SendEventListeners(CefRefPtr<CefBrowser> browser);
+	void DispatchJSEvents(CefRefPtr<CefBrowser> browser,
+			      CefRefPtr<CefListValue> events);
+	void DispatchStateUpdate(CefRefPtr<CefBrowser> browser,
+				 CefRefPtr<CefListValue> args);
+
+	ContextFunctions &GetContextFunctions(CefRefPtr<CefBrowser> browser,
+					      CefRefPtr<CefV8Context> context);
+	void ApplyCSS(CefRefPtr<CefBrowser> browser,
+		      CefRefPtr<CefV8Context> context, const std::string &css);
 
 public:
-	inline BrowserApp(bool shared_texture_available_ = false)
-		: shared_texture_available(shared_texture_available_)
+	inline BrowserApp(bool shared_texture_available_ = false,
+			  bool process_per_site_ = false,
+			  int renderer_process_limit_ = 0,
+			  const std::string &adapter_luid_ = std::string())
+		: shared_texture_available(shared_texture_available_),
+		  process_per_site(process_per_site_),
+		  renderer_process_limit(renderer_process_limit_),
+		  adapter_luid(adapter_luid_)
 	{
 	}
 
@@ -95,9 +203,18 @@ public:
 	virtual void OnBeforeCommandLineProcessing(
 		const CefString &process_type,
 		CefRefPtr<CefCommandLine> command_line) override;
+#if CHROME_VERSION_BUILD >= 3770
+	virtual void
+	OnBrowserCreated(CefRefPtr<CefBrowser> browser,
+			 CefRefPtr<CefDictionaryValue> extra_info) override;
+#endif
+	virtual void OnBrowserDestroyed(CefRefPtr<CefBrowser> browser) override;
 	virtual void OnContextCreated(CefRefPtr<CefBrowser> browser,
 				      CefRefPtr<CefFrame> frame,
 				      CefRefPtr<CefV8Context> context) override;
+	virtual void OnContextReleased(CefRefPtr<CefBrowser> browser,
+				       CefRefPtr<CefFrame> frame,
+				       CefRefPtr<CefV8Context> context) override;
 	virtual bool
 	OnProcessMessageReceived(CefRefPtr<CefBrowser> browser,
 #if CHROME_VERSION_BUILD >= 3770
@@ -113,7 +230,6 @@ public:
 
 #ifdef USE_QT_LOOP
 	virtual void OnScheduleMessagePumpWork(int64 delay_ms) override;
-	QTimer frameTimer;
 #endif
 
 #if !ENABLE_WASHIDDEN
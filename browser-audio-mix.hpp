@@ -0,0 +1,90 @@
+#pragma once
+
+#include <stddef.h>
+
+#if defined(__SSE2__) || defined(_M_X64) || defined(_M_AMD64) || \
+	(defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define BROWSER_MIX_SSE 1
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__) || defined(_M_ARM64)
+#include <arm_neon.h>
+#define BROWSER_MIX_NEON 1
+#endif
+
+/* Audio mixing kernels for browser audio streams.
+ *
+ * These only use the SIMD instructions every supported CPU of the target
+ * architecture has (SSE2 on x86, NEON on ARM), so there's no runtime
+ * dispatch to do.  Nothing here needs to be aligned. */
+
+/* out[i] += in[i] */
+static inline void mix_audio(float *__restrict out,
+			     const float *__restrict in, size_t count)
+{
+	size_t i = 0;
+
+#if BROWSER_MIX_SSE || BROWSER_MIX_NEON
+	size_t vec_count = count & ~(size_t)7;
+#endif
+
+#if BROWSER_MIX_SSE
+	for (; i < vec_count; i += 8) {
+		__m128 a = _mm_add_ps(_mm_loadu_ps(out + i),
+				      _mm_loadu_ps(in + i));
+		__m128 b = _mm_add_ps(_mm_loadu_ps(out + i + 4),
+				      _mm_loadu_ps(in + i + 4));
+		_mm_storeu_ps(out + i, a);
+		_mm_storeu_ps(out + i + 4, b);
+	}
+#elif BROWSER_MIX_NEON
+	for (; i < vec_count; i += 8) {
+		float32x4_t a =
+			vaddq_f32(vld1q_f32(out + i), vld1q_f32(in + i));
+		float32x4_t b = vaddq_f32(vld1q_f32(out + i + 4),
+					  vld1q_f32(in + i + 4));
+		vst1q_f32(out + i, a);
+		vst1q_f32(out + i + 4, b);
+	}
+#endif
+
+	for (; i < count; i++)
+		out[i] += in[i];
+}
+
+/* out[i] += in[0][i] + in[1][i] + ... + in[num - 1][i]
+ *
+ * Adds all inputs in one pass, so the output is only loaded and stored
+ * once no matter how many inputs there are. */
+static inline void mix_audio_multi(float *__restrict out,
+				   const float *const *in, size_t num,
+				   size_t count)
+{
+	size_t i = 0;
+
+#if BROWSER_MIX_SSE || BROWSER_MIX_NEON
+	size_t vec_count = count & ~(size_t)3;
+#endif
+
+#if BROWSER_MIX_SSE
+	for (; i < vec_count; i += 4) {
+		__m128 acc = _mm_loadu_ps(out + i);
+		for (size_t n = 0; n < num; n++)
+			acc = _mm_add_ps(acc, _mm_loadu_ps(in[n] + i));
+		_mm_storeu_ps(out + i, acc);
+	}
+#elif BROWSER_MIX_NEON
+	for (; i < vec_count; i += 4) {
+		float32x4_t acc = vld1q_f32(out + i);
+		for (size_t n = 0; n < num; n++)
+			acc = vaddq_f32(acc, vld1q_f32(in[n] + i));
+		vst1q_f32(out + i, acc);
+	}
+#endif
+
+	for (; i < count; i++) {
+		float acc = out[i];
+		for (size_t n = 0; n < num; n++)
+			acc += in[n][i];
+		out[i] = acc;
+	}
+}
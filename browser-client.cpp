@@ -18,28 +18,47 @@
 
 #include "browser-client.hpp"
 #include "obs-browser-source.hpp"
-#include "base64/base64.hpp"
+#include "browser-texture-pool.hpp"
+#include "browser-state.hpp"
 #include "json11/json11.hpp"
 #include <obs-frontend-api.h>
 #include <obs.hpp>
 #include <util/platform.h>
+#include <inttypes.h>
+#include <algorithm>
+
+#if EXPERIMENTAL_SHARED_TEXTURE_SUPPORT_ENABLED
+#if defined(__APPLE__)
+#include <IOSurface/IOSurface.h>
+#elif defined(__linux__)
+#include <sys/stat.h>
+#endif
+#endif
 
 using namespace json11;
 
 BrowserClient::~BrowserClient()
 {
-#if EXPERIMENTAL_SHARED_TEXTURE_SUPPORT_ENABLED && USE_TEXTURE_COPY
-	if (sharing_available) {
-		obs_enter_graphics();
-		gs_texture_destroy(texture);
-		obs_leave_graphics();
-	}
+#if EXPERIMENTAL_SHARED_TEXTURE_SUPPORT_ENABLED
+	ReleaseSharedTextures();
 #endif
 }
 
-CefRefPtr<CefLoadHandler> BrowserClient::GetLoadHandler()
+void BrowserClient::DetachSource()
 {
-	return this;
+#if EXPERIMENTAL_SHARED_TEXTURE_SUPPORT_ENABLED
+	ReleaseSharedTextures();
+#endif
+	bs = nullptr;
+}
+
+/* hands a spare browser to a source, on the CEF thread.  the audio handler
+ * is only asked for when a stream starts, and a spare hasn't played any. */
+void BrowserClient::AttachSource(BrowserSource *bs_, bool reroute_audio_)
+{
+	bs = bs_;
+	reroute_audio = reroute_audio_;
+	spare = false;
 }
 
 CefRefPtr<CefRenderHandler> BrowserClient::GetRenderHandler()
@@ -57,6 +76,11 @@ CefRefPtr<CefLifeSpanHandler> BrowserClient::GetLifeSpanHandler()
 	return this;
 }
 
+CefRefPtr<CefLoadHandler> BrowserClient::GetLoadHandler()
+{
+	return this;
+}
+
 CefRefPtr<CefContextMenuHandler> BrowserClient::GetContextMenuHandler()
 {
 	return this;
@@ -83,6 +107,39 @@ bool BrowserClient::OnBeforePopup(CefRefPtr<CefBrowser>, CefRefPtr<CefFrame>,
 	return true;
 }
 
+void BrowserClient::OnAfterCreated(CefRefPtr<CefBrowser> browser)
+{
+	/* the source went away while the browser was being created */
+	if (spare)
+		AddSpareBrowser(browser);
+	else if (bs)
+		bs->BrowserCreated(browser);
+	else
+		browser->GetHost()->CloseBrowser(true);
+
+	BrowserCreationDone();
+}
+
+void BrowserClient::OnBeforeClose(CefRefPtr<CefBrowser> browser)
+{
+	UnregisterBrowser(browser);
+	BrowserState::RemoveBrowser(browser);
+
+#if EXPERIMENTAL_SHARED_TEXTURE_SUPPORT_ENABLED
+	ReleaseSharedTextures();
+#endif
+}
+
+void BrowserClient::OnLoadStart(CefRefPtr<CefBrowser>,
+				CefRefPtr<CefFrame> frame, TransitionType)
+{
+	/* spares are still showing about:blank until the source's page has
+	 * been committed */
+	if (bs && frame->IsMain() &&
+	    frame->GetURL().ToString() != "about:blank")
+		bs->page_committed = true;
+}
+
 void BrowserClient::OnBeforeContextMenu(CefRefPtr<CefBrowser>,
 					CefRefPtr<CefFrame>,
 					CefRefPtr<CefContextMenuParams>,
@@ -92,38 +149,27 @@ void BrowserClient::OnBeforeContextMenu(CefRefPtr<CefBrowser>,
 	model->Clear();
 }
 
-bool BrowserClient::OnProcessMessageReceived(
-	CefRefPtr<CefBrowser> browser,
-#if CHROME_VERSION_BUILD >= 3770
-	CefRefPtr<CefFrame>,
-#endif
-	CefProcessId, CefRefPtr<CefProcessMessage> message)
+/* answers a single obsstudio function call */
+static Json HandleRequest(const std::string &name)
 {
-	const std::string &name = message->GetName();
-	Json json;
-
-	if (!bs) {
-		return false;
-	}
-
 	if (name == "getCurrentScene") {
 		OBSSource current_scene = obs_frontend_get_current_scene();
 		obs_source_release(current_scene);
 
 		if (!current_scene)
-			return false;
+			return Json();
 
-		const char *name = obs_source_get_name(current_scene);
-		if (!name)
-			return false;
+		const char *scene_name = obs_source_get_name(current_scene);
+		if (!scene_name)
+			return Json();
 
-		json = Json::object{
-			{"name", name},
+		return Json::object{
+			{"name", scene_name},
 			{"width", (int)obs_source_get_width(current_scene)},
 			{"height", (int)obs_source_get_height(current_scene)}};
 
 	} else if (name == "getStatus") {
-		json = Json::object{
+		return Json::object{
 			{"recording", obs_frontend_recording_active()},
 			{"streaming", obs_frontend_streaming_active()},
 			{"recordingPaused", obs_frontend_recording_paused()},
@@ -131,18 +177,63 @@ bool BrowserClient::OnProcessMessageReceived(
 
 	} else if (name == "saveReplayBuffer") {
 		obs_frontend_replay_buffer_save();
-	} else {
-		return false;
 	}
 
-	CefRefPtr<CefProcessMessage> msg =
-		CefProcessMessage::Create("executeCallback");
+	return Json();
+}
 
-	CefRefPtr<CefListValue> args = msg->GetArgumentList();
-	args->SetInt(0, message->GetArgumentList()->GetInt(0));
-	args->SetString(1, json.dump());
+bool BrowserClient::OnProcessMessageReceived(
+	CefRefPtr<CefBrowser> browser,
+#if CHROME_VERSION_BUILD >= 3770
+	CefRefPtr<CefFrame>,
+#endif
+	CefProcessId, CefRefPtr<CefProcessMessage> message)
+{
+	const std::string &name = message->GetName();
 
-	SendBrowserProcessMessage(browser, PID_RENDERER, msg);
+	if (!bs) {
+		return false;
+	}
+
+	if (name == "obsRequests") {
+		/* all calls a page made in one go get answered in one
+		 * message */
+		CefRefPtr<CefListValue> requests =
+			message->GetArgumentList()->GetList(0);
+		CefRefPtr<CefListValue> replies = CefListValue::Create();
+
+		for (size_t i = 0; i < requests->GetSize(); i++) {
+			CefRefPtr<CefListValue> request = requests->GetList(i);
+
+			CefRefPtr<CefListValue> reply = CefListValue::Create();
+			reply->SetInt(0, request->GetInt(0));
+			reply->SetValue(1, JsonToCefValue(HandleRequest(
+						   request->GetString(1))));
+			replies->SetList(i, reply);
+		}
+
+		CefRefPtr<CefProcessMessage> msg =
+			CefProcessMessage::Create("executeCallbacks");
+		msg->GetArgumentList()->SetList(0, replies);
+		SendBrowserProcessMessage(browser, PID_RENDERER, msg);
+
+	} else if (name == "subscribeState") {
+		CefRefPtr<CefListValue> args = message->GetArgumentList();
+		BrowserState::Subscribe(browser, args->GetList(0),
+					args->GetInt(1), args->GetList(2));
+	} else if (name == "subscribeEvents") {
+		SetEventListeners(browser,
+				  message->GetArgumentList()->GetList(0));
+	} else if (name == "rendererInfo") {
+		bs->renderer_pid = message->GetArgumentList()->GetInt(0);
+
+		/* a new renderer only has what was passed along when the
+		 * browser was created */
+		if (bs->injection_changed)
+			SendPageInjection(browser, bs->css, bs->script, true);
+	} else {
+		return false;
+	}
 
 	return true;
 }
@@ -171,9 +262,58 @@ bool BrowserClient::GetViewRect(
 #endif
 }
 
+bool BrowserClient::GetScreenInfo(CefRefPtr<CefBrowser> browser,
+				  CefScreenInfo &screen_info)
+{
+	if (!bs || bs->render_scale == 100) {
+		return false;
+	}
+
+	CefRect rect;
+	GetViewRect(browser, rect);
+
+	/* the view rect stays at the source size, so pages lay out the same
+	 * and only the painted frames get smaller */
+	screen_info.device_scale_factor = (float)bs->render_scale / 100.0f;
+	screen_info.rect = rect;
+	screen_info.available_rect = rect;
+	return true;
+}
+
+/* select popups are painted on their own, accelerated paints of them are
+ * drawn over the view in BrowserSource::Render */
+void BrowserClient::OnPopupShow(CefRefPtr<CefBrowser>, bool show)
+{
+	if (show) {
+		return;
+	}
+
+	popupRect = CefRect();
+	originalPopupRect = CefRect();
+
+	if (bs && bs->popup_texture) {
+		obs_enter_graphics();
+		TexturePool::Release(bs->popup_texture);
+		bs->popup_texture = nullptr;
+		obs_leave_graphics();
+	}
+}
+
+void BrowserClient::OnPopupSize(CefRefPtr<CefBrowser>, const CefRect &rect)
+{
+	originalPopupRect = rect;
+
+	/* keep the popup inside the view */
+	int width = bs ? bs->width : rect.width;
+	int height = bs ? bs->height : rect.height;
+	popupRect = rect;
+	popupRect.x = std::max(std::min(rect.x, width - rect.width), 0);
+	popupRect.y = std::max(std::min(rect.y, height - rect.height), 0);
+}
+
 void BrowserClient::OnPaint(CefRefPtr<CefBrowser>, PaintElementType type,
-			    const RectList &, const void *buffer, int width,
-			    int height)
+			    const RectList &dirtyRects, const void *buffer,
+			    int width, int height)
 {
 	if (type != PET_VIEW) {
 		return;
@@ -189,70 +329,359 @@ void BrowserClient::OnPaint(CefRefPtr<CefBrowser>, PaintElementType type,
 		return;
 	}
 
-	if (bs->width != width || bs->height != height) {
-		obs_enter_graphics();
-		bs->DestroyTextures();
-		obs_leave_graphics();
+	if (!width || !height) {
+		return;
 	}
 
-	if (!bs->texture && width && height) {
-		obs_enter_graphics();
-		bs->texture = gs_texture_create(width, height, GS_BGRA, 1,
-						(const uint8_t **)&buffer,
-						GS_DYNAMIC);
-		bs->width = width;
-		bs->height = height;
-		obs_leave_graphics();
-	} else {
-		obs_enter_graphics();
-		gs_texture_set_image(bs->texture, (const uint8_t *)buffer,
-				     width * 4, false);
-		obs_leave_graphics();
-	}
+	/* the frame is uploaded on the graphics thread in
+	 * BrowserSource::Render */
+	bs->PaintFrame(buffer, width, height, dirtyRects);
 }
 
 #if EXPERIMENTAL_SHARED_TEXTURE_SUPPORT_ENABLED
-void BrowserClient::OnAcceleratedPaint(CefRefPtr<CefBrowser>, PaintElementType,
-				       const RectList &, void *shared_handle)
+#if CHROME_VERSION_BUILD < 6367
+void BrowserClient::DestroySharedTexture(size_t idx)
 {
-	if (!bs) {
-		return;
-	}
+	gs_texture_t *tex = shared_textures[idx].texture;
 
-	if (shared_handle != last_handle) {
-		obs_enter_graphics();
+	if (bs && bs->texture_borrowed && bs->texture == tex) {
+		bs->texture = nullptr;
+		bs->texture_borrowed = false;
+	}
 #if USE_TEXTURE_COPY
-		gs_texture_destroy(texture);
+	if (texture == tex)
 		texture = nullptr;
 #endif
-		gs_texture_destroy(bs->texture);
-		bs->texture = nullptr;
+	if (last_handle == shared_textures[idx].handle)
+		last_handle = nullptr;
 
-#if USE_TEXTURE_COPY
-		texture = gs_texture_open_shared(
-			(uint32_t)(uintptr_t)shared_handle);
+	gs_texture_destroy(tex);
+	shared_textures.erase(shared_textures.begin() + idx);
+}
+#endif
 
-		uint32_t cx = gs_texture_get_width(texture);
-		uint32_t cy = gs_texture_get_height(texture);
-		gs_color_format format = gs_texture_get_color_format(texture);
+#if CHROME_VERSION_BUILD >= 6367 && defined(__linux__)
+#define DRM_FOURCC(a, b, c, d)                                       \
+	((uint32_t)(a) | ((uint32_t)(b) << 8) | ((uint32_t)(c) << 16) | \
+	 ((uint32_t)(d) << 24))
+#define DRM_FORMAT_ARGB8888 DRM_FOURCC('A', 'R', '2', '4')
+#define DRM_FORMAT_ABGR8888 DRM_FOURCC('A', 'B', '2', '4')
+#define DRM_FORMAT_MOD_INVALID 0x00ffffffffffffffULL
+#define MAX_DMABUF_PLANES 4
+
+/* what the graphics device can import, filled in by SharedTexturesAvailable.
+ * only touched inside the graphics context. */
+struct DmabufFormat {
+	uint32_t drm_format;
+	std::vector<uint64_t> modifiers;
+};
+
+static std::vector<DmabufFormat> dmabuf_formats;
+static bool dmabuf_implicit_modifiers = false;
+
+static bool DmabufSupported(uint32_t drm_format, uint64_t modifier)
+{
+	if (modifier == DRM_FORMAT_MOD_INVALID)
+		return dmabuf_implicit_modifiers;
+
+	for (const DmabufFormat &format : dmabuf_formats) {
+		if (format.drm_format == drm_format)
+			return std::find(format.modifiers.begin(),
+					 format.modifiers.end(),
+					 modifier) != format.modifiers.end();
+	}
+	return false;
+}
+#endif
 
-		bs->texture = gs_texture_create(cx, cy, format, 1, nullptr, 0);
+bool SharedTexturesAvailable(void)
+{
+#if defined(_WIN32) || defined(__APPLE__)
+	return gs_shared_texture_available();
 #else
-		bs->texture = gs_texture_open_shared(
-			(uint32_t)(uintptr_t)shared_handle);
+	enum gs_dmabuf_flags flags;
+	uint32_t *formats = nullptr;
+	size_t num_formats = 0;
+
+	if (!gs_query_dmabuf_capabilities(&flags, &formats, &num_formats))
+		return false;
+
+	dmabuf_formats.clear();
+	dmabuf_implicit_modifiers =
+		(flags & GS_DMABUF_FLAG_IMPLICIT_MODIFIERS_SUPPORTED) != 0;
+
+	for (size_t i = 0; i < num_formats; i++) {
+		if (formats[i] != DRM_FORMAT_ARGB8888 &&
+		    formats[i] != DRM_FORMAT_ABGR8888)
+			continue;
+
+		DmabufFormat format = {formats[i], {}};
+		uint64_t *modifiers = nullptr;
+		size_t num_modifiers = 0;
+
+		if (gs_query_dmabuf_modifiers_for_format(
+			    formats[i], &modifiers, &num_modifiers))
+			format.modifiers.assign(modifiers,
+						modifiers + num_modifiers);
+		bfree(modifiers);
+		dmabuf_formats.push_back(std::move(format));
+	}
+	bfree(formats);
+
+	/* CEF paints in BGRA unless told otherwise */
+	for (const DmabufFormat &format : dmabuf_formats) {
+		if (format.drm_format == DRM_FORMAT_ARGB8888)
+			return true;
+	}
+	return false;
 #endif
-		obs_leave_graphics();
+}
 
-		last_handle = shared_handle;
+static void *SharedTextureKey(const SharedTextureInfo &info)
+{
+#if CHROME_VERSION_BUILD < 6367
+	return info;
+#elif defined(_WIN32)
+	return info.shared_texture_handle;
+#elif defined(__APPLE__)
+	IOSurfaceRef surface = (IOSurfaceRef)info.shared_texture_io_surface;
+	return surface ? (void *)(uintptr_t)IOSurfaceGetID(surface) : nullptr;
+#else
+	/* the fds are only valid during the paint, but the inode stays the
+	 * same for as long as the buffer exists */
+	struct stat st;
+	if (!info.plane_count || fstat(info.planes[0].fd, &st) != 0)
+		return nullptr;
+	return (void *)(uintptr_t)st.st_ino;
+#endif
+}
+
+/* rect is what was painted, the view or the popup, in view coordinates */
+static gs_texture_t *OpenSharedTexture(const SharedTextureInfo &info,
+				       const CefRect &rect, int scale)
+{
+#if CHROME_VERSION_BUILD < 6367
+	(void)rect;
+	(void)scale;
+	return gs_texture_open_shared((uint32_t)(uintptr_t)info);
+#elif defined(_WIN32)
+	(void)rect;
+	(void)scale;
+	return gs_texture_open_nt_shared(
+		(uint32_t)(uintptr_t)info.shared_texture_handle);
+#elif defined(__APPLE__)
+	(void)rect;
+	(void)scale;
+	return gs_texture_create_from_iosurface(
+		info.shared_texture_io_surface);
+#else
+	bool bgra = info.format == CEF_COLOR_TYPE_BGRA_8888;
+	uint32_t drm_format = bgra ? DRM_FORMAT_ARGB8888 : DRM_FORMAT_ABGR8888;
+	if (!DmabufSupported(drm_format, info.modifier))
+		return nullptr;
+
+	int fds[MAX_DMABUF_PLANES];
+	uint32_t strides[MAX_DMABUF_PLANES];
+	uint32_t offsets[MAX_DMABUF_PLANES];
+	uint64_t modifiers[MAX_DMABUF_PLANES];
+	uint32_t planes = std::min((uint32_t)info.plane_count,
+				   (uint32_t)MAX_DMABUF_PLANES);
+
+	for (uint32_t i = 0; i < planes; i++) {
+		fds[i] = info.planes[i].fd;
+		strides[i] = info.planes[i].stride;
+		offsets[i] = (uint32_t)info.planes[i].offset;
+		modifiers[i] = info.modifier;
 	}
 
-#if USE_TEXTURE_COPY
-	if (texture && bs->texture) {
-		obs_enter_graphics();
-		gs_copy_texture(bs->texture, texture);
+	/* dmabufs don't carry their size.  paint infos do from 6778 on,
+	 * before that it's the painted size at the device scale factor. */
+#if CHROME_VERSION_BUILD >= 6778
+	(void)rect;
+	(void)scale;
+	uint32_t cx = (uint32_t)std::max(info.extra.coded_size.width, 1);
+	uint32_t cy = (uint32_t)std::max(info.extra.coded_size.height, 1);
+#else
+	uint32_t cx = (uint32_t)std::max((rect.width * scale + 99) / 100, 1);
+	uint32_t cy = (uint32_t)std::max((rect.height * scale + 99) / 100, 1);
+#endif
+
+	return gs_texture_create_from_dmabuf(
+		cx, cy, drm_format, bgra ? GS_BGRA : GS_RGBA, planes, fds,
+		strides, offsets,
+		info.modifier != DRM_FORMAT_MOD_INVALID ? modifiers : nullptr);
+#endif
+}
+
+/* copies a shared texture in to one the source owns, which is kept for as
+ * long as size and format stay the same */
+static bool CopySharedTexture(gs_texture_t *&dst, uint32_t &dst_cx,
+			      uint32_t &dst_cy, gs_texture_t *src, uint32_t cx,
+			      uint32_t cy)
+{
+	gs_color_format format = gs_texture_get_color_format(src);
+
+	if (!dst || dst_cx != cx || dst_cy != cy ||
+	    gs_texture_get_color_format(dst) != format) {
+		TexturePool::Release(dst);
+		dst = TexturePool::Acquire(cx, cy, format, 0);
+		dst_cx = dst ? cx : 0;
+		dst_cy = dst ? cy : 0;
+		if (!dst)
+			return false;
+	}
+
+	gs_copy_texture_region(dst, 0, 0, src, 0, 0, cx, cy);
+	return true;
+}
+
+#if CHROME_VERSION_BUILD < 6367
+gs_texture_t *BrowserClient::GetSharedTexture(void *shared_handle,
+					      const SharedTextureInfo &info)
+{
+	for (const SharedTexture &shared : shared_textures) {
+		if (shared.handle == shared_handle)
+			return shared.texture;
+	}
+
+	gs_texture_t *tex = OpenSharedTexture(info, CefRect(), 100);
+	if (!tex)
+		return nullptr;
+
+	uint32_t cx = gs_texture_get_width(tex);
+	uint32_t cy = gs_texture_get_height(tex);
+
+	/* CEF switches to a new set of shared textures when the view is
+	 * resized, so anything of a different size is never coming back */
+	for (size_t i = shared_textures.size(); i > 0; i--) {
+		const SharedTexture &shared = shared_textures[i - 1];
+		if (shared.cx != cx || shared.cy != cy)
+			DestroySharedTexture(i - 1);
+	}
+
+	if (shared_textures.size() >= MAX_SHARED_TEXTURES)
+		DestroySharedTexture(0);
+
+	shared_textures.push_back({shared_handle, tex, cx, cy});
+	return tex;
+}
+#endif
+
+void BrowserClient::ReleaseSharedTextures()
+{
+#if CHROME_VERSION_BUILD < 6367
+	obs_enter_graphics();
+	while (!shared_textures.empty())
+		DestroySharedTexture(shared_textures.size() - 1);
+	obs_leave_graphics();
+#endif
+	last_handle = nullptr;
+}
+
+#if CHROME_VERSION_BUILD >= 6367
+void BrowserClient::OnAcceleratedPaint(CefRefPtr<CefBrowser>,
+				       PaintElementType type, const RectList &,
+				       const CefAcceleratedPaintInfo &info)
+{
+	AcceleratedPaint(type, info);
+}
+#else
+void BrowserClient::OnAcceleratedPaint(CefRefPtr<CefBrowser>,
+				       PaintElementType type, const RectList &,
+				       void *shared_handle)
+{
+	AcceleratedPaint(type, shared_handle);
+}
+#endif
+
+void BrowserClient::AcceleratedPaint(PaintElementType type,
+				     const SharedTextureInfo &info)
+{
+	if (!bs) {
+		return;
+	}
+
+	bool popup = type == PET_POPUP;
+	if (popup && popupRect.IsEmpty()) {
+		return;
+	}
+
+	void *shared_handle = SharedTextureKey(info);
+	if (!shared_handle) {
+		return;
+	}
+
+	if (!popup) {
+		bs->CountPaint();
+		bs->accel_paint_ns = os_gettime_ns();
+	}
+
+	obs_enter_graphics();
+
+#if CHROME_VERSION_BUILD >= 6367
+	/* the handles are only valid during this call, and CEF paints in to
+	 * the texture again once it returns.  the texture is copied in to one
+	 * the source owns, and closed again right away. */
+	CefRect rect = popup ? popupRect : CefRect(0, 0, bs->width, bs->height);
+	gs_texture_t *shared = OpenSharedTexture(info, rect, bs->render_scale);
+#else
+	/* the textures CEF rotates through are opened once and then kept
+	 * around, so a steady stream of paints doesn't allocate anything */
+	gs_texture_t *shared = GetSharedTexture(shared_handle, info);
+#endif
+	if (!shared) {
 		obs_leave_graphics();
+		if (++open_failures == MAX_OPEN_FAILURES)
+			bs->FallBackToSoftwarePaint();
+		return;
 	}
+	open_failures = 0;
+
+	uint32_t cx = gs_texture_get_width(shared);
+	uint32_t cy = gs_texture_get_height(shared);
+#if CHROME_VERSION_BUILD >= 6778
+	/* textures can be padded past what was painted */
+	cx = std::min(cx, (uint32_t)std::max(info.extra.visible_rect.width, 1));
+	cy = std::min(cy,
+		      (uint32_t)std::max(info.extra.visible_rect.height, 1));
 #endif
+
+	if (popup) {
+		CopySharedTexture(bs->popup_texture, bs->popup_cx,
+				  bs->popup_cy, shared, cx, cy);
+		bs->popup_x = popupRect.x * bs->render_scale / 100;
+		bs->popup_y = popupRect.y * bs->render_scale / 100;
+	} else {
+		if (shared_handle != last_handle) {
+			last_handle = shared_handle;
+			bs->handle_changes++;
+		}
+
+#if CHROME_VERSION_BUILD >= 6367
+		CopySharedTexture(bs->texture, bs->texture_cx, bs->texture_cy,
+				  shared, cx, cy);
+#elif USE_TEXTURE_COPY
+		texture = shared;
+		CopySharedTexture(bs->texture, bs->texture_cx, bs->texture_cy,
+				  shared, cx, cy);
+#else
+		if (bs->texture != shared) {
+			if (!bs->texture_borrowed)
+				bs->DestroyTextures();
+
+			bs->texture = shared;
+			bs->texture_borrowed = true;
+			bs->texture_cx = cx;
+			bs->texture_cy = cy;
+		}
+#endif
+	}
+
+#if CHROME_VERSION_BUILD >= 6367
+	gs_texture_destroy(shared);
+#endif
+
+	obs_leave_graphics();
 }
 #endif
 
@@ -291,7 +720,36 @@ void BrowserClient::OnAudioStreamStarted(CefRefPtr<CefBrowser> browser, int id,
 		return;
 	}
 
+	std::lock_guard<std::mutex> lock(bs->audio_streams_mutex);
 	AudioStream &stream = bs->audio_streams[id];
+
+	stream.speakers = GetSpeakerLayout(channel_layout);
+	stream.channels = get_audio_channels(stream.speakers);
+	stream.sample_rate = sample_rate;
+
+	if (direct_audio) {
+		/* packets are converted to the output format on arrival, so
+		 * a format change means a new stream */
+		const struct audio_output_info *info =
+			audio_output_get_info(obs_get_audio());
+		std::shared_ptr<DirectAudioStream> direct =
+			std::make_shared<DirectAudioStream>(
+				stream.speakers, (uint32_t)sample_rate,
+				info->speakers, info->samples_per_sec);
+
+		std::lock_guard<std::mutex> sources_lock(
+			bs->audio_sources_mutex);
+		auto &streams = bs->direct_streams;
+		auto it = std::find(streams.begin(), streams.end(),
+				    stream.direct);
+		if (it != streams.end())
+			*it = direct;
+		else
+			streams.push_back(direct);
+		stream.direct = direct;
+		return;
+	}
+
 	if (!stream.source) {
 		stream.source = obs_source_create_private("audio_line", nullptr,
 							  nullptr);
@@ -299,13 +757,10 @@ void BrowserClient::OnAudioStreamStarted(CefRefPtr<CefBrowser> browser, int id,
 
 		obs_source_add_active_child(bs->source, stream.source);
 
-		std::lock_guard<std::mutex> lock(bs->audio_sources_mutex);
+		std::lock_guard<std::mutex> sources_lock(
+			bs->audio_sources_mutex);
 		bs->audio_sources.push_back(stream.source);
 	}
-
-	stream.speakers = GetSpeakerLayout(channel_layout);
-	stream.channels = get_audio_channels(stream.speakers);
-	stream.sample_rate = sample_rate;
 }
 
 void BrowserClient::OnAudioStreamPacket(CefRefPtr<CefBrowser> browser, int id,
@@ -316,7 +771,20 @@ void BrowserClient::OnAudioStreamPacket(CefRefPtr<CefBrowser> browser, int id,
 		return;
 	}
 
-	AudioStream &stream = bs->audio_streams[id];
+	std::lock_guard<std::mutex> lock(bs->audio_streams_mutex);
+	auto pair = bs->audio_streams.find(id);
+	if (pair == bs->audio_streams.end()) {
+		return;
+	}
+
+	bs->audio_packets++;
+
+	AudioStream &stream = pair->second;
+	if (stream.direct) {
+		stream.direct->Write(data, frames, pts);
+		return;
+	}
+
 	struct obs_source_audio audio = {};
 
 	const uint8_t **pcm = (const uint8_t **)data;
@@ -338,6 +806,7 @@ void BrowserClient::OnAudioStreamStopped(CefRefPtr<CefBrowser> browser, int id)
 		return;
 	}
 
+	std::lock_guard<std::mutex> lock(bs->audio_streams_mutex);
 	auto pair = bs->audio_streams.find(id);
 	if (pair == bs->audio_streams.end()) {
 		return;
@@ -345,7 +814,8 @@ void BrowserClient::OnAudioStreamStopped(CefRefPtr<CefBrowser> browser, int id)
 
 	AudioStream &stream = pair->second;
 	{
-		std::lock_guard<std::mutex> lock(bs->audio_sources_mutex);
+		std::lock_guard<std::mutex> sources_lock(
+			bs->audio_sources_mutex);
 		for (size_t i = 0; i < bs->audio_sources.size(); i++) {
 			obs_source_t *source = bs->audio_sources[i];
 			if (source == stream.source) {
@@ -354,29 +824,34 @@ void BrowserClient::OnAudioStreamStopped(CefRefPtr<CefBrowser> browser, int id)
 				break;
 			}
 		}
+
+		auto &streams = bs->direct_streams;
+		streams.erase(std::remove(streams.begin(), streams.end(),
+					  stream.direct),
+			      streams.end());
 	}
+
+	if (stream.direct && stream.direct->dropped_packets)
+		blog(LOG_DEBUG,
+		     "[obs-browser: '%s'] direct audio stream %d dropped "
+		     "%" PRIu64 " packets",
+		     obs_source_get_name(bs->source), id,
+		     (uint64_t)stream.direct->dropped_packets);
+
 	bs->audio_streams.erase(pair);
 }
 #endif
 
-void BrowserClient::OnLoadEnd(CefRefPtr<CefBrowser>, CefRefPtr<CefFrame> frame,
-			      int)
+void SendPageInjection(CefRefPtr<CefBrowser> browser, const std::string &css,
+		       const std::string &script, bool apply_css)
 {
-	if (!bs) {
-		return;
-	}
-
-	if (frame->IsMain()) {
-		std::string base64EncodedCSS = base64_encode(bs->css);
-
-		std::string script;
-		script += "const obsCSS = document.createElement('style');";
-		script += "obsCSS.innerHTML = atob(\"" + base64EncodedCSS +
-			  "\");";
-		script += "document.querySelector('head').appendChild(obsCSS);";
-
-		frame->ExecuteJavaScript(script, "", 0);
-	}
+	CefRefPtr<CefProcessMessage> msg =
+		CefProcessMessage::Create("PageInjection");
+	CefRefPtr<CefListValue> args = msg->GetArgumentList();
+	args->SetString(0, css);
+	args->SetString(1, script);
+	args->SetBool(2, apply_css);
+	SendBrowserProcessMessage(browser, PID_RENDERER, msg);
 }
 
 bool BrowserClient::OnConsoleMessage(CefRefPtr<CefBrowser>,
@@ -22,31 +22,79 @@
 #include "cef-headers.hpp"
 #include "browser-config.h"
 
+#include <vector>
+#include <string>
+
 #define USE_TEXTURE_COPY 0
 
+/* CEF only ever rotates through a couple of shared textures at a time */
+#define MAX_SHARED_TEXTURES 4
+
+/* a source falls back to software paints once this many shared textures
+ * in a row couldn't be opened */
+#define MAX_OPEN_FAILURES 3
+
+#if EXPERIMENTAL_SHARED_TEXTURE_SUPPORT_ENABLED
+/* what an accelerated paint hands over: a D3D11 shared handle on older
+ * versions, and a D3D11 NT handle, an IOSurface or dmabuf planes after */
+#if CHROME_VERSION_BUILD >= 6367
+typedef CefAcceleratedPaintInfo SharedTextureInfo;
+#else
+typedef void *SharedTextureInfo;
+#endif
+
+/* has to be called in the graphics context */
+bool SharedTexturesAvailable(void);
+#endif
+
 struct BrowserSource;
 
 class BrowserClient : public CefClient,
 		      public CefDisplayHandler,
 		      public CefLifeSpanHandler,
+		      public CefLoadHandler,
 		      public CefContextMenuHandler,
-		      public CefRenderHandler,
 #if CHROME_VERSION_BUILD >= 3683
 		      public CefAudioHandler,
 #endif
-		      public CefLoadHandler {
+		      public CefRenderHandler {
 
 #if EXPERIMENTAL_SHARED_TEXTURE_SUPPORT_ENABLED
+#if CHROME_VERSION_BUILD < 6367
+	/* textures are looked up by a key that stays the same for as long as
+	 * CEF keeps a texture in rotation, see SharedTextureKey.  from 6367 on
+	 * the handles are only valid during the paint, so nothing is kept. */
+	struct SharedTexture {
+		void *handle;
+		gs_texture_t *texture;
+		uint32_t cx;
+		uint32_t cy;
+	};
+
+	std::vector<SharedTexture> shared_textures;
 #if USE_TEXTURE_COPY
 	gs_texture_t *texture = nullptr;
 #endif
-	void *last_handle = INVALID_HANDLE_VALUE;
+
+	void DestroySharedTexture(size_t idx);
+	gs_texture_t *GetSharedTexture(void *shared_handle,
+				       const SharedTextureInfo &info);
+#endif
+	void *last_handle = nullptr;
+	/* consecutive shared textures that couldn't be opened */
+	int open_failures = 0;
+
+	void ReleaseSharedTextures();
+	void AcceleratedPaint(PaintElementType type,
+			      const SharedTextureInfo &info);
 #endif
 	bool sharing_available = false;
 	bool reroute_audio = true;
 
 public:
 	BrowserSource *bs;
+	/* kept around for a source to take over, see AddSpareBrowser */
+	bool spare = false;
 	CefRect popupRect;
 	CefRect originalPopupRect;
 
@@ -60,11 +108,16 @@ public:
 
 	virtual ~BrowserClient();
 
+	/* stops the client from touching the source, called on the CEF
+	 * thread when the browser is being destroyed */
+	void DetachSource();
+	void AttachSource(BrowserSource *bs_, bool reroute_audio_);
+
 	/* CefClient */
-	virtual CefRefPtr<CefLoadHandler> GetLoadHandler() override;
 	virtual CefRefPtr<CefRenderHandler> GetRenderHandler() override;
 	virtual CefRefPtr<CefDisplayHandler> GetDisplayHandler() override;
 	virtual CefRefPtr<CefLifeSpanHandler> GetLifeSpanHandler() override;
+	virtual CefRefPtr<CefLoadHandler> GetLoadHandler() override;
 	virtual CefRefPtr<CefContextMenuHandler>
 	GetContextMenuHandler() override;
 #if CHROME_VERSION_BUILD >= 3683
@@ -101,6 +154,13 @@ public:
 		      CefRefPtr<CefDictionaryValue> &extra_info,
 #endif
 		      bool *no_javascript_access) override;
+	virtual void OnAfterCreated(CefRefPtr<CefBrowser> browser) override;
+	virtual void OnBeforeClose(CefRefPtr<CefBrowser> browser) override;
+
+	/* CefLoadHandler */
+	virtual void OnLoadStart(CefRefPtr<CefBrowser> browser,
+				 CefRefPtr<CefFrame> frame,
+				 TransitionType transition_type) override;
 
 	/* CefContextMenuHandler */
 	virtual void
@@ -116,16 +176,29 @@ public:
 	virtual bool GetViewRect(
 #endif
 		CefRefPtr<CefBrowser> browser, CefRect &rect) override;
+	virtual bool GetScreenInfo(CefRefPtr<CefBrowser> browser,
+				   CefScreenInfo &screen_info) override;
+	virtual void OnPopupShow(CefRefPtr<CefBrowser> browser,
+				 bool show) override;
+	virtual void OnPopupSize(CefRefPtr<CefBrowser> browser,
+				 const CefRect &rect) override;
 	virtual void OnPaint(CefRefPtr<CefBrowser> browser,
 			     PaintElementType type, const RectList &dirtyRects,
 			     const void *buffer, int width,
 			     int height) override;
 #if EXPERIMENTAL_SHARED_TEXTURE_SUPPORT_ENABLED
+#if CHROME_VERSION_BUILD >= 6367
+	virtual void
+	OnAcceleratedPaint(CefRefPtr<CefBrowser> browser, PaintElementType type,
+			   const RectList &dirtyRects,
+			   const CefAcceleratedPaintInfo &info) override;
+#else
 	virtual void OnAcceleratedPaint(CefRefPtr<CefBrowser> browser,
 					PaintElementType type,
 					const RectList &dirtyRects,
 					void *shared_handle) override;
 #endif
+#endif
 #if CHROME_VERSION_BUILD >= 3683
 	virtual void OnAudioStreamPacket(CefRefPtr<CefBrowser> browser,
 					 int audio_stream_id,
@@ -142,10 +215,12 @@ public:
 					  int frames_per_buffer) override;
 
 #endif
-	/* CefLoadHandler */
-	virtual void OnLoadEnd(CefRefPtr<CefBrowser> browser,
-			       CefRefPtr<CefFrame> frame,
-			       int httpStatusCode) override;
 
 	IMPLEMENT_REFCOUNTING(BrowserClient);
 };
+
+/* hands a source's custom CSS and script to its renderer, which applies
+ * them to every page from when its document is created.  with apply_css,
+ * the CSS also replaces that of the current page. */
+void SendPageInjection(CefRefPtr<CefBrowser> browser, const std::string &css,
+		       const std::string &script, bool apply_css);
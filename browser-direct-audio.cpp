@@ -0,0 +1,187 @@
+#include "browser-direct-audio.hpp"
+#include "browser-audio-mix.hpp"
+
+#include <util/util_uint64.h>
+#include <util/platform.h>
+#include <string.h>
+
+static inline uint64_t FramesToNs(uint32_t sample_rate, uint64_t frames)
+{
+	return util_mul_div64(frames, 1000000000ULL, sample_rate);
+}
+
+DirectAudioStream::DirectAudioStream(speaker_layout in_speakers_,
+				     uint32_t in_sample_rate_,
+				     speaker_layout out_speakers,
+				     uint32_t out_sample_rate)
+	: channels(get_audio_channels(out_speakers)),
+	  sample_rate(out_sample_rate),
+	  in_speakers(in_speakers_),
+	  in_channels(get_audio_channels(in_speakers_)),
+	  in_sample_rate(in_sample_rate_)
+{
+	buffer.resize(DIRECT_AUDIO_SLOTS * channels *
+		      DIRECT_AUDIO_SLOT_FRAMES);
+
+	if (in_speakers != out_speakers || in_sample_rate != out_sample_rate) {
+		struct resample_info src = {in_sample_rate,
+					    AUDIO_FORMAT_FLOAT_PLANAR,
+					    in_speakers};
+		struct resample_info dst = {out_sample_rate,
+					    AUDIO_FORMAT_FLOAT_PLANAR,
+					    out_speakers};
+		resampler = audio_resampler_create(&dst, &src);
+		if (!resampler)
+			blog(LOG_WARNING, "[obs-browser]: Failed to create "
+					  "audio resampler for direct audio");
+	}
+}
+
+DirectAudioStream::~DirectAudioStream()
+{
+	audio_resampler_destroy(resampler);
+}
+
+void DirectAudioStream::Write(const float **data, int frames, int64_t pts)
+{
+	const uint8_t *in[MAX_AV_PLANES] = {};
+	uint8_t *out[MAX_AV_PLANES] = {};
+	uint32_t out_frames = (uint32_t)frames;
+	uint64_t pts_ns = (uint64_t)pts * 1000000ULL;
+
+	/* the offset to the OBS clock is taken from the first packet, and
+	 * again whenever the packets jump, like libobs does for async audio */
+	uint64_t diff = pts_ns > next_pts_ns ? pts_ns - next_pts_ns
+					     : next_pts_ns - pts_ns;
+	if (!clock_synced || diff > DIRECT_AUDIO_JITTER_NS) {
+		clock_offset = os_gettime_ns() - pts_ns;
+		clock_synced = true;
+	}
+	next_pts_ns = pts_ns + FramesToNs(in_sample_rate, (uint64_t)frames);
+
+	uint64_t ts = pts_ns + clock_offset;
+
+	for (size_t ch = 0; ch < in_channels && ch < MAX_AV_PLANES; ch++)
+		in[ch] = (const uint8_t *)data[ch];
+
+	if (resampler) {
+		uint64_t resample_offset = 0;
+		if (!audio_resampler_resample(resampler, out, &out_frames,
+					      &resample_offset, in,
+					      (uint32_t)frames))
+			return;
+		ts -= resample_offset;
+	} else if (in_channels == channels) {
+		for (size_t ch = 0; ch < channels; ch++)
+			out[ch] = (uint8_t *)in[ch];
+	} else {
+		/* no resampler to fix up the layout */
+		return;
+	}
+
+	/* packets larger than a slot are split up over several */
+	uint32_t offset = 0;
+	while (offset < out_frames) {
+		uint32_t wi = write_index.load(std::memory_order_relaxed);
+		uint32_t ri = read_index.load(std::memory_order_acquire);
+		if (wi - ri == DIRECT_AUDIO_SLOTS) {
+			dropped_packets++;
+			return;
+		}
+
+		uint32_t count = out_frames - offset;
+		if (count > DIRECT_AUDIO_SLOT_FRAMES)
+			count = DIRECT_AUDIO_SLOT_FRAMES;
+
+		for (size_t ch = 0; ch < channels; ch++)
+			memcpy(SlotData(wi, ch),
+			       (const float *)out[ch] + offset,
+			       count * sizeof(float));
+
+		Slot &slot = slots[wi % DIRECT_AUDIO_SLOTS];
+		slot.timestamp = ts + FramesToNs(sample_rate, offset);
+		slot.frames = count;
+
+		write_index.store(wi + 1, std::memory_order_release);
+		offset += count;
+	}
+}
+
+void DirectAudioStream::SyncToHead()
+{
+	if (head_synced)
+		return;
+
+	const Slot &slot =
+		slots[read_index.load(std::memory_order_relaxed) %
+		      DIRECT_AUDIO_SLOTS];
+	uint64_t slot_ts =
+		slot.timestamp + FramesToNs(sample_rate, read_offset);
+	uint64_t diff = slot_ts > next_ts ? slot_ts - next_ts
+					  : next_ts - slot_ts;
+
+	if (!started || diff > DIRECT_AUDIO_JITTER_NS) {
+		next_ts = slot_ts;
+		started = true;
+	}
+
+	head_synced = true;
+}
+
+bool DirectAudioStream::Peek(uint64_t &ts, size_t frames)
+{
+	uint32_t ri = read_index.load(std::memory_order_relaxed);
+	uint32_t wi = write_index.load(std::memory_order_acquire);
+	size_t available = 0;
+
+	/* the first slot may have been read from partially already */
+	for (uint32_t i = ri; i != wi && available < frames + read_offset; i++)
+		available += slots[i % DIRECT_AUDIO_SLOTS].frames;
+	if (ri != wi)
+		available -= read_offset;
+
+	if (available < frames)
+		return false;
+
+	SyncToHead();
+	ts = next_ts;
+	return true;
+}
+
+void DirectAudioStream::Read(float *const *out, size_t frames, bool mix)
+{
+	size_t done = 0;
+
+	while (done < frames) {
+		uint32_t ri = read_index.load(std::memory_order_relaxed);
+		if (ri == write_index.load(std::memory_order_acquire))
+			break;
+
+		SyncToHead();
+
+		const Slot &slot = slots[ri % DIRECT_AUDIO_SLOTS];
+		size_t count = slot.frames - read_offset;
+		if (count > frames - done)
+			count = frames - done;
+
+		for (size_t ch = 0; ch < channels; ch++) {
+			const float *in = SlotData(ri, ch) + read_offset;
+			if (mix)
+				mix_audio(out[ch] + done, in, count);
+			else
+				memcpy(out[ch] + done, in,
+				       count * sizeof(float));
+		}
+
+		done += count;
+		read_offset += (uint32_t)count;
+
+		if (read_offset == slot.frames) {
+			read_offset = 0;
+			head_synced = false;
+			read_index.store(ri + 1, std::memory_order_release);
+		}
+	}
+
+	next_ts += FramesToNs(sample_rate, done);
+}
@@ -0,0 +1,84 @@
+#pragma once
+
+#include <obs.h>
+#include <media-io/audio-resampler.h>
+#include <atomic>
+#include <vector>
+
+#define DIRECT_AUDIO_SLOTS 32
+#define DIRECT_AUDIO_SLOT_FRAMES 1024
+
+/* packets that land within this much of where the previous one ended are
+ * treated as contiguous, anything further off resyncs the stream */
+#define DIRECT_AUDIO_JITTER_NS 20000000ULL
+
+/* Audio of a single CEF audio stream, handed straight from the CEF audio
+ * thread to BrowserSource::AudioMix on the OBS audio thread.
+ *
+ * Packets are converted to the OBS output format when they arrive, and put
+ * in to a lock-free single producer/single consumer ring of fixed size
+ * slots, each with the timestamp of its first frame.  If the mixer falls
+ * behind far enough for the ring to fill up, new packets are dropped.
+ *
+ * The mixer keeps its own running timestamp, and only takes the one of a
+ * slot when it's further off than DIRECT_AUDIO_JITTER_NS, so the small
+ * irregularities in CEF packet timestamps don't make it to the output. */
+class DirectAudioStream {
+	struct Slot {
+		uint64_t timestamp;
+		uint32_t frames;
+	};
+
+	Slot slots[DIRECT_AUDIO_SLOTS];
+	std::vector<float> buffer;
+	size_t channels;
+	uint32_t sample_rate;
+
+	speaker_layout in_speakers;
+	size_t in_channels;
+	uint32_t in_sample_rate;
+	audio_resampler_t *resampler = nullptr;
+
+	/* producer state.  CEF timestamps are milliseconds since the epoch,
+	 * and are moved on to the os_gettime_ns clock libobs mixes on */
+	uint64_t clock_offset = 0;
+	uint64_t next_pts_ns = 0;
+	bool clock_synced = false;
+
+	std::atomic<uint32_t> write_index = {0};
+	std::atomic<uint32_t> read_index = {0};
+
+	/* consumer state */
+	uint32_t read_offset = 0;
+	uint64_t next_ts = 0;
+	bool started = false;
+	bool head_synced = false;
+
+	inline float *SlotData(uint32_t index, size_t ch)
+	{
+		return buffer.data() +
+		       ((index % DIRECT_AUDIO_SLOTS) * channels + ch) *
+			       DIRECT_AUDIO_SLOT_FRAMES;
+	}
+
+	void SyncToHead();
+
+public:
+	std::atomic<uint64_t> dropped_packets = {0};
+
+	DirectAudioStream(speaker_layout in_speakers, uint32_t in_sample_rate,
+			  speaker_layout out_speakers,
+			  uint32_t out_sample_rate);
+	~DirectAudioStream();
+
+	DirectAudioStream(const DirectAudioStream &) = delete;
+	DirectAudioStream &operator=(const DirectAudioStream &) = delete;
+
+	/* CEF audio thread only */
+	void Write(const float **data, int frames, int64_t pts);
+
+	/* OBS audio thread only.  Peek returns false if less than frames are
+	 * buffered, otherwise sets ts to the timestamp of the next frame. */
+	bool Peek(uint64_t &ts, size_t frames);
+	void Read(float *const *out, size_t frames, bool mix);
+};
@@ -0,0 +1,53 @@
+#include "browser-memory.hpp"
+
+#ifdef _WIN32
+#include <windows.h>
+#include <psapi.h>
+#elif __APPLE__
+#include <libproc.h>
+#include <sys/resource.h>
+#else
+#include <stdio.h>
+#include <unistd.h>
+#endif
+
+uint64_t GetProcessResidentBytes(int pid)
+{
+	if (pid <= 0)
+		return 0;
+
+#ifdef _WIN32
+	HANDLE process =
+		OpenProcess(PROCESS_QUERY_LIMITED_INFORMATION, false, pid);
+	if (!process)
+		return 0;
+
+	PROCESS_MEMORY_COUNTERS pmc = {};
+	BOOL success = GetProcessMemoryInfo(process, &pmc, sizeof(pmc));
+	CloseHandle(process);
+	return success ? (uint64_t)pmc.WorkingSetSize : 0;
+
+#elif __APPLE__
+	/* the footprint is what the system goes by when it's low on memory */
+	struct rusage_info_v2 info;
+	if (proc_pid_rusage(pid, RUSAGE_INFO_V2, (rusage_info_t *)&info) != 0)
+		return 0;
+	return info.ri_phys_footprint;
+
+#else
+	char path[64];
+	snprintf(path, sizeof(path), "/proc/%d/statm", pid);
+
+	FILE *file = fopen(path, "r");
+	if (!file)
+		return 0;
+
+	unsigned long long size = 0, resident = 0;
+	int count = fscanf(file, "%llu %llu", &size, &resident);
+	fclose(file);
+
+	if (count != 2)
+		return 0;
+	return (uint64_t)resident * (uint64_t)sysconf(_SC_PAGESIZE);
+#endif
+}
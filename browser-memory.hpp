@@ -0,0 +1,14 @@
+#pragma once
+
+#include <stdint.h>
+
+/* Renderer memory is polled this often, see UpdateRendererMemory.  The
+ * budget and limits are only checked when it's polled. */
+#define MEMORY_POLL_INTERVAL_NS 5000000000ULL
+
+/* a source isn't refreshed for going over its memory limit more often than
+ * this, in case a fresh page doesn't get it back under */
+#define MEMORY_REFRESH_COOLDOWN_NS 60000000000ULL
+
+/* resident memory of a process, or 0 if it can't be read */
+uint64_t GetProcessResidentBytes(int pid);
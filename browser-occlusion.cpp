@@ -0,0 +1,250 @@
+#include "browser-occlusion.hpp"
+
+#include <graphics/matrix4.h>
+#include <graphics/vec3.h>
+
+#include <algorithm>
+#include <vector>
+#include <math.h>
+#include <string.h>
+
+using namespace std;
+
+struct OcclusionRect {
+	float x0, y0, x1, y1;
+
+	inline bool Empty() const { return x1 <= x0 || y1 <= y0; }
+
+	inline bool Contains(const OcclusionRect &r) const
+	{
+		return x0 <= r.x0 && y0 <= r.y0 && x1 >= r.x1 && y1 >= r.y1;
+	}
+};
+
+/* scene items in drawing order, bottom first */
+struct OcclusionItem {
+	obs_source_t *source;
+	OcclusionRect rect;
+	bool visible;
+	bool opaque;
+};
+
+struct OcclusionScene {
+	const unordered_set<obs_source_t *> *sources;
+	/* scenes that are items of other scenes */
+	unordered_set<obs_source_t *> *nested;
+	obs_source_t *source;
+	vector<OcclusionItem> items;
+	struct matrix4 parent;
+	bool in_group;
+};
+
+static bool HasColorFilterAtZero(obs_source_t *source)
+{
+	bool transparent = false;
+
+	auto check_filter = [](obs_source_t *, obs_source_t *filter,
+			       void *param) {
+		bool &transparent = *static_cast<bool *>(param);
+		if (transparent || !obs_source_enabled(filter))
+			return;
+
+		const char *id = obs_source_get_unversioned_id(filter);
+		if (!id || strcmp(id, "color_filter") != 0)
+			return;
+
+		/* 0 to 100 in the first version of the filter, and 0 to 1
+		 * after that, both are 0 when fully transparent */
+		obs_data_t *settings = obs_source_get_settings(filter);
+		if (obs_data_get_double(settings, "opacity") <= 0.0)
+			transparent = true;
+		obs_data_release(settings);
+	};
+
+	obs_source_enum_filters(source, check_filter, &transparent);
+	return transparent;
+}
+
+static bool IsOpaqueColorSource(obs_sceneitem_t *item, obs_source_t *source)
+{
+	if (obs_sceneitem_get_blending_mode(item) != OBS_BLEND_NORMAL)
+		return false;
+	if (obs_source_filter_count(source) > 0)
+		return false;
+
+	const char *id = obs_source_get_unversioned_id(source);
+	if (!id || strcmp(id, "color_source") != 0)
+		return false;
+
+	/* ABGR, alpha in the top byte */
+	obs_data_t *settings = obs_source_get_settings(source);
+	uint32_t color = (uint32_t)obs_data_get_int(settings, "color");
+	obs_data_release(settings);
+	return (color >> 24) == 0xFF;
+}
+
+static bool IsCroppedAway(obs_sceneitem_t *item, obs_source_t *source)
+{
+	uint32_t cx = obs_source_get_width(source);
+	uint32_t cy = obs_source_get_height(source);
+	if (!cx || !cy)
+		return true;
+
+	struct obs_sceneitem_crop crop;
+	obs_sceneitem_get_crop(item, &crop);
+	return (uint32_t)(crop.left + crop.right) >= cx ||
+	       (uint32_t)(crop.top + crop.bottom) >= cy;
+}
+
+/* the bounding rect of the item in scene coordinates, and whether the
+ * item fills all of it */
+static OcclusionRect GetItemRect(obs_sceneitem_t *item,
+				 const struct matrix4 *parent,
+				 bool *axis_aligned)
+{
+	struct matrix4 transform;
+	obs_sceneitem_get_box_transform(item, &transform);
+	if (parent)
+		matrix4_mul(&transform, &transform, parent);
+
+	OcclusionRect rect = {INFINITY, INFINITY, -INFINITY, -INFINITY};
+	for (int corner = 0; corner < 4; corner++) {
+		struct vec3 pos;
+		vec3_set(&pos, (float)(corner & 1), (float)(corner >> 1), 0.0f);
+		vec3_transform(&pos, &pos, &transform);
+
+		rect.x0 = min(rect.x0, pos.x);
+		rect.y0 = min(rect.y0, pos.y);
+		rect.x1 = max(rect.x1, pos.x);
+		rect.y1 = max(rect.y1, pos.y);
+	}
+
+	*axis_aligned = fabsf(transform.x.y) < 1e-4f &&
+			fabsf(transform.y.x) < 1e-4f;
+	return rect;
+}
+
+static bool AddSceneItem(obs_scene_t *, obs_sceneitem_t *item, void *param)
+{
+	OcclusionScene &scene = *static_cast<OcclusionScene *>(param);
+	if (!obs_sceneitem_visible(item))
+		return true;
+
+	if (obs_sceneitem_is_group(item)) {
+		/* groups can't be nested, so the children only need the
+		 * transform of the group itself */
+		OcclusionScene group = {scene.sources, scene.nested,
+					scene.source, {}, {}, true};
+		obs_sceneitem_get_draw_transform(item, &group.parent);
+		obs_sceneitem_group_enum_items(item, AddSceneItem, &group);
+
+		scene.items.insert(scene.items.end(), group.items.begin(),
+				   group.items.end());
+		return true;
+	}
+
+	obs_source_t *source = obs_sceneitem_get_source(item);
+	if (obs_scene_from_source(source))
+		scene.nested->insert(source);
+
+	bool target = scene.sources->count(source) != 0;
+	bool opaque = !target && IsOpaqueColorSource(item, source);
+	if (!target && !opaque)
+		return true;
+
+	bool axis_aligned;
+	OcclusionItem entry;
+	entry.source = source;
+	entry.rect = GetItemRect(item, scene.in_group ? &scene.parent : nullptr,
+				 &axis_aligned);
+	entry.opaque = opaque && axis_aligned;
+	entry.visible = !entry.rect.Empty() &&
+			!(target && (IsCroppedAway(item, source) ||
+				     HasColorFilterAtZero(source)));
+
+	if (target || entry.opaque)
+		scene.items.push_back(entry);
+	return true;
+}
+
+unordered_set<obs_source_t *>
+Occlusion::FindOccluded(const unordered_set<obs_source_t *> &sources)
+{
+	struct State {
+		const unordered_set<obs_source_t *> *sources;
+		unordered_set<obs_source_t *> nested;
+		vector<OcclusionScene> scenes;
+	} state = {&sources, {}, {}};
+
+	if (sources.empty())
+		return {};
+
+	auto add_scene = [](void *param, obs_source_t *scene_source) {
+		State &state = *static_cast<State *>(param);
+
+		/* group children are looked at along with their scene */
+		if (obs_source_is_group(scene_source) ||
+		    !obs_source_showing(scene_source))
+			return true;
+
+		OcclusionScene scene = {state.sources, &state.nested,
+					scene_source, {}, {}, false};
+		obs_scene_enum_items(obs_scene_from_source(scene_source),
+				     AddSceneItem, &scene);
+		state.scenes.push_back(std::move(scene));
+		return true;
+	};
+
+	obs_enum_scenes(add_scene, &state);
+
+	unordered_set<obs_source_t *> seen;
+	unordered_set<obs_source_t *> visible;
+
+	for (const OcclusionScene &scene : state.scenes) {
+		/* nested scenes aren't clipped to their size, what's outside of
+		 * them is still drawn in the scene they're in */
+		bool nested = state.nested.count(scene.source) != 0;
+		OcclusionRect canvas = {
+			nested ? -INFINITY : 0.0f, nested ? -INFINITY : 0.0f,
+			nested ? INFINITY
+			       : (float)obs_source_get_width(scene.source),
+			nested ? INFINITY
+			       : (float)obs_source_get_height(scene.source)};
+
+		for (size_t i = 0; i < scene.items.size(); i++) {
+			const OcclusionItem &item = scene.items[i];
+			if (item.opaque)
+				continue;
+
+			seen.insert(item.source);
+			if (!item.visible)
+				continue;
+
+			OcclusionRect rect = {max(item.rect.x0, canvas.x0),
+					      max(item.rect.y0, canvas.y0),
+					      min(item.rect.x1, canvas.x1),
+					      min(item.rect.y1, canvas.y1)};
+			if (rect.Empty())
+				continue;
+
+			bool covered = false;
+			for (size_t j = i + 1; j < scene.items.size(); j++) {
+				const OcclusionItem &above = scene.items[j];
+				if (above.opaque && above.rect.Contains(rect)) {
+					covered = true;
+					break;
+				}
+			}
+
+			if (!covered)
+				visible.insert(item.source);
+		}
+	}
+
+	unordered_set<obs_source_t *> occluded;
+	for (obs_source_t *source : seen) {
+		if (!visible.count(source))
+			occluded.insert(source);
+	}
+	return occluded;
+}
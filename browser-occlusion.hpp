@@ -0,0 +1,24 @@
+#pragma once
+
+#include <obs.h>
+#include <unordered_set>
+
+/* Effective visibility of sources in the scene graph.
+ *
+ * A source that is shown can still be impossible to see: every scene item
+ * of it can be outside of its scene, cropped to nothing, faded out by an
+ * opacity filter or covered by an opaque item above it.  Only opaque color
+ * sources count as covering anything, as nothing is known about the alpha
+ * of other sources.
+ *
+ * Only the scene items of a source are looked at here.  Sources that are
+ * also drawn outside of scenes, like in projectors or property previews,
+ * have to be told apart by the caller.  Has to be called on the graphics
+ * thread. */
+
+namespace Occlusion {
+/* returns the ones of sources that have visible scene items in scenes that
+ * are showing, yet none that can actually be seen */
+std::unordered_set<obs_source_t *>
+FindOccluded(const std::unordered_set<obs_source_t *> &sources);
+}
@@ -17,10 +17,468 @@
  ******************************************************************************/
 
 #include "browser-scheme.hpp"
-#include "wide-string.hpp"
-#include <include/wrapper/cef_stream_resource_handler.h>
+#include <util/platform.h>
+#include <util/dstr.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <unordered_map>
+#include <algorithm>
+#include <memory>
+#include <vector>
+#include <string.h>
+#include <stdio.h>
+#include <time.h>
+#include <mutex>
+#include <atomic>
+#include <functional>
+#include <list>
+
+/* files up to this size are kept in memory, larger ones (usually videos)
+ * are read from disk as they are requested */
+#define MAX_CACHED_FILE_SIZE (8 * 1024 * 1024)
+#define CACHE_BUDGET (64 * 1024 * 1024)
+
+struct LocalFile {
+	std::string mime_type;
+	int64 size;
+	int64 mtime;
+	std::vector<char> data;
+};
+
+typedef std::shared_ptr<const LocalFile> LocalFilePtr;
+
+struct CacheEntry {
+	LocalFilePtr file;
+	std::list<std::string>::iterator lru;
+};
+
+static std::mutex cache_mutex;
+static std::unordered_map<std::string, CacheEntry> cache;
+static std::list<std::string> cache_lru;
+static size_t cache_bytes = 0;
+
+static std::string GetMimeType(const std::string &path)
+{
+	size_t dot = path.find_last_of('.');
+	size_t slash = path.find_last_of('/');
+	if (dot == std::string::npos ||
+	    (slash != std::string::npos && dot < slash))
+		return "application/octet-stream";
+
+	std::string fileExtension = path.substr(dot + 1);
+	for (char &ch : fileExtension)
+		ch = (char)tolower(ch);
+	if (fileExtension.compare("woff2") == 0)
+		fileExtension = "woff";
+
+	std::string mime_type = CefGetMimeType(fileExtension);
+	return mime_type.empty() ? "application/octet-stream" : mime_type;
+}
+
+static void EvictFile(const std::string &path)
+{
+	auto it = cache.find(path);
+	if (it == cache.end())
+		return;
+
+	cache_bytes -= it->second.file->data.size();
+	cache_lru.erase(it->second.lru);
+	cache.erase(it);
+}
+
+/* overlays poll text and JSON files that get rewritten several times a
+ * second, often with the same length, so seconds aren't enough */
+static int64 GetMtimeNs(const struct stat &st)
+{
+#if defined(__APPLE__)
+	return (int64)st.st_mtimespec.tv_sec * 1000000000LL +
+	       (int64)st.st_mtimespec.tv_nsec;
+#elif defined(__linux__)
+	return (int64)st.st_mtim.tv_sec * 1000000000LL +
+	       (int64)st.st_mtim.tv_nsec;
+#else
+	return (int64)st.st_mtime * 1000000000LL;
+#endif
+}
+
+/* with only seconds to go by, a file that was written in the last couple
+ * of seconds could still change without its mtime changing */
+static bool MaybeStillChanging(const struct stat &st)
+{
+#if defined(__APPLE__) || defined(__linux__)
+	UNUSED_PARAMETER(st);
+	return false;
+#else
+	return (int64)time(nullptr) - (int64)st.st_mtime < 2;
+#endif
+}
+
+/* Returns the file at path, from the cache if it hasn't changed since it
+ * was read, unless skip_cache is set.  Files that are too large to be
+ * cached are returned without data, to be streamed from disk. */
+static LocalFilePtr GetFile(const std::string &path, bool skip_cache)
+{
+	struct stat st;
+	if (os_stat(path.c_str(), &st) != 0 || (st.st_mode & S_IFMT) != S_IFREG)
+		return nullptr;
+
+	int64 size = (int64)st.st_size;
+	int64 mtime = GetMtimeNs(st);
+
+	if (!skip_cache) {
+		std::lock_guard<std::mutex> lock(cache_mutex);
+		auto it = cache.find(path);
+		if (it != cache.end()) {
+			const LocalFilePtr &file = it->second.file;
+			if (file->size == size && file->mtime == mtime) {
+				cache_lru.splice(cache_lru.begin(), cache_lru,
+						 it->second.lru);
+				return file;
+			}
+			EvictFile(path);
+		}
+	}
+
+	std::shared_ptr<LocalFile> file = std::make_shared<LocalFile>();
+	file->mime_type = GetMimeType(path);
+	file->size = size;
+	file->mtime = mtime;
+
+	if (size > MAX_CACHED_FILE_SIZE)
+		return file;
+
+	FILE *fp = os_fopen(path.c_str(), "rb");
+	if (!fp)
+		return nullptr;
+
+	file->data.resize((size_t)size);
+	size_t read = size ? fread(file->data.data(), 1, (size_t)size, fp) : 0;
+	fclose(fp);
+
+	/* changed while it was being read, the next request tries again */
+	if (read != (size_t)size)
+		return nullptr;
+
+	if (MaybeStillChanging(st))
+		return file;
+
+	std::lock_guard<std::mutex> lock(cache_mutex);
+
+	/* another request may have read it in the meantime */
+	EvictFile(path);
+
+	cache_lru.push_front(path);
+	cache[path] = {file, cache_lru.begin()};
+	cache_bytes += file->data.size();
+
+	while (cache_bytes > CACHE_BUDGET && cache_lru.size() > 1) {
+		std::string oldest = cache_lru.back();
+		EvictFile(oldest);
+	}
+
+	return file;
+}
+
+/* "bytes=start-end", "bytes=start-" or "bytes=-suffix".  false if the
+ * range can't be satisfied, in which case a 416 is sent. */
+static bool ParseRange(const std::string &value, int64 size, int64 &start,
+		       int64 &end)
+{
+	if (value.compare(0, 6, "bytes=") != 0)
+		return false;
+
+	std::string range = value.substr(6);
+	size_t dash = range.find('-');
+	if (dash == std::string::npos || range.find(',') != std::string::npos)
+		return false;
+
+	std::string first = range.substr(0, dash);
+	std::string last = range.substr(dash + 1);
+
+	if (first.empty()) {
+		if (last.empty())
+			return false;
+		int64 suffix = (int64)strtoll(last.c_str(), nullptr, 10);
+		if (suffix <= 0)
+			return false;
+		start = std::max<int64>(size - suffix, 0);
+		end = size;
+	} else {
+		start = (int64)strtoll(first.c_str(), nullptr, 10);
+		end = last.empty() ? size
+				   : (int64)strtoll(last.c_str(), nullptr, 10) +
+					     1;
+		end = std::min(end, size);
+	}
+
+	return start >= 0 && start < end;
+}
+
+/* file I/O can block for a long time on slow or network drives, so it's
+ * done on one of CEF's file threads rather than the IO thread requests are
+ * handled on */
+class SchemeTask : public CefTask {
+	std::function<void()> task;
+
+public:
+	inline SchemeTask(std::function<void()> task_) : task(task_) {}
+	virtual void Execute() override { task(); }
+
+	IMPLEMENT_REFCOUNTING(SchemeTask);
+};
+
+static bool PostSchemeTask(CefThreadId thread, std::function<void()> task)
+{
+	CefRefPtr<SchemeTask> cefTask = new SchemeTask(task);
+	return CefPostTask(thread, cefTask);
+}
+
+#if CHROME_VERSION_BUILD >= 3538
+#define FILE_THREAD TID_FILE_USER_BLOCKING
+#else
+#define FILE_THREAD TID_FILE
+#endif
+
+static bool IsCacheHeader(const std::string &name)
+{
+	return astrcmpi(name.c_str(), "Cache-Control") == 0 ||
+	       astrcmpi(name.c_str(), "Pragma") == 0;
+}
+
+static bool IsNoCache(const std::string &value)
+{
+	return value.find("no-cache") != std::string::npos ||
+	       value.find("no-store") != std::string::npos;
+}
+
+class LocalFileHandler : public CefResourceHandler {
+	std::string path;
+	std::string range;
+	bool skip_cache = false;
+	LocalFilePtr file;
+	/* file thread only, until the handler goes away */
+	FILE *fp = nullptr;
+
+	int64 offset = 0;
+	int64 end = 0;
+	int status = 200;
+
+	/* streamed data is read in to here on the file thread, and handed
+	 * over on the IO thread unless the request was canceled meanwhile */
+	std::vector<char> chunk;
+	size_t chunk_offset = 0;
+	bool chunk_ready = false;
+	std::atomic<bool> canceled = {false};
+
+	/* file thread */
+	bool OpenFile()
+	{
+		file = GetFile(path, skip_cache);
+		if (!file) {
+			status = 404;
+			return true;
+		}
+
+		end = file->size;
+		if (!range.empty())
+			status = ParseRange(range, file->size, offset, end)
+					 ? 206
+					 : 416;
+
+		if (status != 416 && file->data.empty() && file->size) {
+			fp = os_fopen(path.c_str(), "rb");
+			if (!fp || os_fseeki64(fp, offset, SEEK_SET) != 0)
+				return false;
+		}
+		return true;
+	}
+
+	bool OpenRequest(CefRefPtr<CefRequest> request,
+			 CefRefPtr<CefCallback> callback)
+	{
+		/* reloads that ignore the cache ignore this one too */
+		skip_cache = (request->GetFlags() & UR_FLAG_SKIP_CACHE) != 0;
+
+		CefRequest::HeaderMap headers;
+		request->GetHeaderMap(headers);
+		for (const auto &header : headers) {
+			std::string name = header.first;
+			std::string value = header.second;
+			if (astrcmpi(name.c_str(), "Range") == 0)
+				range = value;
+			else if (IsCacheHeader(name) && IsNoCache(value))
+				skip_cache = true;
+		}
+
+		CefRefPtr<LocalFileHandler> self(this);
+		return PostSchemeTask(FILE_THREAD, [self, callback]() {
+			if (self->OpenFile())
+				callback->Continue();
+			else
+				callback->Cancel();
+		});
+	}
+
+	/* reads up to count bytes on the file thread, and calls done with
+	 * them on the IO thread */
+	bool ReadChunk(int64 count, std::function<void()> done)
+	{
+		CefRefPtr<LocalFileHandler> self(this);
+		return PostSchemeTask(FILE_THREAD, [self, count, done]() {
+			self->chunk.resize((size_t)count);
+			size_t read = self->canceled ? 0
+						     : fread(self->chunk.data(),
+							     1, (size_t)count,
+							     self->fp);
+			self->chunk.resize(read);
+
+			PostSchemeTask(TID_IO, [self, done]() {
+				if (!self->canceled)
+					done();
+			});
+		});
+	}
+
+public:
+	inline LocalFileHandler(const std::string &path_) : path(path_) {}
+
+	virtual ~LocalFileHandler()
+	{
+		if (fp)
+			fclose(fp);
+	}
+
+#if CHROME_VERSION_BUILD >= 3770
+	virtual bool Open(CefRefPtr<CefRequest> request, bool &handle_request,
+			  CefRefPtr<CefCallback> callback) override
+	{
+		handle_request = false;
+		return OpenRequest(request, callback);
+	}
+#else
+	virtual bool ProcessRequest(CefRefPtr<CefRequest> request,
+				    CefRefPtr<CefCallback> callback) override
+	{
+		return OpenRequest(request, callback);
+	}
+#endif
+
+	virtual void GetResponseHeaders(CefRefPtr<CefResponse> response,
+					int64 &response_length,
+					CefString &) override
+	{
+		if (!file) {
+			response->SetStatus(404);
+			response_length = 0;
+			return;
+		}
+
+		CefResponse::HeaderMap headers;
+		headers.insert(std::make_pair("Accept-Ranges", "bytes"));
+
+		response->SetStatus(status);
+		response->SetMimeType(file->mime_type);
+
+		if (status == 416) {
+			headers.insert(std::make_pair(
+				"Content-Range",
+				"bytes */" + std::to_string(file->size)));
+			response->SetHeaderMap(headers);
+			response_length = 0;
+			return;
+		}
+
+		if (status == 206) {
+			headers.insert(std::make_pair(
+				"Content-Range",
+				"bytes " + std::to_string(offset) + "-" +
+					std::to_string(end - 1) + "/" +
+					std::to_string(file->size)));
+		}
+
+		response->SetHeaderMap(headers);
+		response_length = end - offset;
+	}
+
+#if CHROME_VERSION_BUILD >= 3770
+	virtual bool Read(void *data_out, int bytes_to_read, int &bytes_read,
+			  CefRefPtr<CefResourceReadCallback> callback) override
+	{
+		bytes_read = 0;
+		if (!file || status == 416 || offset >= end)
+			return false;
+
+		int64 count = std::min<int64>(bytes_to_read, end - offset);
+
+		/* cached files are copied out of the shared buffer */
+		if (!file->data.empty()) {
+			memcpy(data_out, file->data.data() + offset,
+			       (size_t)count);
+			offset += count;
+			bytes_read = (int)count;
+			return true;
+		}
+
+		/* data_out stays valid until the callback is run */
+		bool posted = ReadChunk(count, [this, data_out, callback]() {
+			int read = (int)chunk.size();
+			memcpy(data_out, chunk.data(), chunk.size());
+			offset += read;
+			callback->Continue(read);
+		});
+		if (!posted)
+			bytes_read = ERR_FAILED;
+		return posted;
+	}
+#else
+	virtual bool ReadResponse(void *data_out, int bytes_to_read,
+				  int &bytes_read,
+				  CefRefPtr<CefCallback> callback) override
+	{
+		bytes_read = 0;
+		if (!file || status == 416 || offset >= end)
+			return false;
+
+		int64 count = std::min<int64>(bytes_to_read, end - offset);
+
+		/* cached files are copied out of the shared buffer */
+		if (!file->data.empty()) {
+			memcpy(data_out, file->data.data() + offset,
+			       (size_t)count);
+			offset += count;
+			bytes_read = (int)count;
+			return true;
+		}
+
+		/* the callback asks for the chunk once it has been read */
+		if (chunk_ready) {
+			count = std::min<int64>(count,
+						chunk.size() - chunk_offset);
+			if (count <= 0)
+				return false;
+
+			memcpy(data_out, chunk.data() + chunk_offset,
+			       (size_t)count);
+			chunk_offset += (size_t)count;
+			chunk_ready = chunk_offset < chunk.size();
+			offset += count;
+			bytes_read = (int)count;
+			return true;
+		}
+
+		return ReadChunk(count, [this, callback]() {
+			chunk_offset = 0;
+			chunk_ready = true;
+			callback->Continue();
+		});
+	}
+#endif
+
+	virtual void Cancel() override { canceled = true; }
+
+	IMPLEMENT_REFCOUNTING(LocalFileHandler);
+};
 
-#if !ENABLE_LOCAL_FILE_URL_SCHEME
 CefRefPtr<CefResourceHandler>
 BrowserSchemeHandlerFactory::Create(CefRefPtr<CefBrowser> browser,
 				    CefRefPtr<CefFrame>, const CefString &,
@@ -32,30 +490,46 @@ BrowserSchemeHandlerFactory::Create(CefRefPtr<CefBrowser> browser,
 	CefURLParts parts;
 	CefParseURL(request->GetURL(), parts);
 
-	std::string path = CefString(&parts.path);
+#if ENABLE_LOCAL_FILE_URL_SCHEME
+	/* network shares are left to CEF */
+	if (CefString(&parts.host).length())
+		return nullptr;
+#endif
 
-	path = CefURIDecode(path, true, cef_uri_unescape_rule_t::UU_SPACES);
+	/* both unescape rules in one pass */
+	std::string path = CefString(&parts.path);
 	path = CefURIDecode(
 		path, true,
-		cef_uri_unescape_rule_t::
-			UU_URL_SPECIAL_CHARS_EXCEPT_PATH_SEPARATORS);
+		(cef_uri_unescape_rule_t)(
+			cef_uri_unescape_rule_t::UU_SPACES |
+			cef_uri_unescape_rule_t::
+				UU_URL_SPECIAL_CHARS_EXCEPT_PATH_SEPARATORS));
 
-	std::string fileExtension = path.substr(path.find_last_of(".") + 1);
+#ifdef _WIN32
+	path = path.substr(1);
+#endif
 
-	for (char &ch : fileExtension)
-		ch = (char)tolower(ch);
-	if (fileExtension.compare("woff2") == 0)
-		fileExtension = "woff";
+	/* the file is only looked at once the request is opened, on the file
+	 * thread */
+	return new LocalFileHandler(path);
+}
 
-#ifdef _WIN32
-	CefRefPtr<CefStreamReader> stream =
-		CefStreamReader::CreateForFile(path.substr(1));
+void RegisterSchemeHandlers(CefRefPtr<CefRequestContext> context)
+{
+#if ENABLE_LOCAL_FILE_URL_SCHEME
+	const char *scheme = "file";
+	const char *domain = "";
 #else
-	CefRefPtr<CefStreamReader> stream =
-		CefStreamReader::CreateForFile(path);
+	/* Register http://absolute/ scheme handler for older
+	 * CEF builds which do not support file:// URLs */
+	const char *scheme = "http";
+	const char *domain = "absolute";
 #endif
 
-	return new CefStreamResourceHandler(CefGetMimeType(fileExtension),
-					    stream);
+	if (context)
+		context->RegisterSchemeHandlerFactory(
+			scheme, domain, new BrowserSchemeHandlerFactory());
+	else
+		CefRegisterSchemeHandlerFactory(
+			scheme, domain, new BrowserSchemeHandlerFactory());
 }
-#endif
@@ -20,7 +20,6 @@
 
 #include "cef-headers.hpp"
 #include <string>
-#include <fstream>
 
 #if CHROME_VERSION_BUILD >= 3440
 #define ENABLE_LOCAL_FILE_URL_SCHEME 1
@@ -28,7 +27,12 @@
 #define ENABLE_LOCAL_FILE_URL_SCHEME 0
 #endif
 
-#if !ENABLE_LOCAL_FILE_URL_SCHEME
+/* Serves local files, through http://absolute/ on CEF builds without
+ * file:// support and in place of the built-in file:// handler on the
+ * others.  Small files are kept in memory between requests, so pages that
+ * get reloaded a lot don't keep going back to the disk, and every file can
+ * be requested in ranges.  The disk is only ever touched on CEF's file
+ * thread. */
 class BrowserSchemeHandlerFactory : public CefSchemeHandlerFactory {
 public:
 	virtual CefRefPtr<CefResourceHandler>
@@ -37,4 +41,5 @@ public:
 
 	IMPLEMENT_REFCOUNTING(BrowserSchemeHandlerFactory);
 };
-#endif
+
+void RegisterSchemeHandlers(CefRefPtr<CefRequestContext> context = nullptr);
@@ -0,0 +1,334 @@
+#include "browser-state.hpp"
+
+#include <obs-frontend-api.h>
+#include <obs-module.h>
+#include <util/platform.h>
+#include <obs.hpp>
+#include <functional>
+#include <atomic>
+#include <vector>
+#include <mutex>
+#include <limits.h>
+#include <math.h>
+
+using namespace json11;
+
+extern bool QueueCEFTask(std::function<void()> task);
+
+struct StateTopic {
+	const char *name;
+	uint32_t bit;
+	Json value;
+	bool set;
+};
+
+struct StateSubscriber {
+	CefRefPtr<CefBrowser> browser;
+	uint32_t topics;
+};
+
+static std::mutex state_mutex;
+static StateTopic state_topics[] = {
+	{"scene", BROWSER_STATE_SCENE, Json(), false},
+	{"outputs", BROWSER_STATE_OUTPUTS, Json(), false},
+	{"stats", BROWSER_STATE_STATS, Json(), false},
+};
+static uint32_t dirty_topics = 0;
+static uint64_t state_version = 0;
+
+/* union of the topics of all subscribers, so nothing gets collected that
+ * nobody is going to receive */
+static std::atomic<uint32_t> subscribed_topics = {0};
+static uint64_t last_stats_ns = 0;
+
+/* CEF UI thread only */
+static std::vector<StateSubscriber> subscribers;
+
+CefRefPtr<CefValue> JsonToCefValue(const Json &json)
+{
+	CefRefPtr<CefValue> value = CefValue::Create();
+
+	switch (json.type()) {
+	case Json::BOOL:
+		value->SetBool(json.bool_value());
+		break;
+	case Json::NUMBER: {
+		/* int_value() is a plain cast, which is undefined for numbers
+		 * an int can't hold */
+		double number = json.number_value();
+		if (number >= (double)INT_MIN && number <= (double)INT_MAX &&
+		    number == floor(number))
+			value->SetInt((int)number);
+		else
+			value->SetDouble(number);
+		break;
+	}
+	case Json::STRING:
+		value->SetString(json.string_value());
+		break;
+	case Json::ARRAY: {
+		CefRefPtr<CefListValue> list = CefListValue::Create();
+		const Json::array &items = json.array_items();
+		list->SetSize(items.size());
+		for (size_t i = 0; i < items.size(); i++)
+			list->SetValue(i, JsonToCefValue(items[i]));
+		value->SetList(list);
+		break;
+	}
+	case Json::OBJECT: {
+		CefRefPtr<CefDictionaryValue> dict =
+			CefDictionaryValue::Create();
+		for (const auto &item : json.object_items())
+			dict->SetValue(item.first, JsonToCefValue(item.second));
+		value->SetDictionary(dict);
+		break;
+	}
+	default:
+		value->SetNull();
+		break;
+	}
+
+	return value;
+}
+
+static void SetTopic(uint32_t bit, const Json &value)
+{
+	std::lock_guard<std::mutex> lock(state_mutex);
+
+	for (StateTopic &topic : state_topics) {
+		if (topic.bit != bit)
+			continue;
+
+		if (!topic.set || topic.value != value) {
+			topic.value = value;
+			topic.set = true;
+			dirty_topics |= bit;
+		}
+		break;
+	}
+}
+
+static bool TopicSet(uint32_t bit)
+{
+	std::lock_guard<std::mutex> lock(state_mutex);
+
+	for (StateTopic &topic : state_topics) {
+		if (topic.bit == bit)
+			return topic.set;
+	}
+	return false;
+}
+
+void BrowserState::UpdateScene()
+{
+	OBSSource source = obs_frontend_get_current_scene();
+	obs_source_release(source);
+
+	const char *name = source ? obs_source_get_name(source) : nullptr;
+	if (!name) {
+		SetTopic(BROWSER_STATE_SCENE, Json());
+		return;
+	}
+
+	SetTopic(BROWSER_STATE_SCENE,
+		 Json::object{{"name", name},
+			      {"width", (int)obs_source_get_width(source)},
+			      {"height", (int)obs_source_get_height(source)}});
+}
+
+void BrowserState::UpdateOutputs()
+{
+	SetTopic(BROWSER_STATE_OUTPUTS,
+		 Json::object{
+			 {"recording", obs_frontend_recording_active()},
+			 {"streaming", obs_frontend_streaming_active()},
+			 {"recordingPaused", obs_frontend_recording_paused()},
+			 {"replaybuffer", obs_frontend_replay_buffer_active()}});
+}
+
+static void UpdateStats()
+{
+	video_t *video = obs_get_video();
+
+	SetTopic(BROWSER_STATE_STATS,
+		 Json::object{
+			 {"fps", obs_get_active_fps()},
+			 {"averageFrameTime",
+			  (double)obs_get_average_frame_time_ns() / 1000000.0},
+			 {"renderTotalFrames", (int)obs_get_total_frames()},
+			 {"renderMissedFrames", (int)obs_get_lagged_frames()},
+			 {"outputTotalFrames",
+			  (int)video_output_get_total_frames(video)},
+			 {"outputSkippedFrames",
+			  (int)video_output_get_skipped_frames(video)}});
+}
+
+/* takes the topics in mask out of the snapshot */
+static CefRefPtr<CefDictionaryValue> GetTopics(uint32_t mask)
+{
+	CefRefPtr<CefDictionaryValue> dict = CefDictionaryValue::Create();
+
+	for (StateTopic &topic : state_topics) {
+		if ((mask & topic.bit) && topic.set)
+			dict->SetValue(topic.name, JsonToCefValue(topic.value));
+	}
+
+	return dict;
+}
+
+/* with a subscription id, the state is only for that subscription */
+static void SendState(CefRefPtr<CefBrowser> browser,
+		      CefRefPtr<CefDictionaryValue> state, uint64_t version,
+		      int subscription_id = 0)
+{
+	CefRefPtr<CefProcessMessage> msg =
+		CefProcessMessage::Create("StateUpdate");
+	CefRefPtr<CefListValue> args = msg->GetArgumentList();
+	args->SetDictionary(0, state);
+	args->SetDouble(1, (double)version);
+	args->SetInt(2, subscription_id);
+	SendBrowserProcessMessage(browser, PID_RENDERER, msg);
+}
+
+static uint32_t GetTopicBits(CefRefPtr<CefListValue> names)
+{
+	uint32_t topics = 0;
+	for (size_t i = 0; names && i < names->GetSize(); i++) {
+		std::string name = names->GetString(i);
+		for (StateTopic &topic : state_topics) {
+			if (name == topic.name)
+				topics |= topic.bit;
+		}
+	}
+	return topics;
+}
+
+static void UpdateSubscribedTopics()
+{
+	uint32_t topics = 0;
+	for (const StateSubscriber &sub : subscribers)
+		topics |= sub.topics;
+	subscribed_topics = topics;
+}
+
+void BrowserState::Subscribe(CefRefPtr<CefBrowser> browser,
+			     CefRefPtr<CefListValue> names, int added_id,
+			     CefRefPtr<CefListValue> added_topics)
+{
+	uint32_t topics = GetTopicBits(names);
+	bool found = false;
+
+	for (size_t i = 0; i < subscribers.size(); i++) {
+		StateSubscriber &sub = subscribers[i];
+		if (!sub.browser->IsSame(browser))
+			continue;
+
+		if (topics)
+			sub.topics = topics;
+		else
+			subscribers.erase(subscribers.begin() + i);
+		found = true;
+		break;
+	}
+
+	if (!found && topics)
+		subscribers.push_back({browser, topics});
+
+	UpdateSubscribedTopics();
+
+	/* a new subscription gets the current state of its topics right
+	 * away, even ones the browser was already subscribed to.  nothing else
+	 * is sent until it changes. */
+	uint32_t new_topics = topics & GetTopicBits(added_topics);
+	if (!added_id || !new_topics)
+		return;
+
+	if ((new_topics & BROWSER_STATE_SCENE) && !TopicSet(BROWSER_STATE_SCENE))
+		UpdateScene();
+	if ((new_topics & BROWSER_STATE_OUTPUTS) &&
+	    !TopicSet(BROWSER_STATE_OUTPUTS))
+		UpdateOutputs();
+	if ((new_topics & BROWSER_STATE_STATS) && !TopicSet(BROWSER_STATE_STATS))
+		UpdateStats();
+
+	CefRefPtr<CefDictionaryValue> state;
+	uint64_t version;
+	{
+		std::lock_guard<std::mutex> lock(state_mutex);
+		state = GetTopics(new_topics);
+		version = state_version;
+	}
+
+	SendState(browser, state, version, added_id);
+}
+
+void BrowserState::RemoveBrowser(CefRefPtr<CefBrowser> browser)
+{
+	for (size_t i = 0; i < subscribers.size(); i++) {
+		if (subscribers[i].browser->IsSame(browser)) {
+			subscribers.erase(subscribers.begin() + i);
+			UpdateSubscribedTopics();
+			break;
+		}
+	}
+}
+
+static void SendUpdate(uint32_t changed, CefRefPtr<CefDictionaryValue> delta,
+		       uint64_t version)
+{
+	for (const StateSubscriber &sub : subscribers) {
+		uint32_t topics = sub.topics & changed;
+		if (!topics)
+			continue;
+
+		if (topics == changed) {
+			SendState(sub.browser, delta->Copy(false), version);
+			continue;
+		}
+
+		CefRefPtr<CefDictionaryValue> state =
+			CefDictionaryValue::Create();
+		for (const StateTopic &topic : state_topics) {
+			if (topics & topic.bit)
+				state->SetValue(topic.name,
+						delta->GetValue(topic.name)
+							->Copy());
+		}
+		SendState(sub.browser, state, version);
+	}
+}
+
+/* Everything that changed since the last frame goes out as one message
+ * per browser */
+void BrowserState::Tick(void *, float)
+{
+	uint32_t subscribed = subscribed_topics;
+	if (!subscribed)
+		return;
+
+	if (subscribed & BROWSER_STATE_STATS) {
+		uint64_t now = os_gettime_ns();
+		if (now - last_stats_ns >= BROWSER_STATE_STATS_INTERVAL_NS) {
+			last_stats_ns = now;
+			UpdateStats();
+		}
+	}
+
+	uint32_t changed;
+	uint64_t version;
+	CefRefPtr<CefDictionaryValue> delta;
+	{
+		std::lock_guard<std::mutex> lock(state_mutex);
+		changed = dirty_topics & subscribed;
+		dirty_topics = 0;
+		if (!changed)
+			return;
+
+		version = ++state_version;
+		delta = GetTopics(changed);
+	}
+
+	QueueCEFTask([changed, delta, version]() {
+		SendUpdate(changed, delta, version);
+	});
+}
@@ -0,0 +1,38 @@
+#pragma once
+
+#include "cef-headers.hpp"
+#include "json11/json11.hpp"
+
+#include <stdint.h>
+
+/* Versioned snapshot of the OBS state that pages can subscribe to through
+ * obsstudio.subscribe, so they don't have to poll for it.
+ *
+ * Topics are updated from whichever thread notices the change, and
+ * changes are collected and sent out once per video frame, each browser
+ * only getting the topics it subscribed to.  Subscriptions are kept on the
+ * CEF UI thread. */
+
+#define BROWSER_STATE_SCENE (1 << 0)
+#define BROWSER_STATE_OUTPUTS (1 << 1)
+#define BROWSER_STATE_STATS (1 << 2)
+
+/* stats change every frame, so they're only refreshed this often */
+#define BROWSER_STATE_STATS_INTERVAL_NS 1000000000ULL
+
+namespace BrowserState {
+void UpdateScene();
+void UpdateOutputs();
+
+/* CEF UI thread only */
+/* added_id and added_topics are the subscription that was just added in
+ * the renderer, if any, which gets the current state of its topics */
+void Subscribe(CefRefPtr<CefBrowser> browser, CefRefPtr<CefListValue> topics,
+	       int added_id, CefRefPtr<CefListValue> added_topics);
+void RemoveBrowser(CefRefPtr<CefBrowser> browser);
+
+/* called once per video frame */
+void Tick(void *, float);
+}
+
+CefRefPtr<CefValue> JsonToCefValue(const json11::Json &json);
@@ -0,0 +1,71 @@
+#pragma once
+
+#include <atomic>
+#include <utility>
+
+/* Lock-free multiple producer/single consumer queue.
+ *
+ * Producers link a new node on to the head with a single exchange, so
+ * pushing never blocks and never waits on the consumer.  The consumer walks
+ * from the tail, which always points at the last node it popped (a stub
+ * node to begin with).
+ *
+ * A push that is in the middle of being linked in is not visible to Pop yet,
+ * so Pop returning false only means that nothing has been fully pushed.
+ * Callers that need a wakeup per push should signal after Push returns. */
+template<typename T> class MPSCQueue {
+	struct Node {
+		std::atomic<Node *> next = {nullptr};
+		T value;
+
+		inline Node() {}
+		inline Node(T &&value_) : value(std::move(value_)) {}
+	};
+
+	std::atomic<Node *> head;
+	Node *tail;
+
+public:
+	inline MPSCQueue()
+	{
+		Node *stub = new Node;
+		head = stub;
+		tail = stub;
+	}
+
+	inline ~MPSCQueue()
+	{
+		while (tail) {
+			Node *next = tail->next.load(std::memory_order_relaxed);
+			delete tail;
+			tail = next;
+		}
+	}
+
+	MPSCQueue(const MPSCQueue &) = delete;
+	MPSCQueue &operator=(const MPSCQueue &) = delete;
+
+	/* any thread */
+	inline void Push(T &&value)
+	{
+		Node *node = new Node(std::move(value));
+		Node *prev = head.exchange(node, std::memory_order_acq_rel);
+		prev->next.store(node, std::memory_order_release);
+	}
+
+	/* consumer thread only */
+	inline bool Pop(T &value)
+	{
+		Node *next = tail->next.load(std::memory_order_acquire);
+		if (!next)
+			return false;
+
+		/* next becomes the new stub, so don't let it keep anything
+		 * alive */
+		value = std::move(next->value);
+		next->value = T();
+		delete tail;
+		tail = next;
+		return true;
+	}
+};
@@ -0,0 +1,146 @@
+#include "browser-texture-pool.hpp"
+
+#include <obs-module.h>
+#include <inttypes.h>
+#include <unordered_map>
+#include <list>
+#include <mutex>
+
+struct TextureKey {
+	uint32_t cx;
+	uint32_t cy;
+	enum gs_color_format format;
+	uint32_t flags;
+
+	inline bool operator==(const TextureKey &key) const
+	{
+		return cx == key.cx && cy == key.cy && format == key.format &&
+		       flags == key.flags;
+	}
+
+	inline uint64_t Size() const
+	{
+		return (uint64_t)cx * (uint64_t)cy *
+		       (uint64_t)gs_get_format_bpp(format) / 8;
+	}
+};
+
+struct IdleTexture {
+	TextureKey key;
+	gs_texture_t *tex;
+};
+
+static std::mutex pool_mutex;
+static std::unordered_map<gs_texture_t *, TextureKey> used_textures;
+static std::list<IdleTexture> idle_textures; /* most recent first */
+
+static uint64_t budget = TEXTURE_POOL_DEFAULT_BUDGET;
+static uint64_t resident_bytes = 0;
+static uint64_t idle_bytes = 0;
+static uint64_t hits = 0;
+static uint64_t misses = 0;
+
+static inline uint32_t RoundToBucket(uint32_t val)
+{
+	return (val + (TEXTURE_POOL_BUCKET - 1)) & ~(TEXTURE_POOL_BUCKET - 1);
+}
+
+static void TrimToBudget()
+{
+	while (idle_bytes > budget && !idle_textures.empty()) {
+		IdleTexture &idle = idle_textures.back();
+		uint64_t size = idle.key.Size();
+
+		gs_texture_destroy(idle.tex);
+		idle_bytes -= size;
+		resident_bytes -= size;
+		idle_textures.pop_back();
+	}
+}
+
+gs_texture_t *TexturePool::Acquire(uint32_t cx, uint32_t cy,
+				   enum gs_color_format format, uint32_t flags)
+{
+	if (!cx || !cy)
+		return nullptr;
+
+	TextureKey key = {RoundToBucket(cx), RoundToBucket(cy), format, flags};
+	std::lock_guard<std::mutex> lock(pool_mutex);
+
+	for (auto it = idle_textures.begin(); it != idle_textures.end(); ++it) {
+		if (it->key == key) {
+			gs_texture_t *tex = it->tex;
+			idle_bytes -= key.Size();
+			idle_textures.erase(it);
+			used_textures[tex] = key;
+			hits++;
+			return tex;
+		}
+	}
+
+	gs_texture_t *tex =
+		gs_texture_create(key.cx, key.cy, format, 1, nullptr, flags);
+	if (!tex)
+		return nullptr;
+
+	used_textures[tex] = key;
+	resident_bytes += key.Size();
+	misses++;
+	return tex;
+}
+
+void TexturePool::Release(gs_texture_t *tex)
+{
+	if (!tex)
+		return;
+
+	std::lock_guard<std::mutex> lock(pool_mutex);
+
+	auto it = used_textures.find(tex);
+	if (it == used_textures.end()) {
+		gs_texture_destroy(tex);
+		return;
+	}
+
+	TextureKey key = it->second;
+	used_textures.erase(it);
+
+	idle_textures.push_front({key, tex});
+	idle_bytes += key.Size();
+	TrimToBudget();
+}
+
+void TexturePool::SetBudget(uint64_t bytes)
+{
+	std::lock_guard<std::mutex> lock(pool_mutex);
+	budget = bytes;
+	TrimToBudget();
+}
+
+void TexturePool::Clear()
+{
+	std::lock_guard<std::mutex> lock(pool_mutex);
+
+	uint64_t total = hits + misses;
+	blog(LOG_DEBUG,
+	     "[obs-browser]: Texture pool: %.1f%% hit rate "
+	     "(%" PRIu64 " hits, %" PRIu64 " misses), "
+	     "%.2f MB resident, %.2f MB idle",
+	     total ? (double)hits * 100.0 / (double)total : 0.0, hits, misses,
+	     (double)resident_bytes / (1024.0 * 1024.0),
+	     (double)idle_bytes / (1024.0 * 1024.0));
+
+	for (IdleTexture &idle : idle_textures) {
+		gs_texture_destroy(idle.tex);
+		resident_bytes -= idle.key.Size();
+	}
+
+	idle_textures.clear();
+	idle_bytes = 0;
+}
+
+TexturePoolStats TexturePool::GetStats()
+{
+	std::lock_guard<std::mutex> lock(pool_mutex);
+	return {hits, misses, resident_bytes, idle_bytes, budget};
+}
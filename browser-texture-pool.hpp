@@ -0,0 +1,42 @@
+#pragma once
+
+#include <graphics/graphics.h>
+#include <stdint.h>
+
+/* Process-wide pool of browser textures.
+ *
+ * Textures are bucketed by size (rounded up to TEXTURE_POOL_BUCKET pixels),
+ * format and flags, so sources that get resized or recreated pick up an
+ * existing texture instead of going through the graphics driver.  Because of
+ * the bucketing, an acquired texture may be larger than what was asked for;
+ * callers only ever use the top-left cx x cy region of it.
+ *
+ * Released textures are kept idle up to the memory budget, after which the
+ * least recently released ones are destroyed.
+ *
+ * All functions except GetStats must be called inside the graphics
+ * context. */
+
+#define TEXTURE_POOL_BUCKET 64
+#define TEXTURE_POOL_DEFAULT_BUDGET (256ULL * 1024ULL * 1024ULL)
+
+struct TexturePoolStats {
+	uint64_t hits;
+	uint64_t misses;
+	uint64_t resident_bytes;
+	uint64_t idle_bytes;
+	uint64_t budget_bytes;
+};
+
+namespace TexturePool {
+gs_texture_t *Acquire(uint32_t cx, uint32_t cy, enum gs_color_format format,
+		      uint32_t flags);
+
+/* textures that didn't come from the pool are destroyed directly */
+void Release(gs_texture_t *tex);
+
+void SetBudget(uint64_t bytes);
+void Clear();
+
+TexturePoolStats GetStats();
+}
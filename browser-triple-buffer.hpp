@@ -0,0 +1,59 @@
+#pragma once
+
+#include <atomic>
+#include <stdint.h>
+
+/* Lock-free single producer/single consumer triple buffer.
+ *
+ * The producer always has a slot of its own to write in to, and the consumer
+ * always has a slot of its own to read from.  The third slot is the one that
+ * gets handed back and forth: publishing swaps the producer's slot with it,
+ * and acquiring swaps the consumer's slot with it if something new was
+ * published in the meantime.  Neither side ever waits on the other, and if
+ * the producer publishes faster than the consumer acquires, the older
+ * frames are simply overwritten. */
+template<typename T> class TripleBuffer {
+	enum : uint8_t {
+		INDEX_MASK = 0x3,
+		NEW_FLAG = 0x4,
+	};
+
+	T slots[3];
+	std::atomic<uint8_t> middle = {2};
+	uint8_t back = 0;
+	uint8_t front = 1;
+
+public:
+	/* producer side */
+	inline T &Back() { return slots[back]; }
+
+	/* returns false if the previously published slot was never acquired
+	 * and has been dropped */
+	inline bool Publish()
+	{
+		uint8_t prev = middle.exchange(back | NEW_FLAG,
+					       std::memory_order_acq_rel);
+		back = prev & INDEX_MASK;
+		return (prev & NEW_FLAG) == 0;
+	}
+
+	/* true if the last published slot has not been acquired yet */
+	inline bool Pending() const
+	{
+		return (middle.load(std::memory_order_acquire) & NEW_FLAG) !=
+		       0;
+	}
+
+	/* consumer side */
+	inline bool Acquire()
+	{
+		if (!Pending())
+			return false;
+
+		uint8_t prev = middle.exchange(front, std::memory_order_acq_rel);
+		front = prev & INDEX_MASK;
+		return true;
+	}
+
+	inline T &Front() { return slots[front]; }
+};
@@ -23,13 +23,18 @@
 #include <util/dstr.hpp>
 #include <obs-module.h>
 #include <obs.hpp>
+#include <algorithm>
 #include <functional>
+#include <atomic>
 #include <thread>
 #include <mutex>
 
 #include "obs-browser-source.hpp"
+#include "browser-client.hpp"
 #include "browser-scheme.hpp"
 #include "browser-app.hpp"
+#include "browser-texture-pool.hpp"
+#include "browser-state.hpp"
 #include "browser-version.h"
 #include "browser-config.h"
 
@@ -58,12 +63,22 @@ static thread manager_thread;
 static bool manager_initialized = false;
 os_event_t *cef_started_event = nullptr;
 
-static int adapterCount = 0;
-static std::wstring deviceId;
-
 #if EXPERIMENTAL_SHARED_TEXTURE_SUPPORT_ENABLED
 bool hwaccel = false;
 #endif
+bool dirty_rect_upload = true;
+int max_suspended_browsers = 8;
+bool direct_audio = false;
+bool show_stats = false;
+bool windowless_panels = false;
+bool throttle_occluded = false;
+int memory_budget_mb = 0;
+static bool process_per_site = false;
+static int renderer_process_limit = 0;
+static int prewarm_browsers = 0;
+
+/* more spares than that would only wait on each other to be created */
+#define MAX_PREWARM_BROWSERS 4
 
 /* ========================================================================= */
 
@@ -71,13 +86,30 @@ bool hwaccel = false;
 extern MessageObject messageObject;
 #endif
 
+/* time tasks posted with QueueCEFTask wait for the CEF UI thread */
+static std::atomic<uint64_t> cef_tasks = {0};
+static std::atomic<uint64_t> cef_task_wait_ns = {0};
+static std::atomic<uint64_t> cef_task_max_wait_ns = {0};
+
 class BrowserTask : public CefTask {
 public:
 	std::function<void()> task;
+	uint64_t queued_ns;
 
-	inline BrowserTask(std::function<void()> task_) : task(task_) {}
+	inline BrowserTask(std::function<void()> task_)
+		: task(task_), queued_ns(os_gettime_ns())
+	{
+	}
 	virtual void Execute() override
 	{
+		/* only ever run on the CEF UI thread, so the max doesn't need
+		 * a compare-exchange */
+		uint64_t wait = os_gettime_ns() - queued_ns;
+		cef_tasks++;
+		cef_task_wait_ns += wait;
+		if (wait > cef_task_max_wait_ns)
+			cef_task_max_wait_ns = wait;
+
 #ifdef USE_QT_LOOP
 		/* you have to put the tasks on the Qt event queue after this
 		 * call otherwise the CEF message pump may stop functioning
@@ -99,6 +131,23 @@ bool QueueCEFTask(std::function<void()> task)
 			   CefRefPtr<BrowserTask>(new BrowserTask(task)));
 }
 
+static void get_stats_proc(void *, calldata_t *cd)
+{
+	uint64_t tasks = cef_tasks;
+	uint64_t wait_ns = cef_task_wait_ns;
+
+	Json stats = Json::object{
+		{"tasks", (double)tasks},
+		{"taskWaitAverageMs",
+		 tasks ? (double)wait_ns / (double)tasks / 1000000.0 : 0.0},
+		{"taskWaitMaxMs", (double)cef_task_max_wait_ns / 1000000.0},
+		{"sources", GetBrowserSourceStats()},
+	};
+
+	std::string json = stats.dump();
+	calldata_set_string(cd, "json", json.c_str());
+}
+
 /* ========================================================================= */
 
 static const char *default_css = "\
@@ -115,14 +164,20 @@ static void browser_source_get_defaults(obs_data_t *settings)
 	obs_data_set_default_int(settings, "width", 800);
 	obs_data_set_default_int(settings, "height", 600);
 	obs_data_set_default_int(settings, "fps", 30);
-#if EXPERIMENTAL_SHARED_TEXTURE_SUPPORT_ENABLED
+#if ENABLE_EXTERNAL_BEGIN_FRAME
 	obs_data_set_default_bool(settings, "fps_custom", false);
+	obs_data_set_default_int(settings, "frame_divisor", 1);
 #else
 	obs_data_set_default_bool(settings, "fps_custom", true);
 #endif
 	obs_data_set_default_bool(settings, "shutdown", false);
+	obs_data_set_default_bool(settings, "suspend_hidden", false);
+	obs_data_set_default_int(settings, "memory_limit", 0);
+	obs_data_set_default_int(settings, "render_scale", 100);
+	obs_data_set_default_string(settings, "profile", "");
 	obs_data_set_default_bool(settings, "restart_when_active", false);
 	obs_data_set_default_string(settings, "css", default_css);
+	obs_data_set_default_string(settings, "script", "");
 	obs_data_set_default_bool(settings, "reroute_audio", false);
 }
 
@@ -144,6 +199,10 @@ static bool is_fps_custom(obs_properties_t *props, obs_property_t *,
 	bool enabled = obs_data_get_bool(settings, "fps_custom");
 	obs_property_t *fps = obs_properties_get(props, "fps");
 	obs_property_set_visible(fps, enabled);
+#if ENABLE_EXTERNAL_BEGIN_FRAME
+	obs_property_t *divisor = obs_properties_get(props, "frame_divisor");
+	obs_property_set_visible(divisor, !enabled);
+#endif
 
 	return true;
 }
@@ -175,6 +234,9 @@ static obs_properties_t *browser_source_get_properties(void *data)
 	obs_properties_add_text(props, "url", obs_module_text("URL"),
 				OBS_TEXT_DEFAULT);
 
+	obs_properties_add_text(props, "profile", obs_module_text("Profile"),
+				OBS_TEXT_DEFAULT);
+
 	obs_properties_add_int(props, "width", obs_module_text("Width"), 1,
 			       4096, 1);
 	obs_properties_add_int(props, "height", obs_module_text("Height"), 1,
@@ -184,7 +246,7 @@ static obs_properties_t *browser_source_get_properties(void *data)
 		props, "fps_custom", obs_module_text("CustomFrameRate"));
 	obs_property_set_modified_callback(fps_set, is_fps_custom);
 
-#if !EXPERIMENTAL_SHARED_TEXTURE_SUPPORT_ENABLED
+#if !ENABLE_EXTERNAL_BEGIN_FRAME
 	obs_property_set_enabled(fps_set, false);
 #endif
 
@@ -192,11 +254,40 @@ static obs_properties_t *browser_source_get_properties(void *data)
 				obs_module_text("RerouteAudio"));
 
 	obs_properties_add_int(props, "fps", obs_module_text("FPS"), 1, 60, 1);
+#if ENABLE_EXTERNAL_BEGIN_FRAME
+	obs_property_t *divisor = obs_properties_add_list(
+		props, "frame_divisor", obs_module_text("FrameDivisor"),
+		OBS_COMBO_TYPE_LIST, OBS_COMBO_FORMAT_INT);
+	obs_property_list_add_int(divisor, obs_module_text("FrameDivisor.Full"),
+				  1);
+	obs_property_list_add_int(divisor, obs_module_text("FrameDivisor.Half"),
+				  2);
+	obs_property_list_add_int(divisor,
+				  obs_module_text("FrameDivisor.Third"), 3);
+	obs_property_list_add_int(divisor,
+				  obs_module_text("FrameDivisor.Quarter"), 4);
+#endif
+	obs_property_t *scale = obs_properties_add_list(
+		props, "render_scale", obs_module_text("RenderScale"),
+		OBS_COMBO_TYPE_LIST, OBS_COMBO_FORMAT_INT);
+	obs_property_list_add_int(scale, "100%", 100);
+	obs_property_list_add_int(scale, "75%", 75);
+	obs_property_list_add_int(scale, "50%", 50);
+	obs_property_list_add_int(scale, "25%", 25);
+
 	obs_property_t *p = obs_properties_add_text(
 		props, "css", obs_module_text("CSS"), OBS_TEXT_MULTILINE);
 	obs_property_text_set_monospace(p, true);
+	p = obs_properties_add_text(props, "script", obs_module_text("Script"),
+				    OBS_TEXT_MULTILINE);
+	obs_property_text_set_monospace(p, true);
 	obs_properties_add_bool(props, "shutdown",
 				obs_module_text("ShutdownSourceNotVisible"));
+	obs_properties_add_bool(props, "suspend_hidden",
+				obs_module_text("SuspendSourceNotVisible"));
+	p = obs_properties_add_int(props, "memory_limit",
+				   obs_module_text("MemoryLimit"), 0, 65536, 64);
+	obs_property_int_set_suffix(p, " MB");
 	obs_properties_add_bool(props, "restart_when_active",
 				obs_module_text("RefreshBrowserActive"));
 
@@ -206,9 +297,139 @@ static obs_properties_t *browser_source_get_properties(void *data)
 			static_cast<BrowserSource *>(data)->Refresh();
 			return false;
 		});
+
+	if (show_stats && bs) {
+		Json stats = GetBrowserSourceStats(bs);
+		DStr text;
+		dstr_printf(text,
+			    "PID %d (%.0f MB), %.1f paints/s, "
+			    "%.2f MB/s uploaded, %.0f audio underruns",
+			    stats["rendererPid"].int_value(),
+			    stats["rendererResidentBytes"].number_value() /
+				    (1024.0 * 1024.0),
+			    stats["paintsPerSecond"].number_value(),
+			    stats["uploadBytesPerSecond"].number_value() /
+				    (1024.0 * 1024.0),
+			    stats["audioUnderruns"].number_value());
+		obs_properties_add_text(props, "stats", text->array,
+					OBS_TEXT_INFO);
+	}
 	return props;
 }
 
+#ifdef _WIN32
+/* the adapter OBS renders on.  CEF's GPU process is pinned to it, so the
+ * textures it shares can always be opened on OBS's device. */
+static ComPtr<IDXGIAdapter1> obsAdapter;
+static LUID obsAdapterLuid = {};
+
+static inline void FindOBSAdapter()
+{
+	ComPtr<IDXGIFactory1> factory;
+	ComPtr<IDXGIAdapter1> adapter;
+	DXGI_ADAPTER_DESC desc;
+	HRESULT hr;
+
+	struct obs_video_info ovi;
+	UINT index = obs_get_video_info(&ovi) ? ovi.adapter : 0;
+
+	hr = CreateDXGIFactory1(__uuidof(IDXGIFactory1), (void **)&factory);
+	if (FAILED(hr))
+		return;
+	if (factory->EnumAdapters1(index, &adapter) != S_OK)
+		return;
+	if (FAILED(adapter->GetDesc(&desc)))
+		return;
+
+	obsAdapter = adapter;
+	obsAdapterLuid = desc.AdapterLuid;
+}
+#endif
+
+#if EXPERIMENTAL_SHARED_TEXTURE_SUPPORT_ENABLED && defined(_WIN32)
+/* Shares a texture from a device of its own on OBS's adapter and opens it
+ * in OBS, the same way the textures from CEF's GPU process are handled.
+ * Some drivers report shared texture support and then fail to open them.
+ * Newer CEF shares NT handles rather than legacy ones, which is a different
+ * path in the driver, so that's what gets probed there. */
+static bool ProbeSharedTextures(void)
+{
+	ComPtr<ID3D11Device> device;
+	ComPtr<ID3D11DeviceContext> context;
+	ComPtr<ID3D11Texture2D> tex;
+#if CHROME_VERSION_BUILD >= 6367
+	ComPtr<IDXGIResource1> res;
+#else
+	ComPtr<IDXGIResource> res;
+#endif
+	HANDLE handle = nullptr;
+	HRESULT hr;
+
+	if (!obsAdapter)
+		return false;
+
+	hr = D3D11CreateDevice(obsAdapter, D3D_DRIVER_TYPE_UNKNOWN, nullptr, 0,
+			       nullptr, 0, D3D11_SDK_VERSION, &device, nullptr,
+			       &context);
+	if (FAILED(hr))
+		return false;
+
+	D3D11_TEXTURE2D_DESC desc = {};
+	desc.Width = 16;
+	desc.Height = 16;
+	desc.MipLevels = 1;
+	desc.ArraySize = 1;
+	desc.Format = DXGI_FORMAT_B8G8R8A8_UNORM;
+	desc.SampleDesc.Count = 1;
+	desc.Usage = D3D11_USAGE_DEFAULT;
+	desc.BindFlags = D3D11_BIND_SHADER_RESOURCE | D3D11_BIND_RENDER_TARGET;
+#if CHROME_VERSION_BUILD >= 6367
+	desc.MiscFlags = D3D11_RESOURCE_MISC_SHARED |
+			 D3D11_RESOURCE_MISC_SHARED_NTHANDLE;
+#else
+	desc.MiscFlags = D3D11_RESOURCE_MISC_SHARED;
+#endif
+
+	hr = device->CreateTexture2D(&desc, nullptr, &tex);
+	if (FAILED(hr))
+		return false;
+#if CHROME_VERSION_BUILD >= 6367
+	hr = tex->QueryInterface(__uuidof(IDXGIResource1), (void **)&res);
+	if (FAILED(hr))
+		return false;
+	hr = res->CreateSharedHandle(nullptr,
+				     DXGI_SHARED_RESOURCE_READ |
+					     DXGI_SHARED_RESOURCE_WRITE,
+				     nullptr, &handle);
+#else
+	hr = tex->QueryInterface(__uuidof(IDXGIResource), (void **)&res);
+	if (FAILED(hr))
+		return false;
+	hr = res->GetSharedHandle(&handle);
+#endif
+	if (FAILED(hr))
+		return false;
+	context->Flush();
+
+	obs_enter_graphics();
+#if CHROME_VERSION_BUILD >= 6367
+	gs_texture_t *opened =
+		gs_texture_open_nt_shared((uint32_t)(uintptr_t)handle);
+#else
+	gs_texture_t *opened =
+		gs_texture_open_shared((uint32_t)(uintptr_t)handle);
+#endif
+	gs_texture_destroy(opened);
+	obs_leave_graphics();
+
+#if CHROME_VERSION_BUILD >= 6367
+	/* unlike legacy handles, NT handles have to be closed */
+	CloseHandle(handle);
+#endif
+	return !!opened;
+}
+#endif
+
 static CefRefPtr<BrowserApp> app;
 
 static void BrowserInit(void)
@@ -263,12 +484,28 @@ static void BrowserInit(void)
 #if EXPERIMENTAL_SHARED_TEXTURE_SUPPORT_ENABLED
 	if (hwaccel) {
 		obs_enter_graphics();
-		hwaccel = tex_sharing_avail = gs_shared_texture_available();
+		hwaccel = tex_sharing_avail = SharedTexturesAvailable();
 		obs_leave_graphics();
 	}
+#ifdef _WIN32
+	if (hwaccel && !ProbeSharedTextures()) {
+		blog(LOG_INFO, "[obs-browser]: Shared textures can't be opened "
+			       "on the OBS adapter, disabling browser source "
+			       "hardware acceleration.");
+		hwaccel = tex_sharing_avail = false;
+	}
+#endif
+#endif
+
+	std::string adapter_luid;
+#ifdef _WIN32
+	if (obsAdapter)
+		adapter_luid = std::to_string(obsAdapterLuid.HighPart) + "," +
+			       std::to_string(obsAdapterLuid.LowPart);
 #endif
 
-	app = new BrowserApp(tex_sharing_avail);
+	app = new BrowserApp(tex_sharing_avail, process_per_site,
+			     renderer_process_limit, adapter_luid);
 	CefExecuteProcess(args, app, nullptr);
 #ifdef _WIN32
 	/* Massive (but amazing) hack to prevent chromium from modifying our
@@ -282,12 +519,11 @@ static void BrowserInit(void)
 #else
 	CefInitialize(args, settings, app, nullptr);
 #endif
-#if !ENABLE_LOCAL_FILE_URL_SCHEME
-	/* Register http://absolute/ scheme handler for older
-	 * CEF builds which do not support file:// URLs */
-	CefRegisterSchemeHandlerFactory("http", "absolute",
-					new BrowserSchemeHandlerFactory());
-#endif
+	RegisterSchemeHandlers();
+	if (prewarm_browsers > 0) {
+		int count = prewarm_browsers;
+		QueueCEFTask([count]() { PrewarmBrowsers(count); });
+	}
 	os_event_signal(cef_started_event);
 }
 
@@ -297,11 +533,14 @@ extern MessageObject messageObject;
 
 static void BrowserShutdown(void)
 {
+	ReleaseSpareBrowsers();
 #ifdef USE_QT_LOOP
 	while (messageObject.ExecuteNextBrowserTask())
 		;
 	CefDoMessageLoopWork();
+	messageObject.LogBrowserTaskStats();
 #endif
+	ReleaseRequestContexts();
 	CefShutdown();
 	app = nullptr;
 }
@@ -422,9 +661,27 @@ void RegisterBrowserSource()
 
 extern void DispatchJSEvent(std::string eventName, std::string jsonString,
 			    BrowserSource *browser = nullptr);
+extern void FlushJSEvents();
 
 static void handle_obs_frontend_event(enum obs_frontend_event event, void *)
 {
+	switch (event) {
+	case OBS_FRONTEND_EVENT_STREAMING_STARTED:
+	case OBS_FRONTEND_EVENT_STREAMING_STOPPED:
+	case OBS_FRONTEND_EVENT_RECORDING_STARTED:
+	case OBS_FRONTEND_EVENT_RECORDING_PAUSED:
+	case OBS_FRONTEND_EVENT_RECORDING_UNPAUSED:
+	case OBS_FRONTEND_EVENT_RECORDING_STOPPED:
+	case OBS_FRONTEND_EVENT_REPLAY_BUFFER_STARTED:
+	case OBS_FRONTEND_EVENT_REPLAY_BUFFER_STOPPED:
+		BrowserState::UpdateOutputs();
+		break;
+	case OBS_FRONTEND_EVENT_SCENE_CHANGED:
+		BrowserState::UpdateScene();
+		break;
+	default:;
+	}
+
 	switch (event) {
 	case OBS_FRONTEND_EVENT_STREAMING_STARTING:
 		DispatchJSEvent("obsStreamingStarting", "");
@@ -488,78 +745,15 @@ static void handle_obs_frontend_event(enum obs_frontend_event event, void *)
 		break;
 	}
 	case OBS_FRONTEND_EVENT_EXIT:
+		/* the scenes are gone before the next video frame, and with
+		 * them the sources that would get this */
 		DispatchJSEvent("obsExit", "");
+		FlushJSEvents();
 		break;
 	default:;
 	}
 }
 
-#ifdef _WIN32
-static inline void EnumAdapterCount()
-{
-	ComPtr<IDXGIFactory1> factory;
-	ComPtr<IDXGIAdapter1> adapter;
-	HRESULT hr;
-	UINT i = 0;
-
-	hr = CreateDXGIFactory1(__uuidof(IDXGIFactory1), (void **)&factory);
-	if (FAILED(hr))
-		return;
-
-	while (factory->EnumAdapters1(i++, &adapter) == S_OK) {
-		DXGI_ADAPTER_DESC desc;
-
-		hr = adapter->GetDesc(&desc);
-		if (FAILED(hr))
-			continue;
-
-		if (i == 1)
-			deviceId = desc.Description;
-
-		/* ignore Microsoft's 'basic' renderer' */
-		if (desc.VendorId == 0x1414 && desc.DeviceId == 0x8c)
-			continue;
-
-		adapterCount++;
-	}
-}
-#endif
-
-#if EXPERIMENTAL_SHARED_TEXTURE_SUPPORT_ENABLED
-static const wchar_t *blacklisted_devices[] = {
-	L"Intel", L"Microsoft", L"Radeon HD 8850M", L"Radeon HD 7660", nullptr};
-#endif
-
-static inline bool is_intel(const std::wstring &str)
-{
-	return wstrstri(str.c_str(), L"Intel") != 0;
-}
-
-#if EXPERIMENTAL_SHARED_TEXTURE_SUPPORT_ENABLED
-static void check_hwaccel_support(void)
-{
-	/* do not use hardware acceleration if a blacklisted device is the
-	 * default and on 2 or more adapters */
-	const wchar_t **device = blacklisted_devices;
-
-	if (adapterCount >= 2 || !is_intel(deviceId)) {
-		while (*device) {
-			if (!!wstrstri(deviceId.c_str(), *device)) {
-				hwaccel = false;
-				blog(LOG_INFO, "[obs-browser]: "
-					       "Blacklisted device "
-					       "detected, "
-					       "disabling browser "
-					       "source hardware "
-					       "acceleration.");
-				break;
-			}
-			device++;
-		}
-	}
-}
-#endif
-
 bool obs_module_load(void)
 {
 	blog(LOG_INFO, "[obs-browser]: Version %s", OBS_BROWSER_VERSION_STRING);
@@ -573,19 +767,56 @@ bool obs_module_load(void)
 	CefEnableHighDPISupport();
 
 #ifdef _WIN32
-	EnumAdapterCount();
+	FindOBSAdapter();
 #endif
 	RegisterBrowserSource();
 	obs_frontend_add_event_callback(handle_obs_frontend_event, nullptr);
+	/* not removed on unload, libobs frees its tick callbacks before
+	 * modules are unloaded */
+	obs_add_tick_callback(BrowserState::Tick, nullptr);
+	proc_handler_add(obs_get_proc_handler(),
+			 "void obs_browser_get_stats(out string json)",
+			 get_stats_proc, nullptr);
 
-#if EXPERIMENTAL_SHARED_TEXTURE_SUPPORT_ENABLED
 	obs_data_t *private_data = obs_get_private_data();
+#if EXPERIMENTAL_SHARED_TEXTURE_SUPPORT_ENABLED
 	hwaccel = obs_data_get_bool(private_data, "BrowserHWAccel");
-	if (hwaccel) {
-		check_hwaccel_support();
-	}
-	obs_data_release(private_data);
 #endif
+	if (obs_data_has_user_value(private_data, "BrowserDirtyRectUpload"))
+		dirty_rect_upload = obs_data_get_bool(private_data,
+						      "BrowserDirtyRectUpload");
+	int pool_budget_mb = (int)obs_data_get_int(private_data,
+						   "BrowserTexturePoolBudgetMB");
+	if (pool_budget_mb > 0)
+		TexturePool::SetBudget((uint64_t)pool_budget_mb * 1024 * 1024);
+	if (obs_data_has_user_value(private_data, "BrowserMaxSuspended"))
+		max_suspended_browsers = std::max(
+			(int)obs_data_get_int(private_data,
+					      "BrowserMaxSuspended"),
+			0);
+	direct_audio = obs_data_get_bool(private_data, "BrowserDirectAudio");
+	show_stats = obs_data_get_bool(private_data, "BrowserShowStats");
+	process_per_site =
+		obs_data_get_bool(private_data, "BrowserProcessPerSite");
+	renderer_process_limit = (int)obs_data_get_int(
+		private_data, "BrowserRendererProcessLimit");
+	prewarm_browsers = std::min(
+		std::max((int)obs_data_get_int(private_data, "BrowserPrewarm"),
+			 0),
+		MAX_PREWARM_BROWSERS);
+	windowless_panels =
+		obs_data_get_bool(private_data, "BrowserWindowlessPanels");
+	memory_budget_mb = std::max(
+		(int)obs_data_get_int(private_data, "BrowserMemoryBudgetMB"),
+		0);
+	throttle_occluded =
+		obs_data_get_bool(private_data, "BrowserThrottleOccluded");
+	obs_data_release(private_data);
+
+	/* starts CEF right away instead of with the first source or panel,
+	 * so it's ready by the time the scene collection is loaded */
+	if (prewarm_browsers > 0)
+		obs_browser_initialize();
 	return true;
 }
 
@@ -16,6 +16,10 @@
  ******************************************************************************/
 
 #include "obs-browser-source.hpp"
+#include "browser-audio-mix.hpp"
+
+#include <string.h>
+#include <algorithm>
 
 void BrowserSource::EnumAudioStreams(obs_source_enum_proc_t cb, void *param)
 {
@@ -25,16 +29,59 @@ void BrowserSource::EnumAudioStreams(obs_source_enum_proc_t cb, void *param)
 	}
 }
 
-static inline void mix_audio(float *__restrict p_out,
-			     const float *__restrict p_in, size_t pos,
-			     size_t count)
+static inline bool WasFed(const std::vector<const void *> &fed,
+			  const void *stream)
 {
-	float *__restrict out = p_out;
-	const float *__restrict in = p_in + pos;
-	const float *__restrict end = in + count;
+	return std::find(fed.begin(), fed.end(), stream) != fed.end();
+}
+
+/* Direct audio streams are read straight out of their ring buffers, so
+ * there's no child source in between to buffer and sync them */
+bool BrowserSource::DirectAudioMix(uint64_t *ts_out,
+				   struct audio_output_data *audio_output,
+				   size_t channels, size_t sample_rate)
+{
+	uint64_t timestamp = 0;
+
+	direct_inputs.clear();
+	for (auto &stream : direct_streams) {
+		uint64_t stream_ts;
+		if (!stream->Peek(stream_ts, AUDIO_OUTPUT_FRAMES)) {
+			if (WasFed(last_fed_streams, stream.get()))
+				audio_underruns++;
+			continue;
+		}
+		fed_streams.push_back(stream.get());
+
+		if (!timestamp || stream_ts < timestamp)
+			timestamp = stream_ts;
+
+		direct_inputs.emplace_back(stream.get(), stream_ts);
+	}
+
+	if (!timestamp)
+		return false;
+
+	/* libobs clears the output before asking for it, so the first stream
+	 * can be copied in rather than mixed.  streams that start after this
+	 * tick are left buffered for the next one. */
+	bool mix = false;
+	for (auto &input : direct_inputs) {
+		size_t pos = (size_t)ns_to_audio_frames(
+			sample_rate, input.second - timestamp);
+		if (pos >= AUDIO_OUTPUT_FRAMES)
+			continue;
+
+		float *out[MAX_AUDIO_CHANNELS];
+		for (size_t ch = 0; ch < channels; ch++)
+			out[ch] = audio_output->data[ch] + pos;
 
-	while (in < end)
-		*out++ += *in++;
+		input.first->Read(out, AUDIO_OUTPUT_FRAMES - pos, mix);
+		mix = true;
+	}
+
+	*ts_out = timestamp;
+	return true;
 }
 
 bool BrowserSource::AudioMix(uint64_t *ts_out,
@@ -45,41 +92,95 @@ bool BrowserSource::AudioMix(uint64_t *ts_out,
 	struct obs_source_audio_mix child_audio;
 
 	std::lock_guard<std::mutex> lock(audio_sources_mutex);
-	for (obs_source_t *s : audio_sources) {
-		if (!obs_source_audio_pending(s)) {
-			uint64_t source_ts = obs_source_get_audio_timestamp(s);
 
-			if (source_ts && (!timestamp || source_ts < timestamp))
-				timestamp = source_ts;
+	/* streams that are silent aren't underruns, only ones that had data
+	 * on the last tick and ran dry since are */
+	last_fed_streams.swap(fed_streams);
+	fed_streams.clear();
+
+	if (!direct_streams.empty())
+		return DirectAudioMix(ts_out, audio_output, channels,
+				      sample_rate);
+
+	/* only walk the child sources once, everything after works off of
+	 * what was collected here */
+	mix_inputs.clear();
+	for (obs_source_t *s : audio_sources) {
+		if (obs_source_audio_pending(s)) {
+			if (WasFed(last_fed_streams, s))
+				audio_underruns++;
+			continue;
 		}
+
+		uint64_t source_ts = obs_source_get_audio_timestamp(s);
+		if (!source_ts)
+			continue;
+		fed_streams.push_back(s);
+
+		if (!timestamp || source_ts < timestamp)
+			timestamp = source_ts;
+
+		AudioMixInput input;
+		input.source = s;
+		input.timestamp = source_ts;
+		mix_inputs.push_back(input);
 	}
 
 	if (!timestamp)
 		return false;
 
-	for (obs_source_t *s : audio_sources) {
-		uint64_t source_ts;
-		size_t pos, count;
+	size_t max_pos = 0;
+	for (size_t i = 0; i < mix_inputs.size();) {
+		AudioMixInput &input = mix_inputs[i];
+		input.pos = (size_t)ns_to_audio_frames(
+			sample_rate, input.timestamp - timestamp);
 
-		if (obs_source_audio_pending(s)) {
+		if (input.pos >= AUDIO_OUTPUT_FRAMES) {
+			mix_inputs.erase(mix_inputs.begin() + i);
 			continue;
 		}
 
-		source_ts = obs_source_get_audio_timestamp(s);
-		if (!source_ts) {
-			continue;
-		}
+		obs_source_get_audio_mix(input.source, &child_audio);
+		for (size_t ch = 0; ch < channels; ch++)
+			input.data[ch] = child_audio.output[0].data[ch];
 
-		pos = (size_t)ns_to_audio_frames(sample_rate,
-						 source_ts - timestamp);
-		count = AUDIO_OUTPUT_FRAMES - pos;
+		if (input.pos > max_pos)
+			max_pos = input.pos;
+		i++;
+	}
+
+	size_t num = mix_inputs.size();
+	mix_channel_inputs.resize(num);
+
+	for (size_t ch = 0; ch < channels; ch++) {
+		float *out = audio_output->data[ch];
 
-		obs_source_get_audio_mix(s, &child_audio);
-		for (size_t ch = 0; ch < channels; ch++) {
-			float *out = audio_output->data[ch];
-			float *in = child_audio.output[0].data[ch];
+		/* libobs clears the output before asking for it, so a single
+		 * stream can just be copied over */
+		if (num == 1) {
+			const AudioMixInput &input = mix_inputs[0];
+			memcpy(out, input.data[ch] + input.pos,
+			       (AUDIO_OUTPUT_FRAMES - input.pos) *
+				       sizeof(float));
+			continue;
+		}
 
-			mix_audio(out, in, pos, count);
+		/* every stream covers the output up to where the latest one
+		 * ends, that part is mixed in one pass.  the earlier ones
+		 * then get their remainder mixed in separately. */
+		size_t common = AUDIO_OUTPUT_FRAMES - max_pos;
+		for (size_t i = 0; i < num; i++)
+			mix_channel_inputs[i] =
+				mix_inputs[i].data[ch] + mix_inputs[i].pos;
+
+		mix_audio_multi(out, mix_channel_inputs.data(), num, common);
+
+		for (size_t i = 0; i < num; i++) {
+			size_t count = AUDIO_OUTPUT_FRAMES - mix_inputs[i].pos;
+			if (count > common)
+				mix_audio(out + common,
+					  mix_channel_inputs[i] + common,
+					  count - common);
 		}
 	}
 
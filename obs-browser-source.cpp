@@ -19,12 +19,22 @@
 #include "obs-browser-source.hpp"
 #include "browser-client.hpp"
 #include "browser-scheme.hpp"
-#include "wide-string.hpp"
+#include "browser-texture-pool.hpp"
+#include "browser-state.hpp"
+#include "browser-occlusion.hpp"
+#include "browser-memory.hpp"
 #include "json11/json11.hpp"
 #include <util/threading.h>
+#include <util/platform.h>
+#include <util/util.hpp>
 #include <QApplication>
 #include <util/dstr.h>
+#include <inttypes.h>
+#include <algorithm>
+#include <deque>
 #include <functional>
+#include <unordered_map>
+#include <unordered_set>
 #include <thread>
 #include <mutex>
 
@@ -45,6 +55,18 @@ extern bool QueueCEFTask(std::function<void()> task);
 static mutex browser_list_mutex;
 static BrowserSource *first_browser = nullptr;
 
+/* suspended sources, most recently suspended first.  also protected by
+ * browser_list_mutex. */
+static std::list<BrowserSource *> suspended_browsers;
+
+/* sources that are currently showing, read by the message pump */
+static std::atomic<int> showing_browsers = {0};
+
+bool BrowserSourcesShowing()
+{
+	return showing_browsers > 0;
+}
+
 static void SendBrowserVisibility(CefRefPtr<CefBrowser> browser, bool isVisible)
 {
 	if (!browser)
@@ -68,6 +90,215 @@ static void SendBrowserVisibility(CefRefPtr<CefBrowser> browser, bool isVisible)
 
 void DispatchJSEvent(std::string eventName, std::string jsonString,
 		     BrowserSource *browser = nullptr);
+void FlushJSEvents();
+
+/* Sources that are shown but can't be seen, see Occlusion::FindOccluded,
+ * only get every OCCLUDED_FRAME_INTERVAL'th begin frame, or paint at
+ * OCCLUDED_FPS with a custom frame rate.  They keep painting now and then
+ * so they aren't far behind once they can be seen again. */
+#define OCCLUDED_FRAME_INTERVAL 15
+#define OCCLUDED_FPS 2
+
+static void UpdateOcclusion()
+{
+	std::unordered_set<obs_source_t *> showing;
+
+	{
+		lock_guard<mutex> lock(browser_list_mutex);
+
+		for (BrowserSource *bs = first_browser; bs; bs = bs->next) {
+			if (bs->is_showing && bs->has_browser)
+				showing.insert(bs->source);
+		}
+	}
+
+	/* walking the scenes takes their locks, so it can't be done while
+	 * holding browser_list_mutex */
+	std::unordered_set<obs_source_t *> occluded =
+		Occlusion::FindOccluded(showing);
+
+	lock_guard<mutex> lock(browser_list_mutex);
+	for (BrowserSource *bs = first_browser; bs; bs = bs->next) {
+		bool hidden = bs->is_showing && occluded.count(bs->source) &&
+			      !bs->drawn_to_display;
+		bs->drawn_to_display = false;
+		bs->SetOccluded(hidden);
+	}
+}
+
+#if ENABLE_EXTERNAL_BEGIN_FRAME
+/* Pages that haven't painted for this many due frames are considered idle,
+ * and only get every IDLE_FRAME_INTERVAL'th begin frame until they paint
+ * again */
+#define IDLE_FRAME_THRESHOLD 30
+#define IDLE_FRAME_INTERVAL 4
+
+/* Rather than each source posting its own task, the begin frames for every
+ * source that is due are sent from a single CEF task. */
+static void SendBeginFrames()
+{
+	std::vector<CefRefPtr<CefBrowser>> browsers;
+
+	{
+		lock_guard<mutex> lock(browser_list_mutex);
+
+		for (BrowserSource *bs = first_browser; bs; bs = bs->next) {
+			if (bs->WantsBeginFrame())
+				browsers.push_back(bs->cefBrowser);
+		}
+	}
+
+	if (browsers.empty())
+		return;
+
+	QueueCEFTask([browsers]() {
+		for (const CefRefPtr<CefBrowser> &browser : browsers)
+			browser->GetHost()->SendExternalBeginFrame();
+	});
+}
+#endif
+
+/* Renderers are polled for their resident memory.  While all of them put
+ * together use more than memory_budget_mb, the biggest ones are put under
+ * memory pressure, as many as it takes to make up for what's over.  Sources
+ * with a memory limit of their own are checked in CheckMemoryLimit.
+ *
+ * Renderers can be shared by several sources, see BrowserProcessPerSite,
+ * in which case it's what all of them use together. */
+static std::atomic<bool> memory_poll_pending = {false};
+
+/* Called with the resident memory of every renderer.  Sources only get told
+ * what to do here, they act on it in their own Tick. */
+static void
+ApplyRendererMemory(const std::unordered_map<int, uint64_t> &renderers,
+		    uint64_t now)
+{
+	uint64_t total = 0;
+	for (const auto &renderer : renderers)
+		total += renderer.second;
+
+	lock_guard<mutex> lock(browser_list_mutex);
+
+	for (BrowserSource *bs = first_browser; bs; bs = bs->next) {
+		auto it = renderers.find(bs->renderer_pid);
+		bs->renderer_rss = it != renderers.end() ? it->second : 0;
+		bs->CheckMemoryLimit(now);
+	}
+
+	uint64_t budget = (uint64_t)memory_budget_mb * 1024 * 1024;
+	if (!budget || total <= budget)
+		return;
+
+	blog(LOG_WARNING,
+	     "[obs-browser]: Renderers use %.1f MB, more than the budget of "
+	     "%d MB",
+	     (double)total / (1024.0 * 1024.0), memory_budget_mb);
+
+	std::vector<std::pair<uint64_t, int>> worst;
+	for (const auto &renderer : renderers)
+		worst.emplace_back(renderer.second, renderer.first);
+	std::sort(worst.begin(), worst.end(),
+		  std::greater<std::pair<uint64_t, int>>());
+
+	uint64_t excess = total - budget;
+	uint64_t covered = 0;
+
+	for (const auto &renderer : worst) {
+		if (covered >= excess)
+			break;
+		covered += renderer.first;
+
+		/* one browser is enough to reach the whole renderer */
+		for (BrowserSource *bs = first_browser; bs; bs = bs->next) {
+			if (bs->renderer_pid == renderer.second &&
+			    bs->has_browser) {
+				bs->pressure_requested = true;
+				break;
+			}
+		}
+	}
+}
+
+/* reading process memory can block, so it's done on one of CEF's file
+ * threads rather than the graphics thread */
+class MemoryPollTask : public CefTask {
+	std::unordered_map<int, uint64_t> renderers;
+	uint64_t poll_ns;
+
+public:
+	inline MemoryPollTask(std::unordered_map<int, uint64_t> &&renderers_,
+			      uint64_t poll_ns_)
+		: renderers(std::move(renderers_)), poll_ns(poll_ns_)
+	{
+	}
+
+	virtual void Execute() override
+	{
+		for (auto &renderer : renderers)
+			renderer.second =
+				GetProcessResidentBytes(renderer.first);
+
+		ApplyRendererMemory(renderers, poll_ns);
+		memory_poll_pending = false;
+	}
+
+	IMPLEMENT_REFCOUNTING(MemoryPollTask);
+};
+
+static void UpdateRendererMemory()
+{
+	/* graphics thread only */
+	static uint64_t last_poll_ns = 0;
+	uint64_t now = os_gettime_ns();
+	if (now - last_poll_ns < MEMORY_POLL_INTERVAL_NS || memory_poll_pending)
+		return;
+	last_poll_ns = now;
+
+	std::unordered_map<int, uint64_t> renderers;
+
+	{
+		lock_guard<mutex> lock(browser_list_mutex);
+
+		for (BrowserSource *bs = first_browser; bs; bs = bs->next) {
+			if (bs->renderer_pid)
+				renderers[bs->renderer_pid] = 0;
+		}
+	}
+
+	if (renderers.empty())
+		return;
+
+	memory_poll_pending = true;
+	CefRefPtr<MemoryPollTask> task =
+		new MemoryPollTask(std::move(renderers), now);
+#if CHROME_VERSION_BUILD >= 3538
+	if (!CefPostTask(TID_FILE_BACKGROUND, task))
+#else
+	if (!CefPostTask(TID_FILE, task))
+#endif
+		memory_poll_pending = false;
+}
+
+/* Called once per video frame on the graphics thread before sources are
+ * ticked.  Occlusion is updated first, so sources that come back in to
+ * view get their begin frame in the same video frame. */
+static void BrowserSourcesTick(void *, float)
+{
+	if (throttle_occluded)
+		UpdateOcclusion();
+	UpdateRendererMemory();
+	FlushJSEvents();
+#if ENABLE_EXTERNAL_BEGIN_FRAME
+	SendBeginFrames();
+#endif
+}
+
+static void GetStatsProc(void *data, calldata_t *cd)
+{
+	BrowserSource *bs = static_cast<BrowserSource *>(data);
+	std::string json = GetBrowserSourceStats(bs).dump();
+	calldata_set_string(cd, "json", json.c_str());
+}
 
 BrowserSource::BrowserSource(obs_data_t *, obs_source_t *source_)
 	: source(source_)
@@ -75,6 +306,19 @@ BrowserSource::BrowserSource(obs_data_t *, obs_source_t *source_)
 	/* defer update */
 	obs_source_update(source, nullptr);
 
+	proc_handler_t *ph = obs_source_get_proc_handler(source);
+	proc_handler_add(ph, "void get_stats(out string json)", GetStatsProc,
+			 this);
+
+	/* tick callbacks are called with libobs' callback mutex held, so this
+	 * can't be done while holding browser_list_mutex.  it's also never
+	 * removed, as libobs frees its callback lists before modules are
+	 * unloaded. */
+	static std::once_flag tick_registered;
+	std::call_once(tick_registered, []() {
+		obs_add_tick_callback(BrowserSourcesTick, nullptr);
+	});
+
 	lock_guard<mutex> lock(browser_list_mutex);
 	p_prev_next = &first_browser;
 	next = first_browser;
@@ -85,13 +329,59 @@ BrowserSource::BrowserSource(obs_data_t *, obs_source_t *source_)
 
 BrowserSource::~BrowserSource()
 {
+	/* has to be taken out first, so it can't be evicted while the
+	 * browser is being destroyed below */
+	{
+		lock_guard<mutex> lock(browser_list_mutex);
+		suspended_browsers.remove(this);
+		suspended = false;
+	}
+
+	if (is_showing)
+		showing_browsers--;
+
 	DestroyBrowser();
 	DestroyTextures();
 
-	lock_guard<mutex> lock(browser_list_mutex);
-	if (next)
-		next->p_prev_next = p_prev_next;
-	*p_prev_next = next;
+	blog(LOG_DEBUG,
+	     "[obs-browser: '%s'] Uploaded %.2f MB "
+	     "(%" PRIu64 " full frames, %" PRIu64 " partial frames, "
+	     "%" PRIu64 " dropped frames)",
+	     obs_source_get_name(source),
+	     (double)upload_bytes / (1024.0 * 1024.0),
+	     (uint64_t)full_uploads, (uint64_t)partial_uploads,
+	     (uint64_t)dropped_frames);
+	blog(LOG_DEBUG,
+	     "[obs-browser: '%s'] Input: %" PRIu64 " merged mouse moves, "
+	     "%" PRIu64 " dropped events",
+	     obs_source_get_name(source), input->merged, input->dropped);
+#if ENABLE_EXTERNAL_BEGIN_FRAME
+	blog(LOG_DEBUG,
+	     "[obs-browser: '%s'] Sent %" PRIu64 " begin frames, "
+	     "%" PRIu64 " paints",
+	     obs_source_get_name(source), (uint64_t)begin_frames,
+	     (uint64_t)paint_count);
+#endif
+
+	bool last;
+
+	{
+		lock_guard<mutex> lock(browser_list_mutex);
+		if (next)
+			next->p_prev_next = p_prev_next;
+		*p_prev_next = next;
+		last = !first_browser;
+	}
+
+	/* graphics are torn down before modules are unloaded, so idle
+	 * textures have to be freed along with the last source.  the graphics
+	 * thread takes the two locks the other way around, so the list lock
+	 * can't be held here. */
+	if (last) {
+		obs_enter_graphics();
+		TexturePool::Clear();
+		obs_leave_graphics();
+	}
 }
 
 void BrowserSource::ExecuteOnBrowser(BrowserFunc func, bool async)
@@ -127,250 +417,897 @@ void BrowserSource::ExecuteOnBrowser(BrowserFunc func, bool async)
 	}
 }
 
-bool BrowserSource::CreateBrowser()
+/* Browsers are created asynchronously, and only this many at a time so
+ * that loading a scene collection with lots of sources doesn't starve the
+ * browsers that are already running.  The rest wait in creation_queue.
+ * CEF UI thread only. */
+#define MAX_PENDING_CREATIONS 4
+
+static std::deque<BrowserSource *> creation_queue;
+static int pending_creations = 0;
+
+/* With prewarming, spare browsers are kept on about:blank with nothing
+ * attached, and sources that don't need anything a spare wasn't created
+ * with take one over instead of waiting for a new renderer process.  The
+ * site of a spare isn't assigned until its first navigation, so that
+ * navigation normally stays in the renderer that's already running.
+ * Spares are only created with what source creations leave over. */
+static int spare_target = 0;
+static int pending_spares = 0;
+static std::vector<CefRefPtr<CefBrowser>> spare_browsers;
+
+static void CloseBrowser(CefRefPtr<CefBrowser> cefBrowser);
+
+static bool CreateSpareBrowser()
 {
-	return QueueCEFTask([this]() {
 #if EXPERIMENTAL_SHARED_TEXTURE_SUPPORT_ENABLED
-		if (hwaccel) {
-			obs_enter_graphics();
-			tex_sharing_avail = gs_shared_texture_available();
-			obs_leave_graphics();
-		}
+	bool tex_sharing_avail = false;
+	if (hwaccel) {
+		obs_enter_graphics();
+		tex_sharing_avail = SharedTexturesAvailable();
+		obs_leave_graphics();
+	}
 #else
-		bool hwaccel = false;
+	bool hwaccel = false;
+	bool tex_sharing_avail = false;
 #endif
 
-		CefRefPtr<BrowserClient> browserClient = new BrowserClient(
-			this, hwaccel && tex_sharing_avail, reroute_audio);
+	CefRefPtr<BrowserClient> browserClient = new BrowserClient(
+		nullptr, hwaccel && tex_sharing_avail, false);
+	browserClient->spare = true;
 
-		CefWindowInfo windowInfo;
+	CefWindowInfo windowInfo;
 #if CHROME_VERSION_BUILD < 3071
-		windowInfo.transparent_painting_enabled = true;
+	windowInfo.transparent_painting_enabled = true;
 #endif
-		windowInfo.width = width;
-		windowInfo.height = height;
-		windowInfo.windowless_rendering_enabled = true;
+	windowInfo.windowless_rendering_enabled = true;
 
 #if EXPERIMENTAL_SHARED_TEXTURE_SUPPORT_ENABLED
-		windowInfo.shared_texture_enabled = hwaccel;
+	windowInfo.shared_texture_enabled = hwaccel;
+#endif
+
+	CefBrowserSettings cefBrowserSettings;
+
+#if ENABLE_EXTERNAL_BEGIN_FRAME
+	windowInfo.external_begin_frame_enabled = true;
+	cefBrowserSettings.windowless_frame_rate = 0;
+#endif
+
+	return CefBrowserHost::CreateBrowser(windowInfo, browserClient,
+					     "about:blank", cefBrowserSettings,
+#if CHROME_VERSION_BUILD >= 3770
+					     CefRefPtr<CefDictionaryValue>(),
+#endif
+					     CefRefPtr<CefRequestContext>());
+}
+
+static void StartCreations()
+{
+	while (pending_creations < MAX_PENDING_CREATIONS &&
+	       !creation_queue.empty()) {
+		BrowserSource *bs = creation_queue.front();
+		creation_queue.pop_front();
+
+		if (bs->AdoptSpareBrowser())
+			continue;
+		if (bs->StartCreation())
+			pending_creations++;
+	}
+
+	while (creation_queue.empty() &&
+	       pending_creations < MAX_PENDING_CREATIONS &&
+	       (int)spare_browsers.size() + pending_spares < spare_target) {
+		if (!CreateSpareBrowser())
+			break;
+
+		pending_spares++;
+		pending_creations++;
+	}
+}
+
+void BrowserCreationDone()
+{
+	pending_creations--;
+	StartCreations();
+}
+
+void AddSpareBrowser(CefRefPtr<CefBrowser> browser)
+{
+	pending_spares--;
+
+	if ((int)spare_browsers.size() < spare_target)
+		spare_browsers.push_back(browser);
+	else
+		CloseBrowser(browser);
+}
+
+void PrewarmBrowsers(int count)
+{
+	spare_target = count;
+	StartCreations();
+}
+
+void ReleaseSpareBrowsers()
+{
+	spare_target = 0;
+	for (CefRefPtr<CefBrowser> &browser : spare_browsers)
+		CloseBrowser(browser);
+	spare_browsers.clear();
+}
+
+/* Called from StartCreations.  A spare is created without a request
+ * context, web security relaxations or a frame rate of its own, so sources
+ * that need any of those still get a browser of their own. */
+bool BrowserSource::AdoptSpareBrowser()
+{
+	if (spare_browsers.empty() || !profile.empty() || is_local ||
+	    software_paint)
+		return false;
+#if ENABLE_EXTERNAL_BEGIN_FRAME
+	if (fps_custom)
+		return false;
 #endif
 
-		CefBrowserSettings cefBrowserSettings;
+	CefRefPtr<CefBrowser> browser = spare_browsers.back();
+	spare_browsers.pop_back();
 
+	CefRefPtr<CefClient> client = browser->GetHost()->GetClient();
+	BrowserClient *bc = reinterpret_cast<BrowserClient *>(client.get());
+	bc->AttachSource(this, reroute_audio);
+
+	/* the renderer of a spare got no extra_info, and BrowserCreated
+	 * navigates it away from about:blank */
+	created_url.clear();
+	injection_changed = true;
+	prewarmed = true;
+	page_committed = false;
 #if EXPERIMENTAL_SHARED_TEXTURE_SUPPORT_ENABLED
-		if (!fps_custom) {
-			windowInfo.external_begin_frame_enabled = true;
-			cefBrowserSettings.windowless_frame_rate = 0;
-		} else {
-			cefBrowserSettings.windowless_frame_rate = fps;
-		}
+	shared_paint = hwaccel;
+#endif
+
+	BrowserCreated(browser);
+	return true;
+}
+
+bool BrowserSource::CreateBrowser()
+{
+	if (creating)
+		return true;
+
+	create_ns = os_gettime_ns();
+	first_frame_ns = 0;
+	prewarmed = false;
+	page_committed = true;
+	creating = true;
+	bool success = QueueCEFTask([this]() {
+		creation_queue.push_back(this);
+		StartCreations();
+	});
+	if (!success)
+		creating = false;
+	return success;
+}
+
+bool BrowserSource::StartCreation()
+{
+#if EXPERIMENTAL_SHARED_TEXTURE_SUPPORT_ENABLED
+	if (hwaccel) {
+		obs_enter_graphics();
+		tex_sharing_avail = SharedTexturesAvailable();
+		obs_leave_graphics();
+	}
 #else
+	bool hwaccel = false;
+#endif
+
+	/* sources whose shared textures couldn't be opened stay on software
+	 * paints, see BrowserSource::FallBackToSoftwarePaint */
+	bool shared = hwaccel && tex_sharing_avail && !software_paint;
+	shared_paint = shared;
+
+	CefRefPtr<BrowserClient> browserClient =
+		new BrowserClient(this, shared, reroute_audio);
+
+	CefWindowInfo windowInfo;
+#if CHROME_VERSION_BUILD < 3071
+	windowInfo.transparent_painting_enabled = true;
+#endif
+	windowInfo.width = width;
+	windowInfo.height = height;
+	windowInfo.windowless_rendering_enabled = true;
+
+#if EXPERIMENTAL_SHARED_TEXTURE_SUPPORT_ENABLED
+	windowInfo.shared_texture_enabled = shared;
+#endif
+
+	CefBrowserSettings cefBrowserSettings;
+
+#if ENABLE_EXTERNAL_BEGIN_FRAME
+	if (!fps_custom) {
+		windowInfo.external_begin_frame_enabled = true;
+		cefBrowserSettings.windowless_frame_rate = 0;
+	} else {
 		cefBrowserSettings.windowless_frame_rate = fps;
+	}
+#else
+	cefBrowserSettings.windowless_frame_rate = fps;
 #endif
 
 #if ENABLE_LOCAL_FILE_URL_SCHEME
-		if (is_local) {
-			/* Disable web security for file:// URLs to allow
-			 * local content access to remote APIs */
-			cefBrowserSettings.web_security = STATE_DISABLED;
-		}
+	if (is_local) {
+		/* Disable web security for file:// URLs to allow
+		 * local content access to remote APIs */
+		cefBrowserSettings.web_security = STATE_DISABLED;
+	}
 #endif
 
-		cefBrowser = CefBrowserHost::CreateBrowserSync(
-			windowInfo, browserClient, url, cefBrowserSettings,
 #if CHROME_VERSION_BUILD >= 3770
-			CefRefPtr<CefDictionaryValue>(),
+	/* applied by the renderer as soon as each page's document exists,
+	 * see BrowserApp::OnContextCreated */
+	CefRefPtr<CefDictionaryValue> extra_info =
+		CefDictionaryValue::Create();
+	extra_info->SetString("css", css);
+	extra_info->SetString("script", script);
 #endif
-			nullptr);
+
+	created_url = url;
+	injection_changed = false;
+	bool success = CefBrowserHost::CreateBrowser(
+		windowInfo, browserClient, created_url, cefBrowserSettings,
+#if CHROME_VERSION_BUILD >= 3770
+		extra_info,
+#endif
+		GetRequestContext(profile));
+
+	if (success)
+		pending_client = browserClient;
+	else
+		creating = false;
+	return success;
+}
+
+/* The graphics thread copies cefBrowser out when it sends begin frames,
+ * so it's only ever changed with browser_list_mutex held, and has_browser
+ * along with it for the threads that only need to know whether there is
+ * one.  The old browser is let go of after the lock is released. */
+void BrowserSource::SetBrowser(CefRefPtr<CefBrowser> browser)
+{
+	CefRefPtr<CefBrowser> old;
+
+	lock_guard<mutex> lock(browser_list_mutex);
+	old = cefBrowser;
+	cefBrowser = browser;
+	has_browser = !!browser;
+}
+
+/* Called from BrowserClient::OnAfterCreated */
+void BrowserSource::BrowserCreated(CefRefPtr<CefBrowser> browser)
+{
+	pending_client = nullptr;
+	creating = false;
+
+	/* whatever was suspended or about to be evicted is gone now */
+	{
+		lock_guard<mutex> lock(browser_list_mutex);
+		cefBrowser = browser;
+		has_browser = true;
+		suspended_browsers.remove(this);
+		suspended = false;
+	}
+	evict_pending = false;
+
+	RegisterBrowser(browser);
 #if CHROME_VERSION_BUILD >= 3683
-		if (reroute_audio)
-			cefBrowser->GetHost()->SetAudioMuted(true);
+	if (reroute_audio)
+		browser->GetHost()->SetAudioMuted(true);
 #endif
 
-		SendBrowserVisibility(cefBrowser, is_showing);
+	/* settings can change while the browser is being created, the view
+	 * rect is picked up from the source anyway */
+	browser->GetHost()->WasResized();
+	occluded = false;
+	if (fps_custom)
+		browser->GetHost()->SetWindowlessFrameRate(fps);
+	if (url != created_url)
+		browser->GetMainFrame()->LoadURL(url);
+
+#if CHROME_VERSION_BUILD >= 3770
+	if (injection_changed)
+		SendPageInjection(browser, css, script, true);
+#else
+	/* no extra_info, so the first page may already be there by the time
+	 * this arrives */
+	SendPageInjection(browser, css, script, true);
+#endif
+
+	SendBrowserVisibility(browser, is_showing);
+}
+
+/* A browser that's still being created is closed as soon as it's done, see
+ * BrowserClient::OnAfterCreated.  Runs from DestroyBrowser after it has
+ * cleared cefBrowser, so if it's set again here, creation finished in
+ * between and that browser has to go as well. */
+void BrowserSource::CancelCreation()
+{
+	creation_queue.erase(std::remove(creation_queue.begin(),
+					 creation_queue.end(), this),
+			     creation_queue.end());
+
+	if (pending_client) {
+		BrowserClient *bc =
+			reinterpret_cast<BrowserClient *>(pending_client.get());
+		bc->DetachSource();
+		pending_client = nullptr;
+	}
+
+	if (cefBrowser) {
+		CloseBrowser(cefBrowser);
+		SetBrowser(nullptr);
+	}
+}
+
+static void CloseBrowser(CefRefPtr<CefBrowser> cefBrowser)
+{
+	CefRefPtr<CefClient> client = cefBrowser->GetHost()->GetClient();
+	BrowserClient *bc = reinterpret_cast<BrowserClient *>(client.get());
+	if (bc) {
+		bc->DetachSource();
+	}
+
+	/*
+	 * This stops rendering
+	 * http://magpcss.org/ceforum/viewtopic.php?f=6&t=12079
+	 * https://bitbucket.org/chromiumembedded/cef/issues/1363/washidden-api-got-broken-on-branch-2062)
+	 */
+	cefBrowser->GetHost()->WasHidden(true);
+	cefBrowser->GetHost()->CloseBrowser(true);
+}
+
+/* Runs func on the CEF UI thread, and waits for it unless async */
+static void ExecuteOnCEFThread(std::function<void()> func, bool async)
+{
+	if (async) {
+		QueueCEFTask(func);
+		return;
+	}
+
+#ifdef USE_QT_LOOP
+	if (QThread::currentThread() == qApp->thread()) {
+		func();
+		return;
+	}
+#endif
+	os_event_t *finishedEvent;
+	os_event_init(&finishedEvent, OS_EVENT_TYPE_AUTO);
+	bool success = QueueCEFTask([&]() {
+		func();
+		os_event_signal(finishedEvent);
 	});
+	if (success) {
+		os_event_wait(finishedEvent);
+	}
+	os_event_destroy(finishedEvent);
 }
 
 void BrowserSource::DestroyBrowser(bool async)
 {
-	ExecuteOnBrowser(
-		[](CefRefPtr<CefBrowser> cefBrowser) {
-			CefRefPtr<CefClient> client =
-				cefBrowser->GetHost()->GetClient();
-			BrowserClient *bc =
-				reinterpret_cast<BrowserClient *>(client.get());
-			if (bc) {
-				bc->bs = nullptr;
-			}
+	ExecuteOnBrowser(CloseBrowser, async);
 
-			/*
-		 * This stops rendering
-		 * http://magpcss.org/ceforum/viewtopic.php?f=6&t=12079
-		 * https://bitbucket.org/chromiumembedded/cef/issues/1363/washidden-api-got-broken-on-branch-2062)
-		 */
-			cefBrowser->GetHost()->WasHidden(true);
-			cefBrowser->GetHost()->CloseBrowser(true);
-		},
-		async);
+	SetBrowser(nullptr);
+	creating = false;
+	/* the next browser reports its own, this one may get reused */
+	renderer_pid = 0;
+	renderer_rss = 0;
 
-	cefBrowser = nullptr;
+	/* queued after the browser is cleared, see CancelCreation */
+	ExecuteOnCEFThread([this]() { CancelCreation(); }, async);
 }
 
 void BrowserSource::ClearAudioStreams()
 {
 	QueueCEFTask([this]() {
+		std::lock_guard<std::mutex> lock(audio_streams_mutex);
 		audio_streams.clear();
-		std::lock_guard<std::mutex> lock(audio_sources_mutex);
+		std::lock_guard<std::mutex> sources_lock(audio_sources_mutex);
 		audio_sources.clear();
+		direct_streams.clear();
 	});
 }
 
+/* Takes the first code point of a UTF-8 string, which is all a key event
+ * can carry */
+static uint32_t FirstCharacter(const char *text)
+{
+	const uint8_t *p = (const uint8_t *)text;
+	uint32_t ch;
+	int extra;
+
+	if (!p || !*p)
+		return 0;
+
+	if (p[0] < 0x80) {
+		return p[0];
+	} else if ((p[0] & 0xE0) == 0xC0) {
+		ch = p[0] & 0x1F;
+		extra = 1;
+	} else if ((p[0] & 0xF0) == 0xE0) {
+		ch = p[0] & 0x0F;
+		extra = 2;
+	} else if ((p[0] & 0xF8) == 0xF0) {
+		ch = p[0] & 0x07;
+		extra = 3;
+	} else {
+		return 0;
+	}
+
+	for (int i = 1; i <= extra; i++) {
+		if ((p[i] & 0xC0) != 0x80)
+			return 0;
+		ch = (ch << 6) | (p[i] & 0x3F);
+	}
+
+	if (ch > 0x10FFFF || (ch >= 0xD800 && ch <= 0xDFFF))
+		return 0;
+	return ch;
+}
+
+static void SendInputEvent(CefRefPtr<CefBrowserHost> host,
+			   const BrowserInputEvent &event)
+{
+	switch (event.type) {
+	case BrowserInputType::MouseClick: {
+		CefMouseEvent e;
+		e.modifiers = event.modifiers;
+		e.x = event.x;
+		e.y = event.y;
+		host->SendMouseClickEvent(
+			e, (CefBrowserHost::MouseButtonType)event.param1,
+			event.flag, event.param2);
+		break;
+	}
+	case BrowserInputType::MouseMove: {
+		CefMouseEvent e;
+		e.modifiers = event.modifiers;
+		e.x = event.x;
+		e.y = event.y;
+		host->SendMouseMoveEvent(e, event.flag);
+		break;
+	}
+	case BrowserInputType::MouseWheel: {
+		CefMouseEvent e;
+		e.modifiers = event.modifiers;
+		e.x = event.x;
+		e.y = event.y;
+		host->SendMouseWheelEvent(e, event.param1, event.param2);
+		break;
+	}
+	case BrowserInputType::Focus:
+		host->SendFocusEvent(event.flag);
+		break;
+	case BrowserInputType::Key: {
+		/* characters outside of the BMP take a surrogate pair, and
+		 * each half gets a char event of its own */
+		char16 units[2] = {0, 0};
+		int num_units = 0;
+		if (event.character >= 0x10000) {
+			uint32_t ch = event.character - 0x10000;
+			units[0] = (char16)(0xD800 + (ch >> 10));
+			units[1] = (char16)(0xDC00 + (ch & 0x3FF));
+			num_units = 2;
+		} else if (event.character) {
+			units[0] = (char16)event.character;
+			num_units = 1;
+		}
+
+		CefKeyEvent e;
+		e.windows_key_code = event.native_vkey;
+		e.native_key_code = event.native_scancode;
+		e.type = event.flag ? KEYEVENT_KEYUP : KEYEVENT_RAWKEYDOWN;
+		e.character = units[0];
+		e.modifiers = event.modifiers;
+
+		host->SendKeyEvent(e);
+		if (event.flag)
+			break;
+
+		for (int i = 0; i < num_units; i++) {
+			e.type = KEYEVENT_CHAR;
+			e.character = units[i];
+#ifdef __linux__
+			e.windows_key_code =
+				KeyboardCodeFromXKeysym(e.character);
+#else
+			e.windows_key_code = e.character;
+#endif
+			e.native_key_code = event.native_scancode;
+			host->SendKeyEvent(e);
+		}
+		break;
+	}
+	}
+}
+
+static void DrainInput(std::shared_ptr<BrowserInputQueue> queue,
+		       CefRefPtr<CefBrowser> browser)
+{
+	BrowserInputEvent events[BROWSER_INPUT_QUEUE_SIZE];
+	size_t count;
+
+	{
+		std::lock_guard<std::mutex> lock(queue->mutex);
+		count = queue->count;
+		for (size_t i = 0; i < count; i++)
+			events[i] = queue->events[(queue->head + i) %
+						  BROWSER_INPUT_QUEUE_SIZE];
+		queue->head = 0;
+		queue->count = 0;
+		queue->drain_pending = false;
+	}
+
+	CefRefPtr<CefBrowserHost> host = browser->GetHost();
+	for (size_t i = 0; i < count; i++)
+		SendInputEvent(host, events[i]);
+}
+
+void BrowserSource::QueueInput(const BrowserInputEvent &event)
+{
+	CefRefPtr<CefBrowser> browser = cefBrowser;
+	if (!browser)
+		return;
+
+#if ENABLE_EXTERNAL_BEGIN_FRAME
+	idle_frames = 0;
+#endif
+
+	{
+		std::lock_guard<std::mutex> lock(input->mutex);
+		BrowserInputQueue &queue = *input;
+
+		/* only the latest position of successive moves matters */
+		if (event.type == BrowserInputType::MouseMove && queue.count) {
+			BrowserInputEvent &last =
+				queue.events[(queue.head + queue.count - 1) %
+					     BROWSER_INPUT_QUEUE_SIZE];
+			if (last.type == BrowserInputType::MouseMove &&
+			    last.flag == event.flag) {
+				last = event;
+				queue.merged++;
+				return;
+			}
+		}
+
+		if (queue.count == BROWSER_INPUT_QUEUE_SIZE) {
+			queue.head = (queue.head + 1) % BROWSER_INPUT_QUEUE_SIZE;
+			queue.count--;
+			queue.dropped++;
+		}
+
+		queue.events[(queue.head + queue.count) %
+			     BROWSER_INPUT_QUEUE_SIZE] = event;
+		queue.count++;
+
+		if (queue.drain_pending)
+			return;
+		queue.drain_pending = true;
+	}
+
+	std::shared_ptr<BrowserInputQueue> queue = input;
+#ifdef USE_QT_LOOP
+	QueueBrowserTask(browser, [queue](CefRefPtr<CefBrowser> cefBrowser) {
+		DrainInput(queue, cefBrowser);
+	});
+#else
+	if (!QueueCEFTask([queue, browser]() { DrainInput(queue, browser); })) {
+		/* the next event tries again */
+		std::lock_guard<std::mutex> lock(queue->mutex);
+		queue->drain_pending = false;
+	}
+#endif
+}
+
 void BrowserSource::SendMouseClick(const struct obs_mouse_event *event,
 				   int32_t type, bool mouse_up,
 				   uint32_t click_count)
 {
-	uint32_t modifiers = event->modifiers;
-	int32_t x = event->x;
-	int32_t y = event->y;
-
-	ExecuteOnBrowser(
-		[=](CefRefPtr<CefBrowser> cefBrowser) {
-			CefMouseEvent e;
-			e.modifiers = modifiers;
-			e.x = x;
-			e.y = y;
-			CefBrowserHost::MouseButtonType buttonType =
-				(CefBrowserHost::MouseButtonType)type;
-			cefBrowser->GetHost()->SendMouseClickEvent(
-				e, buttonType, mouse_up, click_count);
-		},
-		true);
+	BrowserInputEvent e = {};
+	e.type = BrowserInputType::MouseClick;
+	e.flag = mouse_up;
+	e.x = event->x;
+	e.y = event->y;
+	e.modifiers = event->modifiers;
+	e.param1 = type;
+	e.param2 = (int32_t)click_count;
+	QueueInput(e);
 }
 
 void BrowserSource::SendMouseMove(const struct obs_mouse_event *event,
 				  bool mouse_leave)
 {
-	uint32_t modifiers = event->modifiers;
-	int32_t x = event->x;
-	int32_t y = event->y;
+	BrowserInputEvent e = {};
+	e.type = BrowserInputType::MouseMove;
+	e.flag = mouse_leave;
+	e.x = event->x;
+	e.y = event->y;
+	e.modifiers = event->modifiers;
+	QueueInput(e);
+}
+
+void BrowserSource::SendMouseWheel(const struct obs_mouse_event *event,
+				   int x_delta, int y_delta)
+{
+	BrowserInputEvent e = {};
+	e.type = BrowserInputType::MouseWheel;
+	e.x = event->x;
+	e.y = event->y;
+	e.modifiers = event->modifiers;
+	e.param1 = x_delta;
+	e.param2 = y_delta;
+	QueueInput(e);
+}
+
+void BrowserSource::SendFocus(bool focus)
+{
+	BrowserInputEvent e = {};
+	e.type = BrowserInputType::Focus;
+	e.flag = focus;
+	QueueInput(e);
+}
+
+void BrowserSource::SendKeyClick(const struct obs_key_event *event, bool key_up)
+{
+	BrowserInputEvent e = {};
+	e.type = BrowserInputType::Key;
+	e.flag = key_up;
+#ifdef __linux__
+	e.native_vkey = KeyboardCodeFromXKeysym(event->native_vkey);
+#else
+	e.native_vkey = event->native_vkey;
+#endif
+	e.native_scancode = event->native_scancode;
+	e.modifiers = event->native_modifiers;
+	e.character = FirstCharacter(event->text);
+	QueueInput(e);
+}
+
+void BrowserSource::SetShowing(bool showing)
+{
+	if (showing != is_showing)
+		showing_browsers += showing ? 1 : -1;
+	is_showing = showing;
+
+	if (shutdown_on_invisible) {
+		if (showing) {
+			Update();
+		} else {
+			DestroyBrowser(true);
+		}
+	} else {
+		/* an eviction that hasn't happened yet is called off, the
+		 * browser is still there to be resumed */
+		bool evicting = showing && evict_pending.exchange(false);
+		if (showing && (suspended || evicting)) {
+			Resume();
+		} else if (showing && suspend_hidden && !cefBrowser &&
+			   !create_browser && !creating) {
+			/* evicted from the suspended list while hidden */
+			Update();
+			return;
+		}
+
+		ExecuteOnBrowser(
+			[=](CefRefPtr<CefBrowser> cefBrowser) {
+				CefRefPtr<CefProcessMessage> msg =
+					CefProcessMessage::Create("Visibility");
+				CefRefPtr<CefListValue> args =
+					msg->GetArgumentList();
+				args->SetBool(0, showing);
+				SendBrowserProcessMessage(cefBrowser,
+							  PID_RENDERER, msg);
+			},
+			true);
+		Json json = Json::object{{"visible", showing}};
+		DispatchJSEvent("obsSourceVisibleChanged", json.dump(), this);
+#if ENABLE_EXTERNAL_BEGIN_FRAME
+		if (showing)
+			idle_frames = 0;
+#endif
+
+		SendBrowserVisibility(cefBrowser, showing);
+
+		if (!showing && suspend_hidden)
+			Suspend();
+	}
+}
+
+#if CHROME_VERSION_BUILD >= 4183
+static void SetLifecycleState(CefRefPtr<CefBrowserHost> host, bool frozen)
+{
+	CefRefPtr<CefDictionaryValue> params = CefDictionaryValue::Create();
+	params->SetString("state", frozen ? "frozen" : "active");
+	host->ExecuteDevToolsMethod(0, "Page.setWebLifecycleState", params);
+
+	if (frozen) {
+		/* lets the renderer drop caches it can rebuild on resume */
+		params = CefDictionaryValue::Create();
+		params->SetString("level", "moderate");
+		host->ExecuteDevToolsMethod(
+			0, "Memory.simulatePressureNotification", params);
+	}
+}
+#endif
+
+/* Instead of destroying the browser of a hidden source, stop its rendering
+ * and timers and keep it around so it can be shown again without a reload.
+ * Only up to max_suspended_browsers are kept, after which the ones that
+ * were suspended the longest ago are destroyed, and get recreated as usual
+ * when they are shown again. */
+void BrowserSource::Suspend()
+{
+	if (!cefBrowser || suspended)
+		return;
 
 	ExecuteOnBrowser(
-		[=](CefRefPtr<CefBrowser> cefBrowser) {
-			CefMouseEvent e;
-			e.modifiers = modifiers;
-			e.x = x;
-			e.y = y;
-			cefBrowser->GetHost()->SendMouseMoveEvent(e,
-								  mouse_leave);
+		[](CefRefPtr<CefBrowser> cefBrowser) {
+			CefRefPtr<CefBrowserHost> host = cefBrowser->GetHost();
+#if ENABLE_WASHIDDEN
+			host->WasHidden(true);
+#endif
+#if CHROME_VERSION_BUILD >= 4183
+			SetLifecycleState(host, true);
+#endif
 		},
 		true);
+
+	lock_guard<mutex> lock(browser_list_mutex);
+	suspended = true;
+	suspended_browsers.push_front(this);
+
+	while (suspended_browsers.size() > (size_t)max_suspended_browsers) {
+		BrowserSource *bs = suspended_browsers.back();
+		suspended_browsers.pop_back();
+
+		blog(LOG_DEBUG,
+		     "[obs-browser: '%s'] Destroying suspended browser, "
+		     "more than %d are suspended",
+		     obs_source_get_name(bs->source), max_suspended_browsers);
+
+		/* other sources' browsers are only ever touched by the
+		 * sources themselves, see Tick */
+		bs->suspended = false;
+		bs->evict_pending = true;
+	}
 }
 
-void BrowserSource::SendMouseWheel(const struct obs_mouse_event *event,
-				   int x_delta, int y_delta)
+void BrowserSource::Resume()
 {
-	uint32_t modifiers = event->modifiers;
-	int32_t x = event->x;
-	int32_t y = event->y;
+	{
+		lock_guard<mutex> lock(browser_list_mutex);
+		suspended_browsers.remove(this);
+		suspended = false;
+	}
 
+	/* the visibility change that follows does WasHidden(false) */
+#if CHROME_VERSION_BUILD >= 4183
 	ExecuteOnBrowser(
-		[=](CefRefPtr<CefBrowser> cefBrowser) {
-			CefMouseEvent e;
-			e.modifiers = modifiers;
-			e.x = x;
-			e.y = y;
-			cefBrowser->GetHost()->SendMouseWheelEvent(e, x_delta,
-								   y_delta);
+		[](CefRefPtr<CefBrowser> cefBrowser) {
+			SetLifecycleState(cefBrowser->GetHost(), false);
 		},
 		true);
+#endif
 }
 
-void BrowserSource::SendFocus(bool focus)
+/* Collects garbage in the source's renderer, and has it drop whatever
+ * caches it can rebuild */
+void BrowserSource::SendMemoryPressure()
 {
+	pressure_signals++;
+
+	blog(LOG_INFO,
+	     "[obs-browser: '%s'] Renderer %d uses %.1f MB, sending memory "
+	     "pressure",
+	     obs_source_get_name(source), (int)renderer_pid,
+	     (double)renderer_rss / (1024.0 * 1024.0));
+
+#if CHROME_VERSION_BUILD >= 4183
 	ExecuteOnBrowser(
-		[=](CefRefPtr<CefBrowser> cefBrowser) {
-			cefBrowser->GetHost()->SendFocusEvent(focus);
+		[](CefRefPtr<CefBrowser> cefBrowser) {
+			CefRefPtr<CefBrowserHost> host = cefBrowser->GetHost();
+			host->ExecuteDevToolsMethod(
+				0, "HeapProfiler.collectGarbage", nullptr);
+
+			CefRefPtr<CefDictionaryValue> params =
+				CefDictionaryValue::Create();
+			params->SetString("level", "critical");
+			host->ExecuteDevToolsMethod(
+				0, "Memory.simulatePressureNotification",
+				params);
 		},
 		true);
+#endif
 }
 
-void BrowserSource::SendKeyClick(const struct obs_key_event *event, bool key_up)
+/* Has the page refreshed once the renderer goes over the source's memory
+ * limit, but only while it's hidden, so it doesn't happen on stream.  The
+ * refresh itself happens in Tick, see RefreshForMemoryLimit.  Called with
+ * browser_list_mutex held. */
+void BrowserSource::CheckMemoryLimit(uint64_t now)
 {
-	uint32_t modifiers = event->modifiers;
-	std::string text = event->text;
-#ifdef __linux__
-	uint32_t native_vkey = KeyboardCodeFromXKeysym(event->native_vkey);
-#else
-	uint32_t native_vkey = event->native_vkey;
-#endif
-	uint32_t native_scancode = event->native_scancode;
-	uint32_t native_modifiers = event->native_modifiers;
+	if (!memory_limit_mb || !has_browser) {
+		memory_refresh_pending = false;
+		return;
+	}
 
-	ExecuteOnBrowser(
-		[=](CefRefPtr<CefBrowser> cefBrowser) {
-			CefKeyEvent e;
-			e.windows_key_code = native_vkey;
-			e.native_key_code = native_scancode;
+	double rss_mb = (double)renderer_rss / (1024.0 * 1024.0);
 
-			e.type = key_up ? KEYEVENT_KEYUP : KEYEVENT_RAWKEYDOWN;
+	if (!memory_refresh_pending && rss_mb > (double)memory_limit_mb) {
+		blog(LOG_WARNING,
+		     "[obs-browser: '%s'] Renderer %d uses %.1f MB, more than "
+		     "the limit of %d MB, refreshing once hidden",
+		     obs_source_get_name(source), (int)renderer_pid, rss_mb,
+		     memory_limit_mb);
+		memory_refresh_pending = true;
+	}
 
-			if (!text.empty()) {
-				wstring wide = to_wide(text);
-				if (wide.size())
-					e.character = wide[0];
-			}
+	if (!memory_refresh_pending || is_showing ||
+	    now - last_memory_refresh_ns < MEMORY_REFRESH_COOLDOWN_NS)
+		return;
 
-			//e.native_key_code = native_vkey;
-			e.modifiers = native_modifiers;
+	memory_refresh_pending = false;
+	last_memory_refresh_ns = now;
+	memory_refresh_requested = true;
+}
 
-			cefBrowser->GetHost()->SendKeyEvent(e);
-			if (!text.empty() && !key_up) {
-				e.type = KEYEVENT_CHAR;
-#ifdef __linux__
-				e.windows_key_code =
-					KeyboardCodeFromXKeysym(e.character);
-#else
-				e.windows_key_code = e.character;
-#endif
-				e.native_key_code = native_scancode;
-				cefBrowser->GetHost()->SendKeyEvent(e);
-			}
-		},
-		true);
+/* Suspended pages are destroyed instead of refreshed, they're recreated
+ * when they're shown again anyway */
+void BrowserSource::RefreshForMemoryLimit()
+{
+	if (is_showing || !cefBrowser)
+		return;
+
+	bool was_suspended;
+	{
+		lock_guard<mutex> lock(browser_list_mutex);
+		was_suspended = suspended;
+		suspended_browsers.remove(this);
+		suspended = false;
+	}
+
+	memory_refreshes++;
+	blog(LOG_INFO, "[obs-browser: '%s'] %s for its memory limit",
+	     obs_source_get_name(source),
+	     was_suspended ? "Destroying suspended browser" : "Refreshing");
+
+	if (was_suspended)
+		DestroyBrowser(true);
+	else
+		Refresh();
 }
 
-void BrowserSource::SetShowing(bool showing)
+/* Unlike hiding, this isn't the page's business, so it gets no visibility
+ * events and stays "visible" to its scripts.  It only paints less often. */
+void BrowserSource::SetOccluded(bool n_occluded)
 {
-	is_showing = showing;
+	if (occluded == n_occluded)
+		return;
+	occluded = n_occluded;
 
-	if (shutdown_on_invisible) {
-		if (showing) {
-			Update();
-		} else {
-			DestroyBrowser(true);
-		}
-	} else {
-		ExecuteOnBrowser(
-			[=](CefRefPtr<CefBrowser> cefBrowser) {
-				CefRefPtr<CefProcessMessage> msg =
-					CefProcessMessage::Create("Visibility");
-				CefRefPtr<CefListValue> args =
-					msg->GetArgumentList();
-				args->SetBool(0, showing);
-				SendBrowserProcessMessage(cefBrowser,
-							  PID_RENDERER, msg);
-			},
-			true);
-		Json json = Json::object{{"visible", showing}};
-		DispatchJSEvent("obsSourceVisibleChanged", json.dump(), this);
-#if EXPERIMENTAL_SHARED_TEXTURE_SUPPORT_ENABLED
-		if (showing && !fps_custom) {
-			reset_frame = false;
-		}
+	blog(LOG_DEBUG, "[obs-browser: '%s'] %s", obs_source_get_name(source),
+	     n_occluded ? "Occluded, throttling paints"
+			: "No longer occluded");
+
+#if ENABLE_EXTERNAL_BEGIN_FRAME
+	if (!n_occluded)
+		idle_frames = 0;
+	if (!fps_custom)
+		return;
 #endif
 
-		SendBrowserVisibility(cefBrowser, showing);
-	}
+	int rate = n_occluded ? std::min(fps, OCCLUDED_FPS) : fps;
+	ExecuteOnBrowser(
+		[rate](CefRefPtr<CefBrowser> cefBrowser) {
+			cefBrowser->GetHost()->SetWindowlessFrameRate(rate);
+		},
+		true);
 }
 
 void BrowserSource::SetActive(bool active)
@@ -398,18 +1335,38 @@ void BrowserSource::Refresh()
 		true);
 }
 
-#if EXPERIMENTAL_SHARED_TEXTURE_SUPPORT_ENABLED
-inline void BrowserSource::SignalBeginFrame()
+#if ENABLE_EXTERNAL_BEGIN_FRAME
+bool BrowserSource::WantsBeginFrame()
 {
-	if (reset_frame) {
-		ExecuteOnBrowser(
-			[](CefRefPtr<CefBrowser> cefBrowser) {
-				cefBrowser->GetHost()->SendExternalBeginFrame();
-			},
-			true);
-
-		reset_frame = false;
-	}
+	/* only sources that were rendered since the last video frame */
+	if (!render_requested)
+		return false;
+	render_requested = false;
+
+	if (fps_custom || !cefBrowser)
+		return false;
+
+	if (due_frames++ % (uint32_t)frame_divisor != 0)
+		return false;
+
+	if (occluded &&
+	    (due_frames / (uint32_t)frame_divisor) % OCCLUDED_FRAME_INTERVAL !=
+		    0)
+		return false;
+
+	uint64_t paints = paint_count;
+	if (paints != last_paint_count)
+		idle_frames = 0;
+	else if (idle_frames < IDLE_FRAME_THRESHOLD)
+		idle_frames++;
+	last_paint_count = paints;
+
+	if (idle_frames >= IDLE_FRAME_THRESHOLD &&
+	    (due_frames / (uint32_t)frame_divisor) % IDLE_FRAME_INTERVAL != 0)
+		return false;
+
+	begin_frames++;
+	return true;
 }
 #endif
 
@@ -426,6 +1383,8 @@ void BrowserSource::Update(obs_data_t *settings)
 		bool n_reroute;
 		std::string n_url;
 		std::string n_css;
+		std::string n_script;
+		std::string n_profile;
 
 		n_is_local = obs_data_get_bool(settings, "is_local_file");
 		n_width = (int)obs_data_get_int(settings, "width");
@@ -435,9 +1394,38 @@ void BrowserSource::Update(obs_data_t *settings)
 		n_shutdown = obs_data_get_bool(settings, "shutdown");
 		n_restart = obs_data_get_bool(settings, "restart_when_active");
 		n_css = obs_data_get_string(settings, "css");
+		n_script = obs_data_get_string(settings, "script");
 		n_url = obs_data_get_string(settings,
 					    n_is_local ? "local_file" : "url");
 		n_reroute = obs_data_get_bool(settings, "reroute_audio");
+		n_profile = obs_data_get_string(settings, "profile");
+
+		suspend_hidden = obs_data_get_bool(settings, "suspend_hidden");
+		memory_limit_mb =
+			(int)obs_data_get_int(settings, "memory_limit");
+
+#if ENABLE_EXTERNAL_BEGIN_FRAME
+		/* only affects scheduling, so doesn't need a new browser */
+		frame_divisor = (int)obs_data_get_int(settings, "frame_divisor");
+		if (frame_divisor < 1)
+			frame_divisor = 1;
+#endif
+
+		/* the page is only told about a new screen, so this doesn't
+		 * need a new browser either */
+		int n_scale = (int)obs_data_get_int(settings, "render_scale");
+		n_scale = std::min(std::max(n_scale, 10), 100);
+		if (n_scale != render_scale) {
+			render_scale = n_scale;
+			ExecuteOnBrowser(
+				[](CefRefPtr<CefBrowser> cefBrowser) {
+					CefRefPtr<CefBrowserHost> host =
+						cefBrowser->GetHost();
+					host->NotifyScreenInfoChanged();
+					host->WasResized();
+				},
+				true);
+		}
 
 		if (n_is_local && !n_url.empty()) {
 			n_url = CefURIEncode(n_url, false);
@@ -483,8 +1471,21 @@ void BrowserSource::Update(obs_data_t *settings)
 		if (n_is_local == is_local && n_width == width &&
 		    n_height == height && n_fps_custom == fps_custom &&
 		    n_fps == fps && n_shutdown == shutdown_on_invisible &&
-		    n_restart == restart && n_css == css && n_url == url &&
-		    n_reroute == reroute_audio) {
+		    n_restart == restart && n_css == css &&
+		    n_script == script && n_url == url &&
+		    n_reroute == reroute_audio && n_profile == profile) {
+			return;
+		}
+
+		/* these are all baked in to the browser when it's created */
+		bool recreate = first_update || n_is_local != is_local ||
+				n_fps_custom != fps_custom ||
+				n_reroute != reroute_audio ||
+				n_profile != profile;
+
+		if (!recreate) {
+			UpdateBrowser(n_width, n_height, n_fps, n_shutdown,
+				      n_restart, n_css, n_script, n_url);
 			return;
 		}
 
@@ -495,8 +1496,10 @@ void BrowserSource::Update(obs_data_t *settings)
 		fps_custom = n_fps_custom;
 		shutdown_on_invisible = n_shutdown;
 		reroute_audio = n_reroute;
+		profile = n_profile;
 		restart = n_restart;
 		css = n_css;
+		script = n_script;
 		url = n_url;
 
 		obs_source_set_audio_active(source, reroute_audio);
@@ -511,76 +1514,704 @@ void BrowserSource::Update(obs_data_t *settings)
 	first_update = false;
 }
 
+/* Applies setting changes that don't need a new browser to the existing
+ * one */
+void BrowserSource::UpdateBrowser(int n_width, int n_height, int n_fps,
+				  bool n_shutdown, bool n_restart,
+				  const std::string &n_css,
+				  const std::string &n_script,
+				  const std::string &n_url)
+{
+	bool resized = n_width != width || n_height != height;
+	bool fps_changed = n_fps != fps && fps_custom;
+	bool css_changed = n_css != css;
+	bool script_changed = n_script != script;
+	bool url_changed = n_url != url;
+
+	if (css_changed || script_changed)
+		injection_changed = true;
+
+	width = n_width;
+	height = n_height;
+	fps = n_fps;
+	shutdown_on_invisible = n_shutdown;
+	restart = n_restart;
+	css = n_css;
+	script = n_script;
+	url = n_url;
+
+	if (!cefBrowser) {
+		/* whatever gets created next picks the new settings up, and
+		 * one that's being created is updated when it's done */
+		if (!create_browser && !creating &&
+		    (!shutdown_on_invisible || obs_source_showing(source)))
+			create_browser = true;
+		return;
+	}
+
+	if (shutdown_on_invisible && !obs_source_showing(source)) {
+		DestroyBrowser(true);
+		return;
+	}
+
+	if (!resized && !fps_changed && !css_changed && !script_changed &&
+	    !url_changed)
+		return;
+
+	std::string new_css = css;
+	std::string new_script = script;
+	std::string new_url = url;
+	int new_fps = fps;
+	/* occluded browsers get their frame rate back once they're seen */
+	bool set_fps = fps_changed && !occluded;
+
+	ExecuteOnBrowser(
+		[=](CefRefPtr<CefBrowser> cefBrowser) {
+			CefRefPtr<CefBrowserHost> host = cefBrowser->GetHost();
+
+			/* GetViewRect picks up the new size */
+			if (resized)
+				host->WasResized();
+			if (set_fps)
+				host->SetWindowlessFrameRate(new_fps);
+
+			/* the script only runs for pages created after this,
+			 * the CSS replaces that of the current page as well */
+			if (css_changed || script_changed)
+				SendPageInjection(cefBrowser, new_css,
+						  new_script,
+						  css_changed && !url_changed);
+			if (url_changed)
+				cefBrowser->GetMainFrame()->LoadURL(new_url);
+		},
+		true);
+}
+
+/* Called on the CEF thread when the shared textures of this source keep
+ * failing to open.  Only this source gets a new browser without shared
+ * textures, the others keep theirs. */
+void BrowserSource::FallBackToSoftwarePaint()
+{
+	if (software_paint.exchange(true))
+		return;
+
+	blog(LOG_WARNING,
+	     "[obs-browser: '%s'] shared textures can't be opened, "
+	     "falling back to software paints",
+	     obs_source_get_name(source));
+	fallback_pending = true;
+}
+
 void BrowserSource::Tick()
 {
+	if (evict_pending.exchange(false) && !is_showing)
+		DestroyBrowser(true);
+	if (pressure_requested.exchange(false))
+		SendMemoryPressure();
+	if (memory_refresh_requested.exchange(false))
+		RefreshForMemoryLimit();
+
+	if (fallback_pending.exchange(false)) {
+		DestroyBrowser(true);
+		create_browser = true;
+	}
+
 	if (create_browser && CreateBrowser())
 		create_browser = false;
-#if EXPERIMENTAL_SHARED_TEXTURE_SUPPORT_ENABLED
-	if (!fps_custom)
-		reset_frame = true;
+
+	UpdateStatRates();
+}
+
+#define STATS_INTERVAL_NS 1000000000ULL
+
+void BrowserSource::UpdateStatRates()
+{
+	uint64_t now = os_gettime_ns();
+	if (now - stats_ns < STATS_INTERVAL_NS)
+		return;
+
+	uint64_t paints = paint_count;
+	uint64_t bytes = upload_bytes;
+
+	lock_guard<mutex> lock(stats_mutex);
+	if (stats_ns) {
+		double seconds = (double)(now - stats_ns) / 1000000000.0;
+		paint_rate = (double)(paints - stats_paints) / seconds;
+		upload_rate = (double)(bytes - stats_upload_bytes) / seconds;
+	}
+	stats_ns = now;
+	stats_paints = paints;
+	stats_upload_bytes = bytes;
+}
+
+/* has to be called with browser_list_mutex held, it guards suspended */
+Json BrowserSource::GetStats()
+{
+	double paints_per_sec, upload_bytes_per_sec;
+	{
+		lock_guard<mutex> lock(stats_mutex);
+		paints_per_sec = paint_rate;
+		upload_bytes_per_sec = upload_rate;
+	}
+
+	uint64_t input_merged, input_dropped;
+	{
+		lock_guard<mutex> lock(input->mutex);
+		input_merged = input->merged;
+		input_dropped = input->dropped;
+	}
+
+	uint64_t present_count = presents;
+	uint64_t latency_ns = present_latency_ns;
+
+#if ENABLE_EXTERNAL_BEGIN_FRAME
+	double sent_begin_frames = (double)begin_frames;
+#else
+	double sent_begin_frames = 0.0;
 #endif
+
+	/* counters go out as doubles, json11 only has 32 bit ints */
+	return Json::object{
+		{"name", obs_source_get_name(source)},
+		{"rendererPid", (int)renderer_pid},
+		{"rendererResidentBytes", (double)renderer_rss},
+		{"memoryPressureSignals", (double)pressure_signals},
+		{"memoryRefreshes", (double)memory_refreshes},
+		{"paints", (double)paint_count},
+		{"paintsPerSecond", paints_per_sec},
+		{"beginFrames", sent_begin_frames},
+		{"sharedHandleChanges", (double)handle_changes},
+		{"uploadBytes", (double)upload_bytes},
+		{"uploadBytesPerSecond", upload_bytes_per_sec},
+		{"fullUploads", (double)full_uploads},
+		{"partialUploads", (double)partial_uploads},
+		{"droppedFrames", (double)dropped_frames},
+		{"audioPackets", (double)audio_packets},
+		{"audioUnderruns", (double)audio_underruns},
+		{"inputMerged", (double)input_merged},
+		{"inputDropped", (double)input_dropped},
+		{"suspended", suspended},
+		{"occluded", (bool)occluded},
+		{"sharedTextures", (bool)shared_paint},
+		{"firstFrameMs", (double)first_frame_ns / 1000000.0},
+		{"presents", (double)present_count},
+		{"presentLatencyAverageMs",
+		 present_count ? (double)latency_ns / (double)present_count /
+					 1000000.0
+			       : 0.0},
+		{"presentLatencyMaxMs",
+		 (double)present_latency_max_ns / 1000000.0},
+		{"prewarmed", (bool)prewarmed},
+	};
+}
+
+Json GetBrowserSourceStats(BrowserSource *bs)
+{
+	Json::array sources;
+
+	lock_guard<mutex> lock(browser_list_mutex);
+	if (bs)
+		return bs->GetStats();
+
+	for (bs = first_browser; bs; bs = bs->next)
+		sources.push_back(bs->GetStats());
+
+	return sources;
+}
+
+/* Once the dirty area covers this fraction of the frame, it's cheaper to
+ * upload the whole frame in one go than to copy each rectangle separately */
+#define FULL_UPLOAD_COVERAGE_NUM 3
+#define FULL_UPLOAD_COVERAGE_DEN 4
+#define MAX_DIRTY_RECTS 16
+
+static inline void ClipRect(CefRect &rect, int cx, int cy)
+{
+	int right = std::min(rect.x + rect.width, cx);
+	int bottom = std::min(rect.y + rect.height, cy);
+
+	rect.x = std::max(rect.x, 0);
+	rect.y = std::max(rect.y, 0);
+	rect.width = std::max(right - rect.x, 0);
+	rect.height = std::max(bottom - rect.y, 0);
+}
+
+static inline void UnionRect(CefRect &dst, const CefRect &src)
+{
+	int right = std::max(dst.x + dst.width, src.x + src.width);
+	int bottom = std::max(dst.y + dst.height, src.y + src.height);
+
+	dst.x = std::min(dst.x, src.x);
+	dst.y = std::min(dst.y, src.y);
+	dst.width = right - dst.x;
+	dst.height = bottom - dst.y;
+}
+
+static void CoalesceDirtyRects(std::vector<CefRect> &rects, int cx, int cy)
+{
+	const CefRect full(0, 0, cx, cy);
+	uint64_t area = 0;
+
+	for (CefRect &rect : rects) {
+		ClipRect(rect, cx, cy);
+		area += (uint64_t)rect.width * (uint64_t)rect.height;
+	}
+
+	if (rects.size() > MAX_DIRTY_RECTS) {
+		CefRect bounds = rects[0];
+		for (const CefRect &rect : rects)
+			UnionRect(bounds, rect);
+
+		rects.clear();
+		rects.push_back(bounds);
+		area = (uint64_t)bounds.width * (uint64_t)bounds.height;
+	}
+
+	uint64_t full_area = (uint64_t)cx * (uint64_t)cy;
+	if (area * FULL_UPLOAD_COVERAGE_DEN >=
+	    full_area * FULL_UPLOAD_COVERAGE_NUM) {
+		rects.clear();
+		rects.push_back(full);
+	}
+}
+
+/* Copies rect out of the frame in to a mapped texture, with out pointing
+ * at where the rect's top left pixel goes.  edge_x and edge_y replicate the
+ * rect's right column and bottom row one pixel further, in to the padding
+ * of pooled textures that are larger than the frame, otherwise linear
+ * filtering would blend garbage in to the edges when scaled.  Returns the
+ * number of frame bytes copied. */
+static uint64_t WriteRect(uint8_t *out, uint32_t out_linesize,
+			  const uint8_t *data, uint32_t linesize,
+			  const CefRect &rect, bool edge_x, bool edge_y)
+{
+	const size_t row_bytes = (size_t)rect.width * 4;
+	const uint8_t *in =
+		data + (size_t)rect.y * linesize + (size_t)rect.x * 4;
+
+	if (!edge_x && row_bytes == linesize && out_linesize == linesize) {
+		memcpy(out, in, row_bytes * rect.height);
+		out += (size_t)out_linesize * rect.height;
+	} else {
+		for (int y = 0; y < rect.height; y++) {
+			memcpy(out, in, row_bytes);
+			if (edge_x)
+				memcpy(out + row_bytes, in + row_bytes - 4, 4);
+			in += linesize;
+			out += out_linesize;
+		}
+	}
+
+	if (edge_y)
+		memcpy(out, out - out_linesize, row_bytes + (edge_x ? 4 : 0));
+
+	return (uint64_t)row_bytes * rect.height;
+}
+
+void BrowserSource::UploadFrame(const uint8_t *data, int cx, int cy,
+				const std::vector<CefRect> &dirtyRects)
+{
+	const uint32_t linesize = (uint32_t)cx * 4;
+	bool full = false;
+
+	if (texture &&
+	    (texture_cx != (uint32_t)cx || texture_cy != (uint32_t)cy))
+		DestroyTextures();
+
+	/* In dirty rect mode the texture that gets drawn is a regular GPU
+	 * texture.  Each changed region is written in to a pooled dynamic
+	 * staging texture the size of that region and then copied over, so
+	 * only the dirty pixels ever have to cross the bus, whatever the
+	 * driver does when a staging texture gets unmapped */
+	if (!texture) {
+		texture = TexturePool::Acquire(cx, cy, GS_BGRA,
+					       dirty_rect_upload ? 0
+								 : GS_DYNAMIC);
+		if (!texture)
+			return;
+
+		texture_cx = cx;
+		texture_cy = cy;
+		full = true;
+	}
+
+	std::vector<CefRect> rects;
+	if (full || !dirty_rect_upload) {
+		rects.emplace_back(0, 0, cx, cy);
+	} else {
+		rects = dirtyRects;
+		CoalesceDirtyRects(rects, cx, cy);
+	}
+
+	const bool pad_x = gs_texture_get_width(texture) > (uint32_t)cx;
+	const bool pad_y = gs_texture_get_height(texture) > (uint32_t)cy;
+	uint64_t bytes = 0;
+	uint8_t *ptr;
+	uint32_t map_linesize;
+
+	if (!dirty_rect_upload) {
+		if (!gs_texture_map(texture, &ptr, &map_linesize))
+			return;
+
+		bytes = WriteRect(ptr, map_linesize, data, linesize, rects[0],
+				  pad_x, pad_y);
+		gs_texture_unmap(texture);
+		rects.clear();
+	}
+
+	for (const CefRect &rect : rects) {
+		if (rect.IsEmpty())
+			continue;
+
+		const bool edge_x = pad_x && rect.x + rect.width == cx;
+		const bool edge_y = pad_y && rect.y + rect.height == cy;
+		const uint32_t width = rect.width + (edge_x ? 1 : 0);
+		const uint32_t height = rect.height + (edge_y ? 1 : 0);
+
+		/* pooled, so it can be larger than the rect, only the top
+		 * left of it is copied */
+		gs_texture_t *staging = TexturePool::Acquire(
+			width, height, GS_BGRA, GS_DYNAMIC);
+		if (!staging)
+			break;
+
+		if (gs_texture_map(staging, &ptr, &map_linesize)) {
+			bytes += WriteRect(ptr, map_linesize, data, linesize,
+					   rect, edge_x, edge_y);
+			gs_texture_unmap(staging);
+			gs_copy_texture_region(texture, rect.x, rect.y, staging,
+					       0, 0, width, height);
+		}
+
+		TexturePool::Release(staging);
+	}
+
+	if (!bytes)
+		return;
+
+	upload_bytes += bytes;
+	if (bytes == (uint64_t)linesize * cy)
+		full_uploads++;
+	else
+		partial_uploads++;
+}
+
+void BrowserSource::CountPaint()
+{
+	paint_count++;
+
+	if (!create_ns || !page_committed)
+		return;
+
+	uint64_t start = create_ns.exchange(0);
+	if (!start)
+		return;
+
+	first_frame_ns = os_gettime_ns() - start;
+	blog(LOG_INFO, "[obs-browser: '%s'] first frame %.1f ms after "
+		       "creation%s",
+	     obs_source_get_name(source), (double)first_frame_ns / 1000000.0,
+	     prewarmed ? " (prewarmed)" : "");
+}
+
+/* graphics thread only, so the max doesn't need a compare-exchange */
+void BrowserSource::CountPresent(uint64_t paint_ns)
+{
+	if (!paint_ns)
+		return;
+
+	uint64_t latency = os_gettime_ns() - paint_ns;
+	presents++;
+	present_latency_ns += latency;
+	if (latency > present_latency_max_ns)
+		present_latency_max_ns = latency;
+}
+
+void BrowserSource::PaintFrame(const void *buffer, int cx, int cy,
+			       const CefRenderHandler::RectList &dirtyRects)
+{
+	BrowserFrame &frame = frames.Back();
+	size_t size = (size_t)cx * (size_t)cy * 4;
+
+	CountPaint();
+
+	frame.data.resize(size);
+	memcpy(frame.data.data(), buffer, size);
+	frame.width = cx;
+	frame.height = cy;
+	frame.paint_ns = os_gettime_ns();
+	frame.dirty.assign(dirtyRects.begin(), dirtyRects.end());
+
+	/* If the graphics thread hasn't picked up the last frame yet, that
+	 * frame is about to be dropped, so its damage has to be carried over
+	 * to this one or those regions would never be uploaded */
+	if (frames.Pending()) {
+		if (last_width != cx || last_height != cy) {
+			frame.dirty.clear();
+			frame.dirty.emplace_back(0, 0, cx, cy);
+		} else {
+			frame.dirty.insert(frame.dirty.end(),
+					   last_dirty.begin(),
+					   last_dirty.end());
+		}
+
+		if (frame.dirty.size() > MAX_DIRTY_RECTS) {
+			CefRect bounds = frame.dirty[0];
+			for (const CefRect &rect : frame.dirty)
+				UnionRect(bounds, rect);
+
+			frame.dirty.clear();
+			frame.dirty.push_back(bounds);
+		}
+	}
+
+	last_dirty = frame.dirty;
+	last_width = cx;
+	last_height = cy;
+
+	if (!frames.Publish())
+		dropped_frames++;
 }
 
 extern void ProcessCef();
 
 void BrowserSource::Render()
 {
+	/* displays are drawn in to their swap chain, video output and nested
+	 * sources in to render targets */
+	if (!gs_get_render_target())
+		drawn_to_display = true;
+
 	bool flip = false;
+#if EXPERIMENTAL_SHARED_TEXTURE_SUPPORT_ENABLED && defined(_WIN32)
+	/* D3D11 shared textures come in bottom up, IOSurfaces and dmabufs
+	 * don't */
+	flip = shared_paint;
+#endif
+
+	if (frames.Acquire()) {
+		BrowserFrame &frame = frames.Front();
+		UploadFrame(frame.data.data(), frame.width, frame.height,
+			    frame.dirty);
+		CountPresent(frame.paint_ns);
+	}
+
 #if EXPERIMENTAL_SHARED_TEXTURE_SUPPORT_ENABLED
-	flip = hwaccel;
+	if (accel_paint_ns)
+		CountPresent(accel_paint_ns.exchange(0));
 #endif
 
 	if (texture) {
 		gs_effect_t *effect =
 			obs_get_base_effect(OBS_EFFECT_PREMULTIPLIED_ALPHA);
+		gs_eparam_t *image = gs_effect_get_param_by_name(effect, "image");
+
+		/* frames rendered below the source size are stretched back
+		 * over it by the sampler */
+		bool scaled = texture_cx != (uint32_t)width ||
+			      texture_cy != (uint32_t)height;
+		if (scaled) {
+			gs_matrix_push();
+			gs_matrix_scale3f((float)width / (float)texture_cx,
+					  (float)height / (float)texture_cy,
+					  1.0f);
+		}
+
+		/* pooled textures can be larger than the frame they hold */
+		gs_effect_set_texture(image, texture);
 		while (gs_effect_loop(effect, "Draw"))
-			obs_source_draw(texture, 0, 0, 0, 0, flip);
+			gs_draw_sprite_subregion(texture, flip ? GS_FLIP_V : 0,
+						 0, 0, texture_cx, texture_cy);
+
+		if (popup_texture) {
+			gs_effect_t *popup_effect = obs_get_base_effect(
+				OBS_EFFECT_PREMULTIPLIED_ALPHA);
+			gs_eparam_t *popup_image = gs_effect_get_param_by_name(
+				popup_effect, "image");
+
+			gs_matrix_push();
+			gs_matrix_translate3f((float)popup_x, (float)popup_y,
+					      0.0f);
+			gs_effect_set_texture(popup_image, popup_texture);
+			while (gs_effect_loop(popup_effect, "Draw"))
+				gs_draw_sprite_subregion(
+					popup_texture, flip ? GS_FLIP_V : 0, 0,
+					0, popup_cx, popup_cy);
+			gs_matrix_pop();
+		}
+
+		if (scaled)
+			gs_matrix_pop();
 	}
 
-#if EXPERIMENTAL_SHARED_TEXTURE_SUPPORT_ENABLED
-	SignalBeginFrame();
-#elif USE_QT_LOOP
+#if ENABLE_EXTERNAL_BEGIN_FRAME
+	render_requested = true;
+#endif
+#if USE_QT_LOOP && !ENABLE_EXTERNAL_BEGIN_FRAME
+	/* without external begin frames, pump once per rendered frame so that
+	 * paints keep up with the output frame rate.  with them, the begin
+	 * frame tasks wake the pump themselves. */
 	ProcessCef();
 #endif
 }
 
-static void ExecuteOnBrowser(BrowserFunc func, BrowserSource *bs)
-{
-	lock_guard<mutex> lock(browser_list_mutex);
+static std::unordered_map<std::string, CefRefPtr<CefRequestContext>>
+	request_contexts;
 
-	if (bs) {
-		BrowserSource *bsw = reinterpret_cast<BrowserSource *>(bs);
-		bsw->ExecuteOnBrowser(func, true);
+CefRefPtr<CefRequestContext> GetRequestContext(const std::string &profile)
+{
+	if (profile.empty())
+		return nullptr;
+
+	/* profile names are user input, keep them to one plain directory.
+	 * names that end up with the same directory share a context, as
+	 * two contexts can't use the same cache path. */
+	std::string dir = "profiles/";
+	for (char ch : profile) {
+		bool plain = (ch >= 'a' && ch <= 'z') ||
+			     (ch >= 'A' && ch <= 'Z') ||
+			     (ch >= '0' && ch <= '9') || ch == '-' || ch == '_';
+		dir += plain ? ch : '_';
 	}
+
+	auto it = request_contexts.find(dir);
+	if (it != request_contexts.end())
+		return it->second;
+
+	BPtr<char> rpath = obs_module_config_path(dir.c_str());
+	BPtr<char> path = os_get_abs_path_ptr(rpath.Get());
+
+	CefRequestContextSettings settings;
+	CefString(&settings.cache_path) = path.Get();
+	CefRefPtr<CefRequestContext> context = CefRequestContext::CreateContext(
+		settings, CefRefPtr<CefRequestContextHandler>());
+	if (context)
+		RegisterSchemeHandlers(context);
+
+	request_contexts[dir] = context;
+	return context;
 }
 
-static void ExecuteOnAllBrowsers(BrowserFunc func)
+void ReleaseRequestContexts()
 {
-	lock_guard<mutex> lock(browser_list_mutex);
+	request_contexts.clear();
+}
+
+/* Every browser that's been created for a source and hasn't closed yet.
+ * Only ever touched on the CEF UI thread, so broadcasts don't need to lock
+ * anything, and sources coming and going never wait on them. */
+static std::vector<CefRefPtr<CefBrowser>> browser_registry;
+static std::unordered_map<int, std::unordered_set<std::string>>
+	event_listeners;
+
+void RegisterBrowser(CefRefPtr<CefBrowser> browser)
+{
+	browser_registry.push_back(browser);
+}
+
+void UnregisterBrowser(CefRefPtr<CefBrowser> browser)
+{
+	event_listeners.erase(browser->GetIdentifier());
 
-	BrowserSource *bs = first_browser;
-	while (bs) {
-		BrowserSource *bsw = reinterpret_cast<BrowserSource *>(bs);
-		bsw->ExecuteOnBrowser(func, true);
-		bs = bs->next;
+	for (size_t i = 0; i < browser_registry.size(); i++) {
+		if (browser_registry[i]->IsSame(browser)) {
+			browser_registry.erase(browser_registry.begin() + i);
+			break;
+		}
 	}
 }
 
+void SetEventListeners(CefRefPtr<CefBrowser> browser,
+		       CefRefPtr<CefListValue> events)
+{
+	std::unordered_set<std::string> &listeners =
+		event_listeners[browser->GetIdentifier()];
+
+	listeners.clear();
+	for (size_t i = 0; i < events->GetSize(); i++)
+		listeners.insert(events->GetString(i));
+}
+
+/* events for all browsers, or just the one, waiting to be sent */
+struct PendingJSEvent {
+	std::string name;
+	CefRefPtr<CefValue> detail;
+	CefRefPtr<CefBrowser> browser;
+};
+
+static std::mutex pending_events_mutex;
+static std::vector<PendingJSEvent> pending_events;
+
+/* Events are collected and sent once per video frame, so bursts like a
+ * recording starting and having started cost each page one message.  Pages
+ * only get the events they have listeners for. */
 void DispatchJSEvent(std::string eventName, std::string jsonString,
 		     BrowserSource *browser)
 {
-	const auto jsEvent = [=](CefRefPtr<CefBrowser> cefBrowser) {
-		CefRefPtr<CefProcessMessage> msg =
-			CefProcessMessage::Create("DispatchJSEvent");
-		CefRefPtr<CefListValue> args = msg->GetArgumentList();
+	PendingJSEvent event;
+	event.name = eventName;
 
-		args->SetString(0, eventName);
-		args->SetString(1, jsonString);
-		SendBrowserProcessMessage(cefBrowser, PID_RENDERER, msg);
-	};
+	if (browser) {
+		event.browser = browser->cefBrowser;
+		if (!event.browser)
+			return;
+	} else {
+		/* without sources, nothing would ever send these, and new
+		 * pages would get them much later */
+		lock_guard<mutex> lock(browser_list_mutex);
+		if (!first_browser)
+			return;
+	}
 
-	if (!browser)
-		ExecuteOnAllBrowsers(jsEvent);
-	else
-		ExecuteOnBrowser(jsEvent, browser);
+	/* parsed once here rather than once per browser in each renderer */
+	std::string err;
+	event.detail = JsonToCefValue(Json::parse(jsonString, err));
+
+	lock_guard<mutex> lock(pending_events_mutex);
+	pending_events.push_back(event);
+}
+
+void FlushJSEvents()
+{
+	std::vector<PendingJSEvent> events;
+
+	{
+		lock_guard<mutex> lock(pending_events_mutex);
+		if (pending_events.empty())
+			return;
+		events.swap(pending_events);
+	}
+
+	QueueCEFTask([events]() {
+		for (const CefRefPtr<CefBrowser> &browser : browser_registry) {
+			auto listeners =
+				event_listeners.find(browser->GetIdentifier());
+			if (listeners == event_listeners.end())
+				continue;
+
+			CefRefPtr<CefListValue> list = CefListValue::Create();
+
+			for (const PendingJSEvent &event : events) {
+				if (event.browser &&
+				    !event.browser->IsSame(browser))
+					continue;
+				if (!listeners->second.count(event.name))
+					continue;
+
+				CefRefPtr<CefListValue> entry =
+					CefListValue::Create();
+				entry->SetString(0, event.name);
+				entry->SetValue(1, event.detail->Copy());
+				list->SetList(list->GetSize(), entry);
+			}
+
+			if (!list->GetSize())
+				continue;
+
+			CefRefPtr<CefProcessMessage> msg =
+				CefProcessMessage::Create("DispatchJSEvents");
+			msg->GetArgumentList()->SetList(0, list);
+			SendBrowserProcessMessage(browser, PID_RENDERER, msg);
+		}
+	});
 }
@@ -24,24 +24,128 @@
 #include "cef-headers.hpp"
 #include "browser-config.h"
 #include "browser-app.hpp"
+#include "browser-triple-buffer.hpp"
+#include "browser-texture-pool.hpp"
+#include "browser-direct-audio.hpp"
+#include "json11/json11.hpp"
 
 #include <unordered_map>
 #include <functional>
+#include <memory>
+#include <list>
 #include <vector>
 #include <string>
+#include <atomic>
 #include <mutex>
 
 #if EXPERIMENTAL_SHARED_TEXTURE_SUPPORT_ENABLED
 extern bool hwaccel;
 #endif
 
+#if EXPERIMENTAL_SHARED_TEXTURE_SUPPORT_ENABLED || CHROME_VERSION_BUILD >= 3578
+#define ENABLE_EXTERNAL_BEGIN_FRAME 1
+#else
+#define ENABLE_EXTERNAL_BEGIN_FRAME 0
+#endif
+
+extern bool dirty_rect_upload;
+extern int max_suspended_browsers;
+extern bool direct_audio;
+extern bool show_stats;
+extern bool throttle_occluded;
+extern int memory_budget_mb;
+
+/* CEF UI thread only */
+void RegisterBrowser(CefRefPtr<CefBrowser> browser);
+void UnregisterBrowser(CefRefPtr<CefBrowser> browser);
+
+/* obs* events the page of a browser listens for, only those get sent to
+ * it.  CEF UI thread only. */
+void SetEventListeners(CefRefPtr<CefBrowser> browser,
+		       CefRefPtr<CefListValue> events);
+
+/* CEF UI thread only, see BrowserSource::CreateBrowser */
+void BrowserCreationDone();
+
+/* spare browsers, see BrowserSource::AdoptSpareBrowser.  CEF UI thread
+ * only. */
+void AddSpareBrowser(CefRefPtr<CefBrowser> browser);
+void PrewarmBrowsers(int count);
+void ReleaseSpareBrowsers();
+
+/* request contexts of browser source profiles are kept until CEF shuts
+ * down.  CEF UI thread only. */
+CefRefPtr<CefRequestContext> GetRequestContext(const std::string &profile);
+void ReleaseRequestContexts();
+
+/* stats of a single browser source, or of all of them if bs is null.  see
+ * BrowserSource::GetStats */
+struct BrowserSource;
+json11::Json GetBrowserSourceStats(BrowserSource *bs = nullptr);
+
 struct AudioStream {
 	OBSSource source;
+	std::shared_ptr<DirectAudioStream> direct;
 	speaker_layout speakers;
 	int channels;
 	int sample_rate;
 };
 
+struct AudioMixInput {
+	obs_source_t *source;
+	uint64_t timestamp;
+	size_t pos;
+	const float *data[MAX_AUDIO_CHANNELS];
+};
+
+struct BrowserFrame {
+	std::vector<uint8_t> data;
+	std::vector<CefRect> dirty;
+	int width = 0;
+	int height = 0;
+	uint64_t paint_ns = 0;
+};
+
+enum class BrowserInputType : uint8_t {
+	MouseClick,
+	MouseMove,
+	MouseWheel,
+	Focus,
+	Key,
+};
+
+struct BrowserInputEvent {
+	BrowserInputType type;
+	/* mouse_up, mouse_leave, focus or key_up, depending on type */
+	bool flag;
+	int32_t x;
+	int32_t y;
+	uint32_t modifiers;
+	/* button type and click count, or wheel deltas */
+	int32_t param1;
+	int32_t param2;
+	uint32_t native_vkey;
+	uint32_t native_scancode;
+	/* a code point, not a UTF-16 code unit */
+	uint32_t character;
+};
+
+#define BROWSER_INPUT_QUEUE_SIZE 256
+
+/* Input is queued here from the UI thread and sent to the browser in
+ * batches from the CEF thread.  It's shared with the drain task so that a
+ * pending drain can't outlive it. */
+struct BrowserInputQueue {
+	std::mutex mutex;
+	BrowserInputEvent events[BROWSER_INPUT_QUEUE_SIZE];
+	size_t head = 0;
+	size_t count = 0;
+	bool drain_pending = false;
+
+	uint64_t merged = 0;
+	uint64_t dropped = 0;
+};
+
 struct BrowserSource {
 	BrowserSource **p_prev_next = nullptr;
 	BrowserSource *next = nullptr;
@@ -54,7 +158,26 @@ struct BrowserSource {
 
 	std::string url;
 	std::string css;
+	std::string script;
+	/* css or script changed since the browser was created, so renderers
+	 * can't rely on what they got at creation anymore */
+	std::atomic<bool> injection_changed = {false};
 	gs_texture_t *texture = nullptr;
+	uint32_t texture_cx = 0;
+	uint32_t texture_cy = 0;
+	/* shared textures belong to the BrowserClient that opened them */
+	bool texture_borrowed = false;
+	/* accelerated paints of open <select> popups, drawn over the view at
+	 * popup_x/popup_y */
+	gs_texture_t *popup_texture = nullptr;
+	uint32_t popup_cx = 0;
+	uint32_t popup_cy = 0;
+	int popup_x = 0;
+	int popup_y = 0;
+	/* whether the current browser paints through shared textures */
+	std::atomic<bool> shared_paint = {false};
+	std::atomic<bool> software_paint = {false};
+	std::atomic<bool> fallback_pending = {false};
 	int width = 0;
 	int height = 0;
 	bool fps_custom = false;
@@ -64,26 +187,140 @@ struct BrowserSource {
 	bool is_local = false;
 	bool first_update = true;
 	bool reroute_audio = true;
-#if EXPERIMENTAL_SHARED_TEXTURE_SUPPORT_ENABLED
-	bool reset_frame = false;
-#endif
 	bool is_showing = false;
 
+	/* percentage of the source size pages are rasterized at.  CEF is told
+	 * about it through the device scale factor, so page layout stays at
+	 * the source size and the result is scaled back up when drawn. */
+	int render_scale = 100;
+
+	/* sources with the same profile share a request context, and with it
+	 * cookies, storage and cache.  the default profile is CEF's global
+	 * context. */
+	std::string profile;
+
+	/* hidden pages are frozen but kept alive, see BrowserSource::Suspend */
+	bool suspend_hidden = false;
+	bool suspended = false;
+	/* evicted from the suspended list, the browser is destroyed in the
+	 * next Tick unless the source is shown again first */
+	std::atomic<bool> evict_pending = {false};
+
+	/* shown, but nowhere to be seen, see BrowserSource::SetOccluded */
+	std::atomic<bool> occluded = {false};
+	/* drawn straight in to a display since the last occlusion update, by
+	 * a projector or a preview, so it's seen whatever its scene items say.
+	 * graphics thread only. */
+	bool drawn_to_display = false;
+
+	/* renderer memory, see UpdateRendererMemory.  has_browser,
+	 * memory_refresh_pending and last_memory_refresh_ns are protected by
+	 * browser_list_mutex, the requests are acted on in Tick. */
+	int memory_limit_mb = 0;
+	bool has_browser = false;
+	bool memory_refresh_pending = false;
+	uint64_t last_memory_refresh_ns = 0;
+	std::atomic<bool> memory_refresh_requested = {false};
+	std::atomic<bool> pressure_requested = {false};
+	std::atomic<uint64_t> renderer_rss = {0};
+	std::atomic<uint64_t> pressure_signals = {0};
+	std::atomic<uint64_t> memory_refreshes = {0};
+
+#if ENABLE_EXTERNAL_BEGIN_FRAME
+	/* begin frame scheduling, see BrowserSource::WantsBeginFrame */
+	int frame_divisor = 1;
+	bool render_requested = false;
+	uint32_t due_frames = 0;
+	uint64_t last_paint_count = 0;
+	std::atomic<uint32_t> idle_frames = {0};
+	std::atomic<uint64_t> begin_frames = {0};
+#endif
+
+	/* software paints are handed from the CEF thread to the graphics
+	 * thread through here, so neither one ever waits on the other */
+	TripleBuffer<BrowserFrame> frames;
+	std::vector<CefRect> last_dirty;
+	int last_width = 0;
+	int last_height = 0;
+
+	std::atomic<uint64_t> upload_bytes = {0};
+	std::atomic<uint64_t> full_uploads = {0};
+	std::atomic<uint64_t> partial_uploads = {0};
+	std::atomic<uint64_t> dropped_frames = {0};
+
+	/* performance counters, see BrowserSource::GetStats */
+	std::atomic<uint64_t> paint_count = {0};
+	std::atomic<uint64_t> handle_changes = {0};
+	std::atomic<uint64_t> audio_packets = {0};
+	std::atomic<uint64_t> audio_underruns = {0};
+	std::atomic<int> renderer_pid = {0};
+
+	/* time from CreateBrowser to the first paint of the browser */
+	std::atomic<uint64_t> create_ns = {0};
+	std::atomic<uint64_t> first_frame_ns = {0};
+	std::atomic<bool> prewarmed = {false};
+	/* the main frame has committed the source's page, so paints aren't of
+	 * a spare's about:blank anymore */
+	std::atomic<bool> page_committed = {false};
+
+	/* time from a paint to the first render that shows it.  accelerated
+	 * paints only leave the time of the latest one behind. */
+	std::atomic<uint64_t> accel_paint_ns = {0};
+	std::atomic<uint64_t> presents = {0};
+	std::atomic<uint64_t> present_latency_ns = {0};
+	std::atomic<uint64_t> present_latency_max_ns = {0};
+	void CountPresent(uint64_t paint_ns);
+
+	/* per second rates, updated in Tick */
+	std::mutex stats_mutex;
+	uint64_t stats_ns = 0;
+	uint64_t stats_paints = 0;
+	uint64_t stats_upload_bytes = 0;
+	double paint_rate = 0.0;
+	double upload_rate = 0.0;
+
+	void CountPaint();
+	void UpdateStatRates();
+	json11::Json GetStats();
+
 	inline void DestroyTextures()
 	{
-		if (texture) {
+		if (texture || popup_texture) {
 			obs_enter_graphics();
-			gs_texture_destroy(texture);
+			if (!texture_borrowed)
+				TexturePool::Release(texture);
+			TexturePool::Release(popup_texture);
 			texture = nullptr;
+			popup_texture = nullptr;
+			texture_borrowed = false;
+			texture_cx = 0;
+			texture_cy = 0;
 			obs_leave_graphics();
 		}
 	}
 
+	void PaintFrame(const void *buffer, int cx, int cy,
+			const CefRenderHandler::RectList &dirtyRects);
+	void UploadFrame(const uint8_t *data, int cx, int cy,
+			 const std::vector<CefRect> &dirtyRects);
+
 	/* ---------------------------- */
 
+	/* set from CreateBrowser until the browser exists or is destroyed */
+	std::atomic<bool> creating = {false};
+	/* CEF UI thread only */
+	CefRefPtr<CefClient> pending_client;
+	std::string created_url;
+
 	bool CreateBrowser();
+	bool AdoptSpareBrowser();
+	bool StartCreation();
+	void SetBrowser(CefRefPtr<CefBrowser> browser);
+	void BrowserCreated(CefRefPtr<CefBrowser> browser);
+	void CancelCreation();
 	void DestroyBrowser(bool async = false);
 	void ClearAudioStreams();
+	void FallBackToSoftwarePaint();
 	void ExecuteOnBrowser(BrowserFunc func, bool async = false);
 
 	/* ---------------------------- */
@@ -92,6 +329,10 @@ struct BrowserSource {
 	~BrowserSource();
 
 	void Update(obs_data_t *settings = nullptr);
+	void UpdateBrowser(int n_width, int n_height, int n_fps,
+			   bool n_shutdown, bool n_restart,
+			   const std::string &n_css, const std::string &n_script,
+			   const std::string &n_url);
 	void Tick();
 	void Render();
 	void EnumAudioStreams(obs_source_enum_proc_t cb, void *param);
@@ -107,14 +348,38 @@ struct BrowserSource {
 	void SendKeyClick(const struct obs_key_event *event, bool key_up);
 	void SetShowing(bool showing);
 	void SetActive(bool active);
+	void SetOccluded(bool occluded);
+	void SendMemoryPressure();
+	void CheckMemoryLimit(uint64_t now);
+	void RefreshForMemoryLimit();
 	void Refresh();
+	void Suspend();
+	void Resume();
 
-#if EXPERIMENTAL_SHARED_TEXTURE_SUPPORT_ENABLED
-	inline void SignalBeginFrame();
+#if ENABLE_EXTERNAL_BEGIN_FRAME
+	bool WantsBeginFrame();
 #endif
 
+	std::shared_ptr<BrowserInputQueue> input =
+		std::make_shared<BrowserInputQueue>();
+	void QueueInput(const BrowserInputEvent &event);
+
 	std::mutex audio_sources_mutex;
 	std::vector<obs_source_t *> audio_sources;
+	std::vector<std::shared_ptr<DirectAudioStream>> direct_streams;
+
+	/* only used in AudioMix, kept around so mixing doesn't allocate */
+	std::vector<AudioMixInput> mix_inputs;
+	std::vector<const float *> mix_channel_inputs;
+	std::vector<std::pair<DirectAudioStream *, uint64_t>> direct_inputs;
+	/* streams that had data this tick and the one before, see
+	 * BrowserSource::AudioMix */
+	std::vector<const void *> fed_streams;
+	std::vector<const void *> last_fed_streams;
+	bool DirectAudioMix(uint64_t *ts_out,
+			    struct audio_output_data *audio_output,
+			    size_t channels, size_t sample_rate);
 
+	std::mutex audio_streams_mutex;
 	std::unordered_map<int, AudioStream> audio_streams;
 };
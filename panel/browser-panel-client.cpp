@@ -3,6 +3,10 @@
 
 #include <QUrl>
 #include <QDesktopServices>
+#include <QMetaObject>
+
+#include <algorithm>
+#include <string.h>
 
 #include <obs-module.h>
 #ifdef _WIN32
@@ -35,6 +39,11 @@ CefRefPtr<CefKeyboardHandler> QCefBrowserClient::GetKeyboardHandler()
 	return this;
 }
 
+CefRefPtr<CefRenderHandler> QCefBrowserClient::GetRenderHandler()
+{
+	return view ? this : nullptr;
+}
+
 /* CefDisplayHandler */
 void QCefBrowserClient::OnTitleChange(CefRefPtr<CefBrowser> browser,
 				      const CefString &title)
@@ -53,6 +62,83 @@ void QCefBrowserClient::OnTitleChange(CefRefPtr<CefBrowser> browser,
 	}
 }
 
+#if CHROME_VERSION_BUILD >= 4183
+static Qt::CursorShape GetCursorShape(cef_cursor_type_t type)
+{
+	switch (type) {
+	case CT_CROSS:
+		return Qt::CrossCursor;
+	case CT_HAND:
+		return Qt::PointingHandCursor;
+	case CT_IBEAM:
+	case CT_VERTICALTEXT:
+		return Qt::IBeamCursor;
+	case CT_WAIT:
+		return Qt::WaitCursor;
+	case CT_HELP:
+		return Qt::WhatsThisCursor;
+	case CT_EASTRESIZE:
+	case CT_WESTRESIZE:
+	case CT_EASTWESTRESIZE:
+	case CT_COLUMNRESIZE:
+		return Qt::SizeHorCursor;
+	case CT_NORTHRESIZE:
+	case CT_SOUTHRESIZE:
+	case CT_NORTHSOUTHRESIZE:
+	case CT_ROWRESIZE:
+		return Qt::SizeVerCursor;
+	case CT_NORTHEASTRESIZE:
+	case CT_SOUTHWESTRESIZE:
+	case CT_NORTHEASTSOUTHWESTRESIZE:
+		return Qt::SizeBDiagCursor;
+	case CT_NORTHWESTRESIZE:
+	case CT_SOUTHEASTRESIZE:
+	case CT_NORTHWESTSOUTHEASTRESIZE:
+		return Qt::SizeFDiagCursor;
+	case CT_MOVE:
+		return Qt::SizeAllCursor;
+	case CT_PROGRESS:
+		return Qt::BusyCursor;
+	case CT_NODROP:
+	case CT_NOTALLOWED:
+		return Qt::ForbiddenCursor;
+	case CT_COPY:
+		return Qt::DragCopyCursor;
+	case CT_ALIAS:
+		return Qt::DragLinkCursor;
+	case CT_GRAB:
+		return Qt::OpenHandCursor;
+	case CT_GRABBING:
+		return Qt::ClosedHandCursor;
+	case CT_NONE:
+		return Qt::BlankCursor;
+	default:
+		return Qt::ArrowCursor;
+	}
+}
+
+/* windowed panels get their cursor from CEF, windowless ones have to set it
+ * on the widget themselves */
+bool QCefBrowserClient::OnCursorChange(CefRefPtr<CefBrowser>, CefCursorHandle,
+				       cef_cursor_type_t type,
+				       const CefCursorInfo &)
+{
+	if (!view)
+		return false;
+
+	std::lock_guard<std::mutex> lock(view->mutex);
+	QWidget *target = view->widget;
+	if (!target)
+		return true;
+
+	Qt::CursorShape shape = GetCursorShape(type);
+	QMetaObject::invokeMethod(
+		target, [target, shape]() { target->setCursor(shape); },
+		Qt::QueuedConnection);
+	return true;
+}
+#endif
+
 /* CefRequestHandler */
 bool QCefBrowserClient::OnBeforeBrowse(CefRefPtr<CefBrowser> browser,
 				       CefRefPtr<CefFrame>,
@@ -145,17 +231,14 @@ bool QCefBrowserClient::OnBeforePopup(
 	CefRefPtr<CefBrowser>, CefRefPtr<CefFrame>, const CefString &target_url,
 	const CefString &, CefLifeSpanHandler::WindowOpenDisposition, bool,
 	const CefPopupFeatures &, CefWindowInfo &windowInfo,
-	CefRefPtr<CefClient> &, CefBrowserSettings &,
+	CefRefPtr<CefClient> &client, CefBrowserSettings &,
 #if CHROME_VERSION_BUILD >= 3770
 	CefRefPtr<CefDictionaryValue> &,
 #endif
 	bool *)
 {
 	if (allowAllPopups) {
-#ifdef _WIN32
-		HWND hwnd = (HWND)widget->effectiveWinId();
-		windowInfo.parent_window = hwnd;
-#endif
+		SetPopupWindow(windowInfo, client);
 		return false;
 	}
 
@@ -172,10 +255,7 @@ bool QCefBrowserClient::OnBeforePopup(
 		}
 
 		if (astrcmpi(info.url.c_str(), str_url.c_str()) == 0) {
-#ifdef _WIN32
-			HWND hwnd = (HWND)widget->effectiveWinId();
-			windowInfo.parent_window = hwnd;
-#endif
+			SetPopupWindow(windowInfo, client);
 			return false;
 		}
 	}
@@ -186,6 +266,25 @@ bool QCefBrowserClient::OnBeforePopup(
 	return true;
 }
 
+void QCefBrowserClient::SetPopupWindow(CefWindowInfo &windowInfo,
+				       CefRefPtr<CefClient> &client)
+{
+#ifdef _WIN32
+	HWND hwnd = (HWND)widget->effectiveWinId();
+	windowInfo.parent_window = hwnd;
+#endif
+
+	/* popups of windowless panels would inherit windowless rendering and
+	 * paint over the panel, so they get a real window of their own */
+	if (view) {
+#ifdef _WIN32
+		windowInfo.SetAsPopup(hwnd, CefString());
+#endif
+		windowInfo.windowless_rendering_enabled = false;
+		client = new QCefBrowserClient(widget, script, allowAllPopups);
+	}
+}
+
 void QCefBrowserClient::OnLoadEnd(CefRefPtr<CefBrowser>,
 				  CefRefPtr<CefFrame> frame, int)
 {
@@ -209,3 +308,96 @@ bool QCefBrowserClient::OnPreKeyEvent(CefRefPtr<CefBrowser> browser,
 #endif
 	return false;
 }
+
+/* CefRenderHandler */
+#if CHROME_VERSION_BUILD >= 3578
+void QCefBrowserClient::GetViewRect(
+#else
+bool QCefBrowserClient::GetViewRect(
+#endif
+	CefRefPtr<CefBrowser>, CefRect &rect)
+{
+	std::lock_guard<std::mutex> lock(view->mutex);
+	rect.Set(0, 0, view->width, view->height);
+#if CHROME_VERSION_BUILD < 3578
+	return true;
+#endif
+}
+
+bool QCefBrowserClient::GetScreenInfo(CefRefPtr<CefBrowser>,
+				      CefScreenInfo &screen_info)
+{
+	std::lock_guard<std::mutex> lock(view->mutex);
+	screen_info.device_scale_factor = (float)view->scale;
+	screen_info.depth = 24;
+	screen_info.depth_per_component = 8;
+	screen_info.is_monochrome = false;
+	screen_info.rect.Set(0, 0, view->width, view->height);
+	screen_info.available_rect = screen_info.rect;
+	return true;
+}
+
+void QCefBrowserClient::OnPopupShow(CefRefPtr<CefBrowser>, bool show)
+{
+	std::lock_guard<std::mutex> lock(view->mutex);
+	view->popup_visible = show;
+	if (!show)
+		view->popup = QImage();
+	UpdateView();
+}
+
+void QCefBrowserClient::OnPopupSize(CefRefPtr<CefBrowser>,
+				    const CefRect &rect)
+{
+	std::lock_guard<std::mutex> lock(view->mutex);
+	view->popup_rect = QRect(rect.x, rect.y, rect.width, rect.height);
+}
+
+void QCefBrowserClient::OnPaint(CefRefPtr<CefBrowser>, PaintElementType type,
+				const RectList &dirtyRects, const void *buffer,
+				int width, int height)
+{
+	std::lock_guard<std::mutex> lock(view->mutex);
+
+	QImage &image = type == PET_POPUP ? view->popup : view->image;
+	const uint8_t *src = (const uint8_t *)buffer;
+	const size_t pitch = (size_t)width * 4;
+
+	/* only the dirty parts of the view are copied, unless the image has
+	 * to be reallocated */
+	if (image.width() != width || image.height() != height) {
+		image = QImage(width, height,
+			       QImage::Format_ARGB32_Premultiplied);
+		for (int y = 0; y < height; y++)
+			memcpy(image.scanLine(y), src + y * pitch, pitch);
+	} else {
+		for (const CefRect &rect : dirtyRects) {
+			int x0 = std::max(rect.x, 0);
+			int y0 = std::max(rect.y, 0);
+			int x1 = std::min(rect.x + rect.width, width);
+			int y1 = std::min(rect.y + rect.height, height);
+			if (x1 <= x0 || y1 <= y0)
+				continue;
+
+			for (int y = y0; y < y1; y++)
+				memcpy(image.scanLine(y) + x0 * 4,
+				       src + y * pitch + x0 * 4,
+				       (size_t)(x1 - x0) * 4);
+		}
+	}
+
+	image.setDevicePixelRatio(view->scale);
+	UpdateView();
+}
+
+/* called with the view locked.  the widget only needs to be told once
+ * until it has drawn the view again. */
+void QCefBrowserClient::UpdateView()
+{
+	if (view->update_pending || !view->widget)
+		return;
+
+	view->update_pending = true;
+	QMetaObject::invokeMethod(view->widget, "update",
+				  Qt::QueuedConnection);
+}
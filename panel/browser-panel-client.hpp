@@ -3,6 +3,7 @@
 #include "cef-headers.hpp"
 #include "browser-panel-internal.hpp"
 
+#include <memory>
 #include <string>
 
 class QCefBrowserClient : public CefClient,
@@ -10,15 +11,18 @@ class QCefBrowserClient : public CefClient,
 			  public CefRequestHandler,
 			  public CefLifeSpanHandler,
 			  public CefLoadHandler,
-			  public CefKeyboardHandler {
+			  public CefKeyboardHandler,
+			  public CefRenderHandler {
 
 public:
-	inline QCefBrowserClient(QCefWidgetInternal *widget_,
-				 const std::string &script_,
-				 bool allowAllPopups_)
+	inline QCefBrowserClient(
+		QCefWidgetInternal *widget_, const std::string &script_,
+		bool allowAllPopups_,
+		std::shared_ptr<QCefPanelView> view_ = nullptr)
 		: widget(widget_),
 		  script(script_),
-		  allowAllPopups(allowAllPopups_)
+		  allowAllPopups(allowAllPopups_),
+		  view(view_)
 	{
 	}
 
@@ -28,10 +32,17 @@ public:
 	virtual CefRefPtr<CefRequestHandler> GetRequestHandler() override;
 	virtual CefRefPtr<CefLifeSpanHandler> GetLifeSpanHandler() override;
 	virtual CefRefPtr<CefKeyboardHandler> GetKeyboardHandler() override;
+	virtual CefRefPtr<CefRenderHandler> GetRenderHandler() override;
 
 	/* CefDisplayHandler */
 	virtual void OnTitleChange(CefRefPtr<CefBrowser> browser,
 				   const CefString &title) override;
+#if CHROME_VERSION_BUILD >= 4183
+	virtual bool
+	OnCursorChange(CefRefPtr<CefBrowser> browser, CefCursorHandle cursor,
+		       cef_cursor_type_t type,
+		       const CefCursorInfo &custom_cursor_info) override;
+#endif
 
 	/* CefRequestHandler */
 	virtual bool OnBeforeBrowse(CefRefPtr<CefBrowser> browser,
@@ -76,9 +87,32 @@ public:
 				   CefEventHandle os_event,
 				   bool *is_keyboard_shortcut) override;
 
+	/* CefRenderHandler, only used by windowless panels */
+#if CHROME_VERSION_BUILD >= 3578
+	virtual void GetViewRect(
+#else
+	virtual bool GetViewRect(
+#endif
+		CefRefPtr<CefBrowser> browser, CefRect &rect) override;
+	virtual bool GetScreenInfo(CefRefPtr<CefBrowser> browser,
+				   CefScreenInfo &screen_info) override;
+	virtual void OnPopupShow(CefRefPtr<CefBrowser> browser,
+				 bool show) override;
+	virtual void OnPopupSize(CefRefPtr<CefBrowser> browser,
+				 const CefRect &rect) override;
+	virtual void OnPaint(CefRefPtr<CefBrowser> browser,
+			     PaintElementType type, const RectList &dirtyRects,
+			     const void *buffer, int width,
+			     int height) override;
+
+	void SetPopupWindow(CefWindowInfo &windowInfo,
+			    CefRefPtr<CefClient> &client);
+	void UpdateView();
+
 	QCefWidgetInternal *widget = nullptr;
 	std::string script;
 	bool allowAllPopups;
+	std::shared_ptr<QCefPanelView> view;
 
 	IMPLEMENT_REFCOUNTING(QCefBrowserClient);
 };
@@ -2,9 +2,13 @@
 
 #include <QTimer>
 #include <QPointer>
+#include <QImage>
+#include <QRect>
 #include "browser-panel.hpp"
 #include "cef-headers.hpp"
 
+#include <functional>
+#include <memory>
 #include <vector>
 #include <mutex>
 
@@ -42,6 +46,27 @@ public:
 
 /* ------------------------------------------------------------------------- */
 
+/* The view of a windowless panel.  Its browser paints in to it on the CEF
+ * thread, and the widget draws it on the Qt thread.  Shared between the
+ * two, so the client can keep painting while the widget goes away. */
+struct QCefPanelView {
+	std::mutex mutex;
+	QWidget *widget = nullptr;
+	bool update_pending = false;
+
+	/* view size in device independent pixels */
+	int width = 1;
+	int height = 1;
+	double scale = 1.0;
+
+	QImage image;
+	QImage popup;
+	QRect popup_rect;
+	bool popup_visible = false;
+};
+
+/* ------------------------------------------------------------------------- */
+
 class QCefWidgetInternal : public QCefWidget {
 	Q_OBJECT
 
@@ -57,16 +82,38 @@ public:
 	QTimer timer;
 	bool allowAllPopups_ = false;
 
+	/* windowless panels are painted by Qt instead of being a native
+	 * child window of CEF's, see BrowserWindowlessPanels */
+	bool windowless = false;
+	std::shared_ptr<QCefPanelView> view;
+
 	virtual void resizeEvent(QResizeEvent *event) override;
 	virtual void showEvent(QShowEvent *event) override;
+	virtual void hideEvent(QHideEvent *event) override;
+	virtual void paintEvent(QPaintEvent *event) override;
 	virtual QPaintEngine *paintEngine() const override;
 
+	virtual void mousePressEvent(QMouseEvent *event) override;
+	virtual void mouseReleaseEvent(QMouseEvent *event) override;
+	virtual void mouseDoubleClickEvent(QMouseEvent *event) override;
+	virtual void mouseMoveEvent(QMouseEvent *event) override;
+	virtual void leaveEvent(QEvent *event) override;
+	virtual void wheelEvent(QWheelEvent *event) override;
+	virtual void keyPressEvent(QKeyEvent *event) override;
+	virtual void keyReleaseEvent(QKeyEvent *event) override;
+	virtual void focusInEvent(QFocusEvent *event) override;
+	virtual void focusOutEvent(QFocusEvent *event) override;
+	virtual bool focusNextPrevChild(bool next) override;
+
 	virtual void setURL(const std::string &url) override;
 	virtual void setStartupScript(const std::string &script) override;
 	virtual void allowAllPopups(bool allow) override;
 	virtual void closeBrowser() override;
 
 	void Resize();
+	void ExecuteOnBrowser(std::function<void(CefRefPtr<CefBrowser>)> func);
+	void SendMouseClick(QMouseEvent *event, bool mouse_up, int click_count);
+	void SendKey(QKeyEvent *event, bool key_up);
 
 public slots:
 	void Init();
@@ -5,20 +5,37 @@
 
 #include <QWindow>
 #include <QApplication>
+#include <QPainter>
+#include <QCursor>
+#include <QKeyEvent>
+#include <QMouseEvent>
+#include <QWheelEvent>
 
 #ifdef USE_QT_LOOP
 #include <QEventLoop>
 #include <QThread>
 #endif
 
+#ifdef __linux__
+#include "linux-keyboard-helpers.hpp"
+#endif
+
 #include <obs-module.h>
 #include <util/threading.h>
 #include <util/base.h>
+#include <unordered_map>
+#include <algorithm>
 #include <thread>
+#include <mutex>
 
 extern bool QueueCEFTask(std::function<void()> task);
 extern "C" void obs_browser_initialize(void);
 extern os_event_t *cef_started_event;
+extern bool windowless_panels;
+
+/* hidden windowless panels don't paint at all, so this only limits the
+ * ones that are visible */
+#define PANEL_FRAME_RATE 30
 
 std::mutex popup_whitelist_mutex;
 std::vector<PopupWhitelistInfo> popup_whitelist;
@@ -62,10 +79,50 @@ public:
 	IMPLEMENT_REFCOUNTING(CookieCheck);
 };
 
+#if CHROME_VERSION_BUILD >= 3770
+/* cookie managers with the same storage path share one request context,
+ * instead of each one getting a context (and network state) of its own */
+struct SharedRequestContext {
+	CefRefPtr<CefRequestContext> rc;
+	int refs;
+};
+
+static std::mutex shared_contexts_mutex;
+static std::unordered_map<std::string, SharedRequestContext> shared_contexts;
+
+static CefRefPtr<CefRequestContext> AcquireContext(const std::string &path)
+{
+	std::lock_guard<std::mutex> lock(shared_contexts_mutex);
+
+	SharedRequestContext &shared = shared_contexts[path];
+	if (!shared.rc) {
+		CefRequestContextSettings settings;
+		CefString(&settings.cache_path) = path;
+		shared.rc = CefRequestContext::CreateContext(
+			settings, CefRefPtr<CefRequestContextHandler>());
+		shared.refs = 0;
+	}
+
+	shared.refs++;
+	return shared.rc;
+}
+
+static void ReleaseContext(const std::string &path)
+{
+	std::lock_guard<std::mutex> lock(shared_contexts_mutex);
+
+	auto it = shared_contexts.find(path);
+	if (it != shared_contexts.end() && --it->second.refs <= 0)
+		shared_contexts.erase(it);
+}
+#endif
+
 struct QCefCookieManagerInternal : QCefCookieManager {
 	CefRefPtr<CefCookieManager> cm;
 #if CHROME_VERSION_BUILD < 3770
 	CefRefPtr<CefRequestContextHandler> rch;
+#else
+	std::string rc_path;
 #endif
 	CefRefPtr<CefRequestContext> rc;
 
@@ -91,10 +148,8 @@ struct QCefCookieManagerInternal : QCefCookieManager {
 		rc = CefRequestContext::CreateContext(
 			CefRequestContext::GetGlobalContext(), rch);
 #else
-		CefRequestContextSettings settings;
-		CefString(&settings.cache_path) = path.Get();
-		rc = CefRequestContext::CreateContext(
-			settings, CefRefPtr<CefRequestContextHandler>());
+		rc_path = path.Get();
+		rc = AcquireContext(rc_path);
 		if (rc)
 			cm = rc->GetCookieManager(nullptr);
 
@@ -102,6 +157,10 @@ struct QCefCookieManagerInternal : QCefCookieManager {
 #endif
 	}
 
+#if CHROME_VERSION_BUILD >= 3770
+	~QCefCookieManagerInternal() { ReleaseContext(rc_path); }
+#endif
+
 	virtual bool DeleteCookies(const std::string &url,
 				   const std::string &name) override
 	{
@@ -118,10 +177,9 @@ struct QCefCookieManagerInternal : QCefCookieManager {
 		return cm->SetStoragePath(path.Get(), persist_session_cookies,
 					  nullptr);
 #else
-		CefRequestContextSettings settings;
-		CefString(&settings.cache_path) = storage_path;
-		rc = CefRequestContext::CreateContext(
-			settings, CefRefPtr<CefRequestContextHandler>());
+		ReleaseContext(rc_path);
+		rc_path = path.Get();
+		rc = AcquireContext(rc_path);
 		if (rc)
 			cm = rc->GetCookieManager(nullptr);
 
@@ -151,20 +209,34 @@ struct QCefCookieManagerInternal : QCefCookieManager {
 
 QCefWidgetInternal::QCefWidgetInternal(QWidget *parent, const std::string &url_,
 				       CefRefPtr<CefRequestContext> rqc_)
-	: QCefWidget(parent), url(url_), rqc(rqc_)
+	: QCefWidget(parent), url(url_), rqc(rqc_), windowless(windowless_panels)
 {
-	setAttribute(Qt::WA_PaintOnScreen);
 	setAttribute(Qt::WA_StaticContents);
 	setAttribute(Qt::WA_NoSystemBackground);
 	setAttribute(Qt::WA_OpaquePaintEvent);
-	setAttribute(Qt::WA_DontCreateNativeAncestors);
-	setAttribute(Qt::WA_NativeWindow);
 
-	setFocusPolicy(Qt::ClickFocus);
+	if (windowless) {
+		view = std::make_shared<QCefPanelView>();
+		view->widget = this;
+
+		setMouseTracking(true);
+		setFocusPolicy(Qt::StrongFocus);
+	} else {
+		setAttribute(Qt::WA_PaintOnScreen);
+		setAttribute(Qt::WA_DontCreateNativeAncestors);
+		setAttribute(Qt::WA_NativeWindow);
+
+		setFocusPolicy(Qt::ClickFocus);
+	}
 }
 
 QCefWidgetInternal::~QCefWidgetInternal()
 {
+	if (view) {
+		std::lock_guard<std::mutex> lock(view->mutex);
+		view->widget = nullptr;
+	}
+
 	closeBrowser();
 }
 
@@ -216,7 +288,16 @@ void QCefWidgetInternal::closeBrowser()
 
 void QCefWidgetInternal::Init()
 {
-	WId id = winId();
+	/* windowless panels must not turn in to native windows, popups get
+	 * parented to the nearest native ancestor instead */
+	WId id = windowless ? effectiveWinId() : winId();
+
+	if (windowless) {
+		std::lock_guard<std::mutex> lock(view->mutex);
+		view->width = std::max(width(), 1);
+		view->height = std::max(height(), 1);
+		view->scale = devicePixelRatioF();
+	}
 
 	bool success = QueueCEFTask([this, id]() {
 		CefWindowInfo windowInfo;
@@ -225,20 +306,34 @@ void QCefWidgetInternal::Init()
 		if (cefBrowser)
 			return;
 
-		QSize size = this->size();
+		if (windowless) {
+			std::lock_guard<std::mutex> lock(view->mutex);
+			windowInfo.windowless_rendering_enabled = true;
+#ifdef _WIN32
+			windowInfo.parent_window = (HWND)id;
+#endif
+			windowInfo.width = view->width;
+			windowInfo.height = view->height;
+		} else {
+			QSize size = this->size();
 #ifdef _WIN32
-		size *= devicePixelRatio();
-		RECT rc = {0, 0, size.width(), size.height()};
-		windowInfo.SetAsChild((HWND)id, rc);
+			size *= devicePixelRatio();
+			RECT rc = {0, 0, size.width(), size.height()};
+			windowInfo.SetAsChild((HWND)id, rc);
 #elif __APPLE__
-		windowInfo.SetAsChild((CefWindowHandle)id, 0, 0, size.width(),
-				      size.height());
+			windowInfo.SetAsChild((CefWindowHandle)id, 0, 0,
+					      size.width(), size.height());
 #endif
+		}
 
 		CefRefPtr<QCefBrowserClient> browserClient =
-			new QCefBrowserClient(this, script, allowAllPopups_);
+			new QCefBrowserClient(this, script, allowAllPopups_,
+					      view);
 
 		CefBrowserSettings cefBrowserSettings;
+		if (windowless)
+			cefBrowserSettings.windowless_frame_rate =
+				PANEL_FRAME_RATE;
 		cefBrowser = CefBrowserHost::CreateBrowserSync(
 			windowInfo, browserClient, url, cefBrowserSettings,
 #if CHROME_VERSION_BUILD >= 3770
@@ -246,7 +341,8 @@ void QCefWidgetInternal::Init()
 #endif
 			rqc);
 #ifdef _WIN32
-		Resize();
+		if (!windowless)
+			Resize();
 #endif
 	});
 
@@ -262,6 +358,27 @@ void QCefWidgetInternal::resizeEvent(QResizeEvent *event)
 
 void QCefWidgetInternal::Resize()
 {
+	/* windowless panels never wait on CEF to resize, it asks for the new
+	 * view size once it gets to it */
+	if (windowless) {
+		bool scale_changed;
+		{
+			std::lock_guard<std::mutex> lock(view->mutex);
+			scale_changed = view->scale != devicePixelRatioF();
+			view->width = std::max(width(), 1);
+			view->height = std::max(height(), 1);
+			view->scale = devicePixelRatioF();
+		}
+
+		ExecuteOnBrowser([=](CefRefPtr<CefBrowser> cefBrowser) {
+			CefRefPtr<CefBrowserHost> host = cefBrowser->GetHost();
+			if (scale_changed)
+				host->NotifyScreenInfoChanged();
+			host->WasResized();
+		});
+		return;
+	}
+
 #ifdef _WIN32
 	QSize size = this->size() * devicePixelRatio();
 
@@ -286,12 +403,394 @@ void QCefWidgetInternal::showEvent(QShowEvent *event)
 		connect(&timer, SIGNAL(timeout()), this, SLOT(Init()));
 		timer.start(500);
 		Init();
+	} else if (windowless) {
+		ExecuteOnBrowser([](CefRefPtr<CefBrowser> cefBrowser) {
+			cefBrowser->GetHost()->WasHidden(false);
+		});
 	}
 }
 
+void QCefWidgetInternal::hideEvent(QHideEvent *event)
+{
+	QWidget::hideEvent(event);
+
+	/* hidden browsers stop painting until they're shown again */
+	if (windowless) {
+		ExecuteOnBrowser([](CefRefPtr<CefBrowser> cefBrowser) {
+			cefBrowser->GetHost()->WasHidden(true);
+		});
+	}
+}
+
+void QCefWidgetInternal::paintEvent(QPaintEvent *event)
+{
+	if (!windowless) {
+		QWidget::paintEvent(event);
+		return;
+	}
+
+	QPainter painter(this);
+	std::lock_guard<std::mutex> lock(view->mutex);
+	view->update_pending = false;
+
+	if (view->image.isNull())
+		painter.fillRect(rect(), palette().window());
+	else
+		painter.drawImage(QPoint(0, 0), view->image);
+
+	if (view->popup_visible && !view->popup.isNull())
+		painter.drawImage(view->popup_rect.topLeft(), view->popup);
+}
+
 QPaintEngine *QCefWidgetInternal::paintEngine() const
 {
-	return nullptr;
+	return windowless ? QWidget::paintEngine() : nullptr;
+}
+
+void QCefWidgetInternal::ExecuteOnBrowser(
+	std::function<void(CefRefPtr<CefBrowser>)> func)
+{
+	CefRefPtr<CefBrowser> browser = cefBrowser;
+	if (browser)
+		QueueCEFTask([browser, func]() { func(browser); });
+}
+
+/* ------------------------------------------------------------------------- */
+/* input of windowless panels                                                */
+
+static uint32_t GetModifiers(Qt::KeyboardModifiers keys,
+			     Qt::MouseButtons buttons)
+{
+	uint32_t modifiers = 0;
+	if (keys & Qt::ShiftModifier)
+		modifiers |= EVENTFLAG_SHIFT_DOWN;
+	if (keys & Qt::ControlModifier)
+		modifiers |= EVENTFLAG_CONTROL_DOWN;
+	if (keys & Qt::AltModifier)
+		modifiers |= EVENTFLAG_ALT_DOWN;
+	if (keys & Qt::KeypadModifier)
+		modifiers |= EVENTFLAG_IS_KEY_PAD;
+	if (buttons & Qt::LeftButton)
+		modifiers |= EVENTFLAG_LEFT_MOUSE_BUTTON;
+	if (buttons & Qt::MiddleButton)
+		modifiers |= EVENTFLAG_MIDDLE_MOUSE_BUTTON;
+	if (buttons & Qt::RightButton)
+		modifiers |= EVENTFLAG_RIGHT_MOUSE_BUTTON;
+	return modifiers;
+}
+
+static CefMouseEvent GetMouseEvent(const QPoint &pos,
+				   Qt::KeyboardModifiers keys,
+				   Qt::MouseButtons buttons)
+{
+	CefMouseEvent e;
+	e.x = pos.x();
+	e.y = pos.y();
+	e.modifiers = GetModifiers(keys, buttons);
+	return e;
+}
+
+void QCefWidgetInternal::SendMouseClick(QMouseEvent *event, bool mouse_up,
+					int click_count)
+{
+	CefBrowserHost::MouseButtonType type;
+	switch (event->button()) {
+	case Qt::LeftButton:
+		type = MBT_LEFT;
+		break;
+	case Qt::MiddleButton:
+		type = MBT_MIDDLE;
+		break;
+	case Qt::RightButton:
+		type = MBT_RIGHT;
+		break;
+	default:
+		return;
+	}
+
+	CefMouseEvent e = GetMouseEvent(event->pos(), event->modifiers(),
+					event->buttons());
+
+	ExecuteOnBrowser([=](CefRefPtr<CefBrowser> cefBrowser) {
+		cefBrowser->GetHost()->SendMouseClickEvent(e, type, mouse_up,
+							   click_count);
+	});
+}
+
+void QCefWidgetInternal::mousePressEvent(QMouseEvent *event)
+{
+	if (!windowless) {
+		QWidget::mousePressEvent(event);
+		return;
+	}
+
+	setFocus(Qt::MouseFocusReason);
+	SendMouseClick(event, false, 1);
+}
+
+void QCefWidgetInternal::mouseReleaseEvent(QMouseEvent *event)
+{
+	if (!windowless) {
+		QWidget::mouseReleaseEvent(event);
+		return;
+	}
+
+	SendMouseClick(event, true, 1);
+}
+
+void QCefWidgetInternal::mouseDoubleClickEvent(QMouseEvent *event)
+{
+	if (!windowless) {
+		QWidget::mouseDoubleClickEvent(event);
+		return;
+	}
+
+	SendMouseClick(event, false, 2);
+}
+
+void QCefWidgetInternal::mouseMoveEvent(QMouseEvent *event)
+{
+	if (!windowless) {
+		QWidget::mouseMoveEvent(event);
+		return;
+	}
+
+	CefMouseEvent e = GetMouseEvent(event->pos(), event->modifiers(),
+					event->buttons());
+
+	ExecuteOnBrowser([e](CefRefPtr<CefBrowser> cefBrowser) {
+		cefBrowser->GetHost()->SendMouseMoveEvent(e, false);
+	});
+}
+
+void QCefWidgetInternal::leaveEvent(QEvent *event)
+{
+	QWidget::leaveEvent(event);
+
+	if (windowless) {
+		CefMouseEvent e =
+			GetMouseEvent(mapFromGlobal(QCursor::pos()),
+				      QApplication::keyboardModifiers(),
+				      QApplication::mouseButtons());
+
+		ExecuteOnBrowser([e](CefRefPtr<CefBrowser> cefBrowser) {
+			cefBrowser->GetHost()->SendMouseMoveEvent(e, true);
+		});
+	}
+}
+
+void QCefWidgetInternal::wheelEvent(QWheelEvent *event)
+{
+	if (!windowless) {
+		QWidget::wheelEvent(event);
+		return;
+	}
+
+	CefMouseEvent e = GetMouseEvent(event->position().toPoint(),
+					event->modifiers(), event->buttons());
+	QPoint delta = event->angleDelta();
+
+	ExecuteOnBrowser([e, delta](CefRefPtr<CefBrowser> cefBrowser) {
+		cefBrowser->GetHost()->SendMouseWheelEvent(e, delta.x(),
+							   delta.y());
+	});
+}
+
+#ifdef __APPLE__
+/* native virtual keys are Carbon key codes on macOS, which don't say what
+ * the key means in the current layout.  Qt's key does, and maps on to the
+ * Windows key codes CEF wants. */
+static int KeyboardCodeFromQtKey(int key)
+{
+	if ((key >= Qt::Key_0 && key <= Qt::Key_9) ||
+	    (key >= Qt::Key_A && key <= Qt::Key_Z))
+		return key;
+	if (key >= Qt::Key_F1 && key <= Qt::Key_F24)
+		return 0x70 + (key - Qt::Key_F1);
+
+	switch (key) {
+	case Qt::Key_Backspace:
+		return 0x08;
+	case Qt::Key_Tab:
+	case Qt::Key_Backtab:
+		return 0x09;
+	case Qt::Key_Clear:
+		return 0x0C;
+	case Qt::Key_Return:
+	case Qt::Key_Enter:
+		return 0x0D;
+	case Qt::Key_Shift:
+		return 0x10;
+	case Qt::Key_Control:
+		return 0x11;
+	case Qt::Key_Alt:
+		return 0x12;
+	case Qt::Key_Pause:
+		return 0x13;
+	case Qt::Key_CapsLock:
+		return 0x14;
+	case Qt::Key_Escape:
+		return 0x1B;
+	case Qt::Key_Space:
+		return 0x20;
+	case Qt::Key_PageUp:
+		return 0x21;
+	case Qt::Key_PageDown:
+		return 0x22;
+	case Qt::Key_End:
+		return 0x23;
+	case Qt::Key_Home:
+		return 0x24;
+	case Qt::Key_Left:
+		return 0x25;
+	case Qt::Key_Up:
+		return 0x26;
+	case Qt::Key_Right:
+		return 0x27;
+	case Qt::Key_Down:
+		return 0x28;
+	case Qt::Key_Insert:
+		return 0x2D;
+	case Qt::Key_Delete:
+		return 0x2E;
+	case Qt::Key_Help:
+		return 0x2F;
+	case Qt::Key_Meta:
+		return 0x5B;
+	case Qt::Key_NumLock:
+		return 0x90;
+	case Qt::Key_ScrollLock:
+		return 0x91;
+	case Qt::Key_Semicolon:
+	case Qt::Key_Colon:
+		return 0xBA;
+	case Qt::Key_Equal:
+	case Qt::Key_Plus:
+		return 0xBB;
+	case Qt::Key_Comma:
+	case Qt::Key_Less:
+		return 0xBC;
+	case Qt::Key_Minus:
+	case Qt::Key_Underscore:
+		return 0xBD;
+	case Qt::Key_Period:
+	case Qt::Key_Greater:
+		return 0xBE;
+	case Qt::Key_Slash:
+	case Qt::Key_Question:
+		return 0xBF;
+	case Qt::Key_QuoteLeft:
+	case Qt::Key_AsciiTilde:
+		return 0xC0;
+	case Qt::Key_BracketLeft:
+	case Qt::Key_BraceLeft:
+		return 0xDB;
+	case Qt::Key_Backslash:
+	case Qt::Key_Bar:
+		return 0xDC;
+	case Qt::Key_BracketRight:
+	case Qt::Key_BraceRight:
+		return 0xDD;
+	case Qt::Key_Apostrophe:
+	case Qt::Key_QuoteDbl:
+		return 0xDE;
+	}
+	return 0;
+}
+#endif
+
+void QCefWidgetInternal::SendKey(QKeyEvent *event, bool key_up)
+{
+	CefKeyEvent e;
+	e.type = key_up ? KEYEVENT_KEYUP : KEYEVENT_RAWKEYDOWN;
+	e.modifiers = GetModifiers(event->modifiers(), Qt::NoButton);
+#ifdef _WIN32
+	e.windows_key_code = (int)event->nativeVirtualKey();
+
+	/* CEF wants the lParam of the key message on Windows */
+	uint32_t lparam = 1 | ((event->nativeScanCode() & 0x1FF) << 16);
+	if (key_up)
+		lparam |= 0xC0000000;
+	e.native_key_code = (int)lparam;
+#elif defined(__APPLE__)
+	e.windows_key_code = KeyboardCodeFromQtKey(event->key());
+	/* and the Carbon key code */
+	e.native_key_code = (int)event->nativeVirtualKey();
+#else
+	/* native virtual keys are X keysyms */
+	e.windows_key_code =
+		(int)KeyboardCodeFromXKeysym(event->nativeVirtualKey());
+	e.native_key_code = (int)event->nativeScanCode();
+#endif
+
+	std::vector<CefKeyEvent> events = {e};
+
+	if (!key_up) {
+		for (QChar c : event->text()) {
+			CefKeyEvent ch = e;
+			ch.type = KEYEVENT_CHAR;
+			ch.windows_key_code = c.unicode();
+			ch.character = c.unicode();
+			ch.unmodified_character = c.unicode();
+			events.push_back(ch);
+		}
+	}
+
+	ExecuteOnBrowser([events](CefRefPtr<CefBrowser> cefBrowser) {
+		for (const CefKeyEvent &e : events)
+			cefBrowser->GetHost()->SendKeyEvent(e);
+	});
+}
+
+void QCefWidgetInternal::keyPressEvent(QKeyEvent *event)
+{
+	if (!windowless) {
+		QWidget::keyPressEvent(event);
+		return;
+	}
+
+	SendKey(event, false);
+}
+
+void QCefWidgetInternal::keyReleaseEvent(QKeyEvent *event)
+{
+	if (!windowless) {
+		QWidget::keyReleaseEvent(event);
+		return;
+	}
+
+	SendKey(event, true);
+}
+
+void QCefWidgetInternal::focusInEvent(QFocusEvent *event)
+{
+	QWidget::focusInEvent(event);
+
+	if (windowless) {
+		ExecuteOnBrowser([](CefRefPtr<CefBrowser> cefBrowser) {
+			cefBrowser->GetHost()->SetFocus(true);
+		});
+	}
+}
+
+void QCefWidgetInternal::focusOutEvent(QFocusEvent *event)
+{
+	QWidget::focusOutEvent(event);
+
+	if (windowless) {
+		ExecuteOnBrowser([](CefRefPtr<CefBrowser> cefBrowser) {
+			cefBrowser->GetHost()->SetFocus(false);
+		});
+	}
+}
+
+bool QCefWidgetInternal::focusNextPrevChild(bool next)
+{
+	/* tab moves focus within the page, not out of the panel */
+	if (windowless)
+		return false;
+
+	return QWidget::focusNextPrevChild(next);
 }
 
 void QCefWidgetInternal::setURL(const std::string &url_)